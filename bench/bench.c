@@ -0,0 +1,266 @@
+/* bench: time each phase of tfortune's work on a tree of fortune files */
+
+/* Build on tfortune's own functions, with its main() out of the way. */
+#define main tfortune_main
+#include "../tfortune.c"
+#undef main
+
+#include <ftw.h>
+
+/* A set of timings of one phase, in seconds. */
+typedef struct Samples {
+	double* t;
+	size_t count;
+	size_t capacity;
+} Samples;
+
+/* The steps timed, in the order they're reported. */
+enum { STEP_WALK, STEP_ADD, STEP_SELECT, STEP_LIST, NUM_STEPS };
+const char* step_names[NUM_STEPS] = { "walk", "add", "select", "list" };
+
+double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+unsigned char Samples_add(Samples* s, double t)
+{
+	double* new_t;
+
+	if (s->count == s->capacity) {
+		s->capacity = (s->capacity + 8) * 2;
+		if ((new_t = realloc(s->t, s->capacity * sizeof(double))) == NULL) {
+			fputs("Cannot allocate memory for timings.\n", stderr);
+			return 0;
+		}
+		s->t = new_t;
+	}
+	s->t[s->count++] = t;
+	return 1;
+}
+
+int double_compare(const void* a, const void* b)
+{
+	double p = *(const double*) a;
+	double q = *(const double*) b;
+
+	return (p < q) ? -1 : (p > q);
+}
+
+/* The `pct`th percentile of the sorted samples `s`, by nearest rank. */
+double Samples_percentile(const Samples* s, double pct)
+{
+	size_t rank = (size_t) (pct / 100.0 * s->count + 0.999999);
+
+	return s->t[(rank ? rank : 1) - 1];
+}
+
+void Samples_report(Samples* s, const char* phase, const char* cache,
+                    FILE* fh)
+{
+	if (!s->count) {
+		return;
+	}
+	qsort(s->t, s->count, sizeof(double), double_compare);
+	fprintf(fh, "%-8s %-6s %7lu %10.3f %10.3f %10.3f %10.3f\n", phase, cache,
+	        (unsigned long) s->count, 1e3 * Samples_percentile(s, 50),
+	        1e3 * Samples_percentile(s, 90), 1e3 * Samples_percentile(s, 99),
+	        1e3 * s->t[s->count - 1]);
+}
+
+int evict_file(const char* path, const struct stat* info, int type,
+               struct FTW* ftw)
+{
+	int fd;
+
+	(void) info;
+	(void) ftw;
+	if ((type == FTW_F) && ((fd = open(path, O_RDONLY)) >= 0)) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+	return 0;
+}
+
+/* Push the tree at `path` out of the page cache: all of the kernel's
+   caches if we're allowed to drop them, or else just the files' data,
+   which leaves the kernel's directory entries and inodes warm. */
+void evict(const char* path)
+{
+	int fd;
+
+	sync();
+	if ((fd = open("/proc/sys/vm/drop_caches", O_WRONLY)) >= 0) {
+		if (write(fd, "3\n", 2) == 2) {
+			close(fd);
+			return;
+		}
+		close(fd);
+	}
+	nftw(path, evict_file, 64, FTW_PHYS);
+}
+
+/* Time one run of every phase on the tree at `path`, adding the times
+   to `samples`. Cookies and listings go to standard output, which the
+   caller's pointed somewhere harmless. */
+unsigned char bench_run(const char* path, const WalkOptions* wopts,
+                        unsigned char cold, unsigned int num_selections,
+                        Samples* samples)
+{
+	Jars added;
+	unsigned int jar_no;
+	Jars js;
+	Options opts;
+	unsigned char ok = 0;
+	char* path_buf = NULL;
+	size_t path_buf_size = 0;
+	unsigned int selection_no;
+	double t;
+
+	memset(&opts, 0, sizeof(Options));
+	if (!Jars_init(&js, 99) || !Jars_init(&added, js.capacity)) {
+		return 0;
+	}
+
+	/* Traversal, which includes adding each jar found. */
+	if (cold) {
+		evict(path);
+	}
+	t = now();
+	walk_for_fortune_files(path, &js, NULL, wopts);
+	if (!Samples_add(&samples[STEP_WALK], now() - t)) {
+		goto done;
+	}
+	if (!js.num_fortunes) {
+		fprintf(stderr, "No fortune cookies found under %s.\n", path);
+		goto done;
+	}
+
+	/* Adding the jars found again, on their own, one after another. */
+	if (cold) {
+		evict(path);
+	}
+	t = now();
+	for (jar_no = 0; jar_no < js.count; jar_no++) {
+		if (Jar_path(&(js.j[jar_no]), ".dat", &path_buf, &path_buf_size)
+		    != NULL) {
+			Jars_add(&added, path_buf);
+		}
+	}
+	if (!Samples_add(&samples[STEP_ADD], now() - t)) {
+		goto done;
+	}
+
+	/* Choosing and writing a cookie. Only the first selection after
+	   eviction is cold, so a cold run makes just one. */
+	if (!Jars_build_alias(&js)) {
+		goto done;
+	}
+	if (cold) {
+		evict(path);
+		num_selections = 1;
+	}
+	for (selection_no = 0; selection_no < num_selections; selection_no++) {
+		t = now();
+		Jars_fortune(&js, opts);
+		if (!Samples_add(&samples[STEP_SELECT], now() - t)) {
+			goto done;
+		}
+	}
+
+	/* Listing. */
+	t = now();
+	Jars_list(&js, 0, 0);
+	fflush(stdout);
+	if (!Samples_add(&samples[STEP_LIST], now() - t)) {
+		goto done;
+	}
+	ok = 1;
+
+done:
+	free(path_buf);
+	Jars_free(&js);
+	Jars_free(&added);
+	return ok;
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned char cold;
+	int getopt_option;
+	int null_fd;
+	unsigned int num_runs = 20;
+	unsigned int num_selections = 100;
+	unsigned int step;
+	FILE* report;
+	unsigned int run_no;
+	Samples samples[2][NUM_STEPS];
+	unsigned char skip_cold = 0;
+	WalkOptions wopts;
+
+	/* The walk's timed in full, so it mustn't sample (see WalkOptions). */
+	memset(&wopts, 0, sizeof(WalkOptions));
+	wopts.threads = default_walk_threads();
+	wopts.uring = 1;
+	while ((getopt_option = getopt(argc, argv, "Cj:Ln:r:U")) != -1) {
+		switch (getopt_option) {
+		case 'C': skip_cold = 1; break;
+		case 'j': wopts.threads = atoi(optarg); break;
+		case 'L': wopts.lazy = 1; break;
+		case 'n': num_selections = atoi(optarg); break;
+		case 'r': num_runs = atoi(optarg); break;
+		case 'U': wopts.uring = 0; break;
+		default:
+			fprintf(stderr, "Usage: %s [-CLU] [-j threads] [-n selections] "
+			        "[-r runs] path\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "Usage: %s [-CLU] [-j threads] [-n selections] "
+		        "[-r runs] path\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* Keep the real standard output for the report, and send the
+	   cookies and listings to /dev/null. */
+	if (((report = fdopen(dup(STDOUT_FILENO), "w")) == NULL)
+	    || ((null_fd = open("/dev/null", O_WRONLY)) < 0)
+	    || (dup2(null_fd, STDOUT_FILENO) < 0)) {
+		fputs("Cannot redirect standard output.\n", stderr);
+		return EXIT_FAILURE;
+	}
+	close(null_fd);
+	Rng_seed(&rng, time(NULL) ^ getpid());
+	memset(samples, 0, sizeof(samples));
+
+	/* Warm the cache with a run that isn't counted, then do all the warm
+	   runs before any cold one disturbs the cache. */
+	bench_run(argv[optind], &wopts, 0, 1, samples[0]);
+	for (step = 0; step < NUM_STEPS; step++) {
+		samples[0][step].count = 0;
+	}
+	for (cold = 0; cold <= !skip_cold; cold++) {
+		for (run_no = 0; run_no < num_runs; run_no++) {
+			if (!bench_run(argv[optind], &wopts, cold, num_selections,
+			               samples[cold])) {
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	fprintf(report, "%-8s %-6s %7s %10s %10s %10s %10s\n", "step", "cache",
+	        "samples", "p50 ms", "p90 ms", "p99 ms", "max ms");
+	for (step = 0; step < NUM_STEPS; step++) {
+		for (cold = 0; cold <= !skip_cold; cold++) {
+			Samples_report(&samples[cold][step], step_names[step],
+			               cold ? "cold" : "warm", report);
+			free(samples[cold][step].t);
+		}
+	}
+	fclose(report);
+	return EXIT_SUCCESS;
+}
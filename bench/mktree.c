@@ -0,0 +1,224 @@
+/* mktree: make a synthetic tree of fortune files for benchmarking */
+
+#include <arpa/inet.h>  /* for uint32_t & htonl */
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* What kind of tree to make. Every directory, at every level, gets
+   `jars_per_dir` jars, and every directory above the bottom level gets
+   `fanout` subdirectories. */
+typedef struct TreeShape {
+	unsigned int depth;
+	unsigned int fanout;
+	unsigned int jars_per_dir;
+	unsigned int cookies_per_jar;
+	unsigned int min_cookie_len;
+	unsigned int max_cookie_len;
+} TreeShape;
+
+/* A little xorshift generator, so the same seed makes the same tree
+   whatever the C library. */
+uint64_t rng_state = 88172645463325252ULL;
+
+uint64_t rng_next(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+unsigned int rng_between(unsigned int lo, unsigned int hi)
+{
+	return lo + (unsigned int) (rng_next() % ((uint64_t) hi - lo + 1));
+}
+
+/* Write a fortune file of `shape->cookies_per_jar` cookies of words and
+   spaces, broken into lines, at `path`, and its dat file alongside it
+   as strfile would write it. */
+unsigned char write_jar(const char* path, const TreeShape* shape)
+{
+	char* dat_path;
+	FILE* dat;
+	unsigned int cookie_no;
+	unsigned int i;
+	unsigned int len;
+	unsigned int line_len;
+	unsigned int max_len = 0;
+	unsigned int min_len = 0;
+	uint32_t* offsets;
+	FILE* text;
+	uint32_t word;
+
+	if ((offsets = malloc((shape->cookies_per_jar + 1)
+	                      * sizeof(uint32_t))) == NULL) {
+		fputs("Cannot allocate memory for cookie offsets.\n", stderr);
+		return 0;
+	}
+	if ((text = fopen(path, "w")) == NULL) {
+		fprintf(stderr, "Cannot create fortune file %s.\n", path);
+		free(offsets);
+		return 0;
+	}
+
+	/* Each cookie's a run of lowercase letters with a space or newline
+	   now and then, ending with a newline, then a delimiter line. */
+	offsets[0] = 0;
+	for (cookie_no = 0; cookie_no < shape->cookies_per_jar; cookie_no++) {
+		len = rng_between(shape->min_cookie_len, shape->max_cookie_len);
+		line_len = 0;
+		for (i = 0; i + 1 < len; i++) {
+			if ((line_len > 60) || ((line_len > 8) && !(rng_next() % 40))) {
+				putc('\n', text);
+				line_len = 0;
+			} else if (!(rng_next() % 6)) {
+				putc(' ', text);
+				line_len++;
+			} else {
+				putc('a' + rng_next() % 26, text);
+				line_len++;
+			}
+		}
+		fputs("\n%\n", text);
+		offsets[cookie_no + 1] = offsets[cookie_no] + len + 2;
+		if (len > max_len) {
+			max_len = len;
+		}
+		if (!cookie_no || (len < min_len)) {
+			min_len = len;
+		}
+	}
+	if (fclose(text)) {
+		fprintf(stderr, "Cannot write fortune file %s.\n", path);
+		free(offsets);
+		return 0;
+	}
+
+	if ((dat_path = malloc(strlen(path) + 5)) == NULL) {
+		fputs("Cannot allocate memory for data file path.\n", stderr);
+		free(offsets);
+		return 0;
+	}
+	sprintf(dat_path, "%s.dat", path);
+	if ((dat = fopen(dat_path, "wb")) == NULL) {
+		fprintf(stderr, "Cannot create fortune data file %s.\n", dat_path);
+		free(dat_path);
+		free(offsets);
+		return 0;
+	}
+	word = htonl(2);  /* version */
+	fwrite(&word, sizeof(uint32_t), 1, dat);
+	word = htonl(shape->cookies_per_jar);
+	fwrite(&word, sizeof(uint32_t), 1, dat);
+	word = htonl(max_len);
+	fwrite(&word, sizeof(uint32_t), 1, dat);
+	word = htonl(min_len);
+	fwrite(&word, sizeof(uint32_t), 1, dat);
+	word = 0;  /* flags */
+	fwrite(&word, sizeof(uint32_t), 1, dat);
+	fwrite("%\0\0\0", 4, 1, dat);
+	for (i = 0; i <= shape->cookies_per_jar; i++) {
+		word = htonl(offsets[i]);
+		fwrite(&word, sizeof(uint32_t), 1, dat);
+	}
+	if (fclose(dat)) {
+		fprintf(stderr, "Cannot write fortune data file %s.\n", dat_path);
+		free(dat_path);
+		free(offsets);
+		return 0;
+	}
+	free(dat_path);
+	free(offsets);
+	return 1;
+}
+
+/* Fill the directory `dir` with jars, and subdirectories filled in turn
+   down to `levels_left` levels further. */
+unsigned char make_dir(const char* dir, unsigned int levels_left,
+                       const TreeShape* shape, unsigned long* num_jars)
+{
+	unsigned int i;
+	char* path;
+
+	if (mkdir(dir, 0777) && (errno != EEXIST)) {
+		fprintf(stderr, "Cannot create directory %s.\n", dir);
+		return 0;
+	}
+	if ((path = malloc(strlen(dir) + 16)) == NULL) {
+		fputs("Cannot allocate memory for path.\n", stderr);
+		return 0;
+	}
+	for (i = 0; i < shape->jars_per_dir; i++) {
+		sprintf(path, "%s/jar%u", dir, i);
+		if (!write_jar(path, shape)) {
+			free(path);
+			return 0;
+		}
+		(*num_jars)++;
+	}
+	if (levels_left) {
+		for (i = 0; i < shape->fanout; i++) {
+			sprintf(path, "%s/dir%u", dir, i);
+			if (!make_dir(path, levels_left - 1, shape, num_jars)) {
+				free(path);
+				return 0;
+			}
+		}
+	}
+	free(path);
+	return 1;
+}
+
+int main(int argc, char* argv[])
+{
+	int getopt_option;
+	unsigned long num_jars = 0;
+	TreeShape shape;
+
+	shape.depth = 2;
+	shape.fanout = 4;
+	shape.jars_per_dir = 8;
+	shape.cookies_per_jar = 100;
+	shape.min_cookie_len = 20;
+	shape.max_cookie_len = 400;
+
+	while ((getopt_option = getopt(argc, argv, "b:c:d:j:r:s:S:")) != -1) {
+		switch (getopt_option) {
+		case 'b': shape.fanout = atoi(optarg); break;
+		case 'c': shape.cookies_per_jar = atoi(optarg); break;
+		case 'd': shape.depth = atoi(optarg); break;
+		case 'j': shape.jars_per_dir = atoi(optarg); break;
+		case 'r': rng_state = strtoull(optarg, NULL, 10) | 1; break;
+		case 's': shape.min_cookie_len = atoi(optarg); break;
+		case 'S': shape.max_cookie_len = atoi(optarg); break;
+		default:
+			fprintf(stderr, "Usage: %s [-b fanout] [-c cookies] [-d depth] "
+			        "[-j jars] [-r seed] [-s min] [-S max] dir\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "Usage: %s [-b fanout] [-c cookies] [-d depth] "
+		        "[-j jars] [-r seed] [-s min] [-S max] dir\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (shape.min_cookie_len < 1) {
+		shape.min_cookie_len = 1;
+	}
+	if (shape.max_cookie_len < shape.min_cookie_len) {
+		shape.max_cookie_len = shape.min_cookie_len;
+	}
+
+	if (!make_dir(argv[optind], shape.depth, &shape, &num_jars)) {
+		return EXIT_FAILURE;
+	}
+	printf("Made %lu jars of %u cookies under %s.\n", num_jars,
+	       shape.cookies_per_jar, argv[optind]);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,78 @@
+/* libtfortune: draw fortune cookies in-process, from any number of
+   threads at once */
+
+#ifndef LIBTFORTUNE_H
+#define LIBTFORTUNE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Only the functions marked TF_API are exported from the library,
+   shared or static; the rest of tfortune's functions stay inside it. */
+#define TF_API __attribute__((visibility("default")))
+
+/* Flags for TfCorpus_open(). Like fortune, a corpus leaves out
+   offensive fortune files unless TF_ALL (like tfortune's -a) or
+   TF_OFFENSIVE (like -o) is given, and TF_EQUAL (like -e) makes every
+   fortune file equally likely to be chosen, whatever its size. */
+#define TF_ALL 0x1
+#define TF_OFFENSIVE 0x2
+#define TF_EQUAL 0x4
+
+/* The fortune files found under some paths, ready to draw cookies
+   from. A corpus isn't changed once it's open, so any number of threads
+   may draw from it at once. */
+typedef struct TfCorpus TfCorpus;
+
+/* The state of a pseudorandom number generator. Each thread drawing
+   cookies keeps its own, so draws share nothing but the corpus. */
+typedef struct TfRng {
+	uint64_t s[4];
+} TfRng;
+
+/* A cookie drawn from a corpus: `len` bytes of text at `text`, followed
+   by a NUL, from the fortune file whose path is `dir` followed by
+   `name`. The text is in `buf`, which belongs to the cookie and is
+   reused by the next draw into it; `dir` and `name` belong to the
+   corpus. Zero a cookie before its first draw, and free it with
+   TfCookie_free(). */
+typedef struct TfCookie {
+	const char* text;
+	size_t len;
+	const char* dir;
+	const char* name;
+	char* buf;
+	size_t buf_size;
+} TfCookie;
+
+/* A function to pass each of the library's error messages to (with
+   the `arg` given alongside it), instead of writing it to standard
+   error. */
+typedef void (*TfReportFn)(const char* message, void* arg);
+
+/* Send error messages to `fn`, or back to standard error if it's NULL.
+   This affects every thread, so set it up before opening a corpus. */
+TF_API void tf_set_report(TfReportFn fn, void* arg);
+
+/* Find the fortune files under each of the `num_paths` paths in
+   `paths` (or in tfortune's default directory, if there are none), and
+   make a corpus of them. Return NULL, having reported why, if there
+   are no cookies to draw from them. */
+TF_API TfCorpus* TfCorpus_open(const char* const* paths,
+                               unsigned int num_paths, unsigned int flags);
+
+/* How many cookies `corpus` has. */
+TF_API unsigned long TfCorpus_count(const TfCorpus* corpus);
+
+TF_API void TfRng_seed(TfRng* r, uint64_t seed);
+
+/* Draw a cookie at random from `corpus` into `cookie`, with `r`.
+   Return 1 if it could be read, or else 0, having reported why. */
+TF_API unsigned char TfCorpus_draw(const TfCorpus* corpus, TfRng* r,
+                                   TfCookie* cookie);
+
+TF_API void TfCookie_free(TfCookie* cookie);
+
+TF_API void TfCorpus_close(TfCorpus* corpus);
+
+#endif
@@ -1,72 +1,1080 @@
 /* tfortune: fortune with recursive directory traversal */
 
+#define _GNU_SOURCE  /* for accept4() */
+
 #include <arpa/inet.h>  /* for uint32_t & htonl */
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/file.h>  /* for flock() */
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>  /* for io_uring, which glibc doesn't wrap */
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <ctype.h>
 #include <dirent.h>
-#include <limits.h>  /* for NAME_MAX */
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>  /* for ULONG_MAX */
+#include <math.h>  /* for log(), to sample jars while walking */
+#include <pthread.h>
+#include <regex.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>  /* for time(), to seed rand() */
+#include <time.h>  /* for time(), to seed the PRNG */
 #include <unistd.h>
+#include <zlib.h>
+
+#include "libtfortune.h"
+#if defined(__x86_64__) && defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #define DEFAULT_FORTUNE_FILE_DIR "/usr/share/games/fortunes/dt/"
 
+/* The longest a fortune cookie can be and still count as short for -s
+   and -l, unless -n says otherwise; fortune's default. */
+#define DEFAULT_SHORT_LEN 160
+
 #define STRFILE_HEADER_SIZE ((5 * sizeof(uint32_t)) + 1)
 
-typedef struct Dire {
-	DIR* d;
-	struct dirent* en;
-} Dire;
+/* The header as strfile writes it, with the delimiter padded out to a
+   whole word, and the header's version number. */
+#define STRFILE_HEADER_SPACE (6 * sizeof(uint32_t))
+#define STRFILE_VERSION 2
+
+/* A wide dat file, which tfortune writes for fortune files too big for
+   a classic dat file's 32-bit offsets, has the same header, but with
+   its own version number and the delimiter padded by only one byte,
+   followed by 64-bit offsets. Its size is then never a whole number of
+   words, as a classic dat file's is, so -L can tell the two apart. */
+#define STRFILE_WIDE_HEADER_SPACE (5 * sizeof(uint32_t) + 2)
+#define STRFILE_VERSION_WIDE 0x74660040  /* "tf", then 64 */
+
+/* The flags in a strfile header. STR_RANDOM and STR_ORDERED mean the
+   offsets have been shuffled or sorted by their cookies' text, so they
+   aren't in the order of the text; STR_ROTATED means the text is rot13
+   encoded; STR_COMMENTS means lines starting with two delimiters are
+   comments, not part of their cookies. */
+#define STR_RANDOM 0x1
+#define STR_ORDERED 0x2
+#define STR_ROTATED 0x4
+#define STR_COMMENTS 0x8
+
+/* The delimiter strfile assumes by default, and so the one tfortune's
+   own indexer looks for. */
+#define STRFILE_DEFAULT_DELIM '%'
+
+/* The first bytes of a jar catalog file. Bump the digits whenever the
+   layout of CatHeader, CatDir or CatEnt changes. */
+#define CATALOG_MAGIC "tfcat009"
+
+/* The first bytes of a pack of jars written by -P. */
+#define PACK_MAGIC "tfpack02"
+
+/* The last bytes of a seekable gzip fortune file written by -z. */
+#define GZ_INDEX_MAGIC "tfgzix01"
+
+/* How much fortune file text -z puts in each frame, at least: a frame
+   runs on from there to the end of the cookie it's in. */
+#define GZ_FRAME_SIZE 65536
+
+/* The first bytes of a no-repeat state file kept by -r. */
+#define SEEN_MAGIC "tfseen01"
+
+/* How many words of a no-repeat state file's bitmap make a block, whose
+   seen cookies are counted, for finding unseen cookies by rank. */
+#define SEEN_BLOCK_WORDS 64
+
+/* Placeholder for `CatEnt.num_fortunes` marking an entry which is a
+   subdirectory rather than a jar. */
+#define CATENT_SUBDIR 0xFFFFFFFFu
+
+/* How many symbolic links in a row directory traversal will follow
+   before giving up on a path as cyclic, like stat(2) with ELOOP. */
+#define MAX_SYMLINK_HOPS 40
+
+/* How many jars batch mode keeps open at once. */
+#define JAR_CACHE_SLOTS 64
+
+/* How many jars server mode keeps mapped at once. Each takes 2 of the
+   kernel's (typically 65530) memory mappings per process. */
+#define SERVER_CACHE_SLOTS 4096
+
+/* The longest request line a server accepts, and how much output it
+   prepares for a client before writing it. */
+#define SERVER_REQUEST_MAX 256
+#define SERVER_OUTPUT_CHUNK 65536
+
+/* How many events a server handles per epoll_wait() call. */
+#define SERVER_EVENTS 64
+
+/* How many cookies batch mode draws (and maybe sorts) at a time. */
+#define BATCH_CHUNK_SIZE 65536
+
+/* How many bytes of strings each chunk of a Jars' arena holds. */
+#define ARENA_CHUNK_SIZE 65536
+
+/* The most threads walk_for_fortune_files() will traverse with. */
+#define MAX_WALK_THREADS 16
+
+/* How many dat files' headers a walker loads through io_uring at once.
+   Each takes up to two entries of its ring at a time. */
+#define HEADER_BATCH_SIZE 128
+
+/* How many jars a walker that's sampling (see Jars_sample()) may hold
+   before it throws away all but one. */
+#define SAMPLE_BATCH_SIZE 64
+
+/* Which file a file is, whatever path it was reached by: its device
+   and inode numbers. */
+typedef struct FileId {
+	uint64_t dev;
+	uint64_t ino;
+} FileId;
+
+/* A jar catalog is a cache, written in native byte order, of what a
+   previous run found in each directory it traversed. It begins with a
+   CatHeader, followed by `num_dirs` CatDirs sorted by path, `num_ents`
+   CatEnts grouped by directory, and finally a string table of
+   `str_size` bytes holding the directories' paths and the entries'
+   names. What a walk finds depends on -I, -x and -L, so `mode` records
+   them: the walk's `index` (see WalkOptions), plus 4 if it was `lazy`.
+   A catalog built in another mode is no use at all. */
+typedef struct CatHeader {
+	char magic[8];
+	uint32_t num_dirs;
+	uint32_t num_ents;
+	uint32_t str_size;
+	uint32_t mode;
+} CatHeader;
+
+typedef struct CatDir {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint32_t path_off;
+	uint32_t first_ent;
+	uint32_t num_ents;
+	uint32_t reserved;
+} CatDir;
+
+typedef struct CatEnt {
+	int64_t file_size;
+	FileId id;  /* of the jar's dat file (or its fortune file, if indexed) */
+	int64_t dat_size;  /* the dat file's size and modification time (in */
+	int64_t dat_mtime;  /* nanoseconds) when it was read, or 0 if unknown */
+	uint32_t name_off;
+	uint32_t num_fortunes;
+	uint32_t min_len;
+	uint32_t max_len;
+	char delim;
+	char is_link;  /* whether the entry's a symbolic link */
+	char indexed;  /* whether the jar was indexed by tfortune itself */
+	char lazy;  /* whether only `num_fortunes` is known */
+	char wide;  /* whether the dat file has 64-bit offsets */
+	uint32_t flags;
+} CatEnt;
+
+typedef struct Catalog {
+	/* Where the catalog lives on disk, and the mode (see CatHeader) of
+	   this run's walk. */
+	const char* path;
+	uint32_t mode;
+
+	/* The catalog left by the previous run, mapped read-only. */
+	void* map;
+	size_t map_size;
+	const CatDir* dirs;
+	const CatEnt* ents;
+	const char* strs;
+	uint32_t num_dirs;
+
+	/* The catalog being accumulated by this run. `owner` records, for
+	   each entry in `new_ents`, the index of its directory in
+	   `new_dirs`. */
+	CatDir* new_dirs;
+	uint32_t new_dirs_count;
+	uint32_t new_dirs_capacity;
+	CatEnt* new_ents;
+	uint32_t* owner;
+	uint32_t new_ents_count;
+	uint32_t new_ents_capacity;
+	char* new_strs;
+	uint32_t new_strs_size;
+	uint32_t new_strs_capacity;
+
+	/* Whether any directory had to be rescanned during this run, and
+	   whether building the new catalog failed part way. */
+	unsigned char dirty;
+	unsigned char failed;
+} Catalog;
+
+/* A pack holds a whole collection of jars in one file, so they can be
+   drawn from without traversing directories or opening a file per jar.
+   It begins with a PackHeader, followed by `num_jars` PackJars, a
+   string table of `names_size` bytes holding the jars' names (their
+   fortune files' paths when packed), `num_offsets` 64-bit offsets, and
+   finally `text_size` bytes of fortune file text. Each jar has its
+   cookies' `num_fortunes` + 1 offsets in a row from `first_offset`,
+   reckoned from the start of its text, like a dat file's. Everything's
+   big-endian, as in a dat file, so a pack can be copied between
+   machines. */
+typedef struct PackHeader {
+	char magic[8];
+	uint32_t num_jars;
+	uint32_t names_size;
+	uint64_t num_offsets;
+	uint64_t text_size;
+} PackHeader;
+
+typedef struct PackJar {
+	uint64_t first_offset;
+	uint64_t text_off;
+	uint64_t text_size;
+	uint32_t name_off;
+	uint32_t num_fortunes;
+	uint32_t min_len;
+	uint32_t max_len;
+	char delim;
+	unsigned char flags;  /* the low byte of the strfile flags */
+	char reserved[6];
+} PackJar;
+
+/* A seekable gzip fortune file, written by -z, holds a fortune file's
+   text in frames, each a whole gzip member ending with a delimiter line
+   (or the end of the text), so `gzip -dc` gives back the text, and a
+   cookie can be read by inflating only the frame it's in. The frames
+   are followed by an index of `num_frames` + 1 GzFrames, the last of
+   them marking where the frames and the text end, and then a GzFooter.
+   The index and footer are big-endian, as in a dat file. */
+typedef struct GzFrame {
+	uint64_t gz_off;
+	uint64_t text_off;
+} GzFrame;
+
+typedef struct GzFooter {
+	uint64_t num_frames;
+	char magic[8];
+} GzFooter;
+
+/* A seekable gzip fortune file opened for reading, with its index in
+   native byte order, and the text of the frame last inflated, numbered
+   `frame_no` (or `num_frames` if none has been). */
+typedef struct GzText {
+	GzFrame* index;
+	uint64_t num_frames;
+	uint64_t frame_no;
+	char* frame;
+	size_t frame_size;
+	unsigned char* in;  /* the frame's compressed bytes */
+	size_t in_size;
+	z_stream zs;
+} GzText;
+
+/* A pack's file, mapped into memory. */
+typedef struct Pack {
+	void* map;
+	size_t size;
+} Pack;
+
+/* An open directory, shared by the tasks for its subdirectories so they
+   can be opened relative to it. The last task to finish with it closes
+   it. */
+typedef struct WalkDir {
+	DIR* d;  /* NULL if the directory's entries came from the catalog */
+	int fd;
+	int refs;
+	FileId id;
+} WalkDir;
+
+/* A directory waiting to be scanned. */
+typedef struct WalkTask {
+	WalkDir* parent;  /* NULL if `name` is the whole of `path` */
+	FileId parent_id;  /* all zero if there's no parent */
+	char* path;
+	const char* name;  /* the last component of `path` */
+	unsigned int hops;  /* symbolic links followed to get here */
+} WalkTask;
+
+/* A double-ended queue of directories waiting to be scanned. */
+typedef struct WalkQueue {
+	pthread_mutex_t lock;
+	WalkTask** tasks;
+	size_t head;
+	size_t tail;
+	size_t capacity;
+} WalkQueue;
 
 typedef struct Jar {
-	char* dat;
+	/* The jar's path, less ".dat": the directory part (ending with a
+	   slash, or empty for the current directory), shared by all the
+	   jars of its Jars in that directory and numbered `dir_id` there,
+	   and the fortune file's name. Both are in the Jars' arena. */
+	const char* dir;
+	const char* name;
+	unsigned int dir_id;
+
+	/* Which of its Jars' groups the jar's in, if the Jars has any. */
+	unsigned int group;
+
+	/* Which file the jar's dat file (or, if it's indexed, its fortune
+	   file) is, if a directory walk found it; all zero otherwise. */
+	FileId id;
+
 	unsigned int num_fortunes;
 	unsigned int min_len;
 	unsigned int max_len;
 	char delim;
-	off_t file_size;
+	uint32_t flags;
+	unsigned char wide;  /* whether the dat file has 64-bit offsets */
+	off_t file_size;  /* -1 if unknown; if the fortune file's only there
+	                     compressed (see -z), its compressed size */
+
+	/* A jar that came out of the jar catalog has its dat file's size
+	   and modification time (in nanoseconds) as the catalog had them,
+	   so JarMap_open() can tell if the dat file's been rewritten since;
+	   for any other jar `dat_mtime` is 0. */
+	off_t dat_size;
+	int64_t dat_mtime;
+
+	/* A jar added by -L is `lazy`: its number of fortune cookies was
+	   worked out from the size of its dat file, and the rest of its
+	   header (so `min_len`, `max_len`, `delim`, `flags`) and
+	   `file_size` are unknown until it's opened. It's 2 once `flags`
+	   has been read, by Jar_read_flags(). */
+	unsigned char lazy;
+
+	/* A jar whose fortune file has no dat file, but was indexed by
+	   tfortune itself, is `indexed`. `index` holds an image of the dat
+	   file it would have (or is NULL if the file has to be indexed
+	   again to be read). */
+	unsigned char indexed;
+	char* index;
+	size_t index_size;
+
+	/* A jar that came out of a pack has its offsets and text in the
+	   pack's mapping, at `pack_offsets` and `pack_text`, and
+	   `file_size` bytes of text; its path is then its name in the
+	   pack. Both are NULL for any other jar. */
+	const unsigned char* pack_offsets;
+	const char* pack_text;
+
+	/* When only cookies of some lengths may be drawn (see -s and -l),
+	   `by_length` holds the jar's cookie numbers sorted by length, and
+	   the `num_drawable` that may be drawn are a run of them starting at
+	   `drawable`. Both are NULL when any of the jar's cookies may be. */
+	uint32_t* by_length;
+	const uint32_t* drawable;
+	unsigned int num_drawable;
 } Jar;
 
+/* A jar's files, opened (and mapped into memory if possible) for
+   reading cookies. A file that's been mapped is closed, so its fd is
+   only valid when its map pointer is NULL. */
+typedef struct JarMap {
+	const Jar* jar;
+	int dat_fd;
+	const unsigned char* dat_map;  /* NULL if the dat file isn't mapped */
+	size_t dat_size;
+	unsigned char dat_in_memory;  /* whether `dat_map` is an index image */
+	size_t offsets_at;  /* where in `dat_map` the cookies' offsets begin */
+	unsigned char wide;  /* whether the offsets are 64-bit */
+	uint32_t num_fortunes;  /* the jar's header, as found when it was */
+	char delim;  /* opened */
+	unsigned int min_len;
+	unsigned int max_len;
+	uint32_t flags;
+	unsigned char packed;  /* whether `text_map` is in a pack's mapping */
+	char* own_index;  /* an index image belonging to this JarMap */
+	int text_fd;
+	const char* text_map;  /* NULL if the fortune file isn't mapped */
+	size_t text_size;
+	GzText* gz;  /* if the fortune file's only there compressed, in which
+	                case `text_fd` is the compressed file's */
+	char* buf;  /* cookie buffer, for when the fortune file isn't mapped
+	               or the cookie has to be decoded */
+	size_t buf_size;
+} JarMap;
+
+/* A bump allocator for strings that last as long as the Jars holding
+   them. Its chunks are never moved or freed one by one, so pointers
+   into them stay good; each chunk's data follows its header. */
+typedef struct ArenaChunk {
+	struct ArenaChunk* next;
+} ArenaChunk;
+
+typedef struct Arena {
+	ArenaChunk* chunks;  /* newest first */
+	char* free;  /* the unused end of the newest chunk */
+	size_t left;
+} Arena;
+
+/* A directory some of a Jars' jars are in. */
+typedef struct JarDir {
+	const char* path;
+	size_t len;
+	uint64_t hash;
+} JarDir;
+
+/* A no-repeat state file, written in native byte order, is a bitmap of
+   the cookies drawn since the last time all of them had been, numbering
+   the cookies of all the jars one after another. Its header says which
+   jars the bits are for. */
+typedef struct SeenHeader {
+	char magic[8];
+	uint64_t jars_hash;  /* of the jars' paths and numbers of cookies */
+	uint64_t num_cookies;
+} SeenHeader;
+
+/* A no-repeat state file, mapped and locked for drawing from. */
+typedef struct Seen {
+	const char* path;
+	int fd;
+	unsigned char* map;
+	size_t map_size;
+	uint64_t* bits;  /* in the mapping, set for cookies seen */
+	uint64_t num_cookies;
+	uint64_t num_seen;
+	uint64_t num_blocks;
+	uint32_t* block_seen;  /* how many bits are set in each block */
+	uint64_t* first_cookie;  /* the number of each jar's first cookie */
+	unsigned int num_jars;
+} Seen;
+
+/* The jars found under one path given, and the percentage of the time
+   to choose from them, if one was given (as in "30% path"). The group's
+   jars are together in its Jars, from `first_jar` on. Its `weight`, by
+   cookies and with -e by jars, is out of the Jars' `group_total`. */
+typedef struct JarGroup {
+	const char* path;
+	unsigned char weighted;
+	unsigned int percent;
+	unsigned int first_jar;
+	unsigned int num_jars;
+	uint64_t num_fortunes;
+	uint64_t weight[2];
+} JarGroup;
+
+/* Cookie numbers are reckoned from 0 within each jar. */
+typedef struct Draw {
+	unsigned int jar_no;
+	uint32_t cookie_no;
+} Draw;
+
 typedef struct Jars {
 	Jar* j;
 	unsigned int count;
 	unsigned int capacity;
-	unsigned int num_fortunes;
+	uint64_t num_fortunes;  /* can't overflow, as each jar's count and
+	                           the number of jars are 32-bit */
+
+	/* An alias table for choosing a jar with probability proportional
+	   to its number of fortune cookies, built by Jars_build_alias()
+	   once all the jars have been added. Jar `jar_no`'s chance of being
+	   chosen is spread over the table's columns; column `jar_no` goes
+	   to jar `jar_no` with probability `cut[jar_no]` / `num_fortunes`,
+	   and to jar `alias[jar_no]` otherwise. If the jars are in groups,
+	   each group's columns make a table of their own, reckoned out of
+	   the group's `num_fortunes`. */
+	uint64_t* cut;
+	unsigned int* alias;
+
+	/* The groups the jars are in, one for each path given, if any of
+	   the paths was given a percentage; otherwise there are none, and
+	   the jars are all chosen from together. A group is chosen first,
+	   by weight, from an alias table like the jars' (the first for
+	   weights by cookies, the second for -e), then a jar in it. */
+	JarGroup* groups;
+	unsigned int num_groups;
+	uint64_t group_total[2];
+	uint64_t* group_cut[2];
+	unsigned int* group_alias[2];
+
+	/* The packs any of the jars came out of. */
+	Pack* packs;
+	unsigned int num_packs;
+
+	/* The jars' directories, each stored once, and found through a
+	   hash table of `num_dir_slots` (a power of 2) slots holding their
+	   numbers plus 1, or 0 for an empty slot. The directories' paths
+	   and the jars' names are in `strings`. */
+	Arena strings;
+	JarDir* dirs;
+	unsigned int num_dirs;
+	unsigned int dirs_capacity;
+	unsigned int* dir_slots;
+	unsigned int num_dir_slots;
+
+	/* The cookies to draw without repeats from, for -r, or NULL. */
+	Seen* seen;
 } Jars;
 
 typedef struct Options {
+	unsigned char a;  /* choose from all fortune files, offensive or not */
 	unsigned char c;  /* show file from which the fortune was sampled */
 	unsigned char e;  /* all fortune files have equal selection chances */
 	unsigned char f;  /* just list available fortune files */
+	unsigned char F;  /* list them in a machine-readable form */
+	unsigned char l;  /* draw only long fortunes */
+	unsigned char o;  /* choose only from offensive fortune files */
+	unsigned char s;  /* draw only short fortunes */
+	unsigned char S;  /* sort batches of fortunes by file and position */
 	unsigned char w;  /* wait, to give the user time to read the fortune */
 } Options;
 
+/* A cache of opened jars' files, for drawing many cookies at once.
+   When the cache is full, the least recently used jar is closed. */
+typedef struct JarCache {
+	const Jars* js;
+	JarMap* maps;
+	unsigned int* jar_of_slot;
+	unsigned long* last_used;
+	int* slot_of_jar;  /* -1 for jars not in the cache */
+	unsigned int num_slots;
+	unsigned int num_used;
+	unsigned long clock;
+} JarCache;
+
+/* The cookies of one jar that matched a search, formatted for output,
+   and whether the jar's been searched yet (1), or couldn't be (2). */
+typedef struct MatchOut {
+	char* out;
+	size_t len;
+	size_t capacity;
+	unsigned long count;
+	unsigned char done;  /* guarded by the search's `lock` */
+} MatchOut;
+
+/* A search of a set of jars for cookies matching a pattern, shared by
+   the threads doing it. */
+typedef struct Search {
+	const Jars* js;
+	char* literal;  /* a string every matching cookie contains */
+	char* rot_literal;  /* the same, rot13 encoded */
+	size_t literal_len;  /* 0 if there's no such string */
+	MatchOut* outs;  /* one per jar */
+	unsigned int next_jar;  /* the next jar for a thread to take */
+	pthread_mutex_t lock;
+	pthread_cond_t jar_done;
+} Search;
+
+/* One thread's share of a search. */
+typedef struct SearchWorker {
+	Search* search;
+	regex_t re;
+	pthread_t thread;
+} SearchWorker;
+
+/* A connection to a client of fortune server mode. */
+typedef struct Client {
+	int fd;
+	char req[SERVER_REQUEST_MAX + 1];
+	size_t req_len;
+	unsigned char replying;  /* whether the request's been read */
+	Options opts;
+	unsigned char batch;  /* whether to format the cookies as -N does */
+	unsigned long remaining;  /* cookies still to be drawn */
+	char* out;  /* output waiting to be written */
+	size_t out_len;
+	size_t out_pos;
+	size_t out_size;
+} Client;
+
+/* How to go about looking for fortune files. */
+typedef struct WalkOptions {
+	unsigned int threads;  /* how many threads to traverse with */
+	unsigned char index;  /* 1 to index fortune files without dat files
+	                         ourselves, 2 to write dat files for them too */
+	unsigned char lazy;  /* count cookies by the sizes of dat files */
+	unsigned char uring;  /* load headers through io_uring if possible */
+
+	/* To draw a single cookie, the walk need keep only the jar it's to
+	   come from, so it can be `sample`d as the walk goes, uniformly
+	   among jars if `uniform` is set, and by number of cookies if not,
+	   from the offensive jars if `offensive` is 1, the inoffensive ones
+	   if it's 0, and all of them if it's 2. `seed` decides which. */
+	unsigned char sample;
+	unsigned char uniform;
+	unsigned char offensive;
+	uint64_t seed;
+} WalkOptions;
+
+/* An io_uring instance, driven with raw system calls: the submission
+   queue, the completion queue and the array of submission entries are
+   all shared with the kernel. */
+typedef struct Ring {
+	int fd;
+	unsigned char* sq_map;
+	size_t sq_map_size;
+	unsigned char* cq_map;
+	size_t cq_map_size;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+	unsigned int* sq_head;
+	unsigned int* sq_tail;
+	unsigned int* sq_mask;
+	unsigned int* sq_array;
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int* cq_mask;
+	struct io_uring_cqe* cqes;
+	unsigned int to_submit;  /* entries queued but not yet submitted */
+} Ring;
+
+/* A dat file found by a walker whose header's waiting to be loaded
+   through its ring, and what each step of loading it came to. The
+   strings are in the batch's `strs`, by offset. */
+typedef struct HeaderLoad {
+	size_t path_off;  /* the dat file's path */
+	size_t name_off;  /* its name in the directory */
+	size_t text_name_off;  /* its fortune file's name */
+	FileId id;
+	unsigned char is_link;
+	int fd;  /* the result of opening the dat file */
+	int stat_res;  /* of looking up the fortune file's size */
+	int read_res;  /* of reading the header */
+	int close_res;  /* of closing the dat file, or 1 while it's being
+	                   closed; -ECANCELED if it's for the walker to
+	                   close */
+	char header[STRFILE_HEADER_SIZE];
+	struct statx text_info;
+} HeaderLoad;
+
+typedef struct HeaderBatch {
+	HeaderLoad loads[HEADER_BATCH_SIZE];
+	unsigned int count;
+	char* strs;
+	size_t strs_len;
+	size_t strs_size;
+} HeaderBatch;
+
+/* A directory a walk's been to, the path it was scanned by, and the
+   path to it that comes first (see Walk_name_dirs()). */
+typedef struct WalkVisit {
+	FileId id;
+	char* path;  /* NULL in an empty slot */
+	char* first_path;  /* NULL until worked out */
+} WalkVisit;
+
+/* A way a walk found to reach a directory: the entry `name` of the
+   directory `from`, or, with `from` all zero, the path `name` the walk
+   started from. */
+typedef struct WalkLink {
+	FileId from;
+	FileId to;
+	char* name;
+} WalkLink;
+
+/* A path to a directory, waiting in Walk_name_dirs()'s heap. */
+typedef struct WalkRoute {
+	char* path;
+	FileId to;
+} WalkRoute;
+
+struct Walk;
+
+/* One thread's share of a directory traversal. */
+typedef struct Walker {
+	struct Walk* walk;
+	WalkQueue queue;
+	Jars js;  /* the jars this walker's found */
+	char* path;  /* scratch space for building paths */
+	size_t path_alloc;
+	pthread_t thread;
+	unsigned char use_ring;  /* whether `ring` could be set up */
+	Ring ring;
+	HeaderBatch batch;
+	unsigned int batch_limit;  /* how many dat files to batch at once */
+} Walker;
+
+typedef struct Walk {
+	Walker* walkers;
+	unsigned int num_walkers;
+	const WalkOptions* wopts;
+	Catalog* cat;
+	pthread_mutex_t lock;  /* guards `cat`, and `wake`'s sleepers */
+	pthread_cond_t wake;
+	unsigned int num_idle;  /* walkers sleeping on `wake` */
+	size_t queued;  /* directories waiting in queues */
+	size_t pending;  /* directories waiting or being scanned */
+
+	/* The directories reached so far, in a hash table of
+	   `num_visit_slots` (a power of 2) slots, and every link to them
+	   the walk's come across; `aliased` is set once a directory's been
+	   reached by a second link. */
+	pthread_mutex_t visit_lock;
+	WalkVisit* visits;
+	size_t num_visits;
+	size_t num_visit_slots;
+	WalkLink* links;
+	size_t num_links;
+	size_t links_capacity;
+	unsigned char aliased;
+} Walk;
+
+/* The state of a pseudorandom number generator. Whatever draws cookies
+   passes its own along; `rng` is tfortune's. */
+typedef TfRng Rng;
+
+Rng rng;
+
+/* Set by JarMap_open() on finding the jar catalog out of date. */
+unsigned char stale_catalog = 0;
+
+/* Where report() sends messages, if not to standard error. */
+TfReportFn report_fn = NULL;
+void* report_arg = NULL;
+
+/* The phases of a run that -T accounts for separately. Header loading
+   happens during traversal, so traversal's time includes it; header
+   loading's time is summed over all the threads traversing. */
+enum {
+	PHASE_TRAVERSAL,
+	PHASE_HEADERS,
+	PHASE_SELECTION,
+	PHASE_COOKIE_READ,
+	PHASE_OUTPUT,
+	NUM_PHASES
+};
+
+typedef struct PhaseStats {
+	uint64_t nsec;
+	uint64_t dirs_opened;
+	uint64_t stats;
+	uint64_t files_opened;
+	uint64_t bytes_read;
+	uint64_t jars_skipped;
+} PhaseStats;
+
+/* Counters of the work done in each phase. They're always kept, since
+   they cost only an uncontended atomic add apiece, but phases are only
+   timed, and the counts only reported, for -T. */
+typedef struct Stats {
+	unsigned char enabled;
+	PhaseStats phases[NUM_PHASES];
+} Stats;
+
+Stats stats;
+__thread unsigned int stats_phase = PHASE_TRAVERSAL;
+
+/* Add `n` to `counter` of the calling thread's current phase. */
+#define STATS_COUNT(counter, n) \
+	__atomic_fetch_add(&(stats.phases[stats_phase].counter), \
+	                   (uint64_t) (n), __ATOMIC_RELAXED)
+
+/* Write an error message to standard error, or pass it to the handler
+   set with tf_set_report(). */
+void report(const char* format, ...)
+{
+	va_list args;
+	char message[4096 + 256];  /* room for the longest path, and more */
+
+	va_start(args, format);
+	if (report_fn == NULL) {
+		vfprintf(stderr, format, args);
+	} else {
+		vsnprintf(message, sizeof(message), format, args);
+		report_fn(message, report_arg);
+	}
+	va_end(args);
+}
+
+/* Make `phase` the calling thread's current phase, noting the time in
+   `start` if phases are being timed. Return the phase it replaces, for
+   stats_leave(). */
+unsigned int stats_enter(unsigned int phase, struct timespec* start)
+{
+	unsigned int prev_phase = stats_phase;
+
+	if (stats.enabled) {
+		clock_gettime(CLOCK_MONOTONIC, start);
+	}
+	stats_phase = phase;
+	return prev_phase;
+}
+
+/* Charge the time since `start` to the current phase, and go back to
+   `prev_phase`. */
+void stats_leave(unsigned int prev_phase, const struct timespec* start)
+{
+	struct timespec end;
+
+	if (stats.enabled) {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		__atomic_fetch_add(&(stats.phases[stats_phase].nsec),
+		                   (uint64_t) ((end.tv_sec - start->tv_sec)
+		                               * 1000000000LL
+		                               + end.tv_nsec - start->tv_nsec),
+		                   __ATOMIC_RELAXED);
+	}
+	stats_phase = prev_phase;
+}
+
+/* Write the phases' times and counters to standard error as a JSON
+   object. */
+void stats_report(void)
+{
+	const char* names[NUM_PHASES] = { "traversal", "headers", "selection",
+	                                  "cookie_read", "output" };
+	unsigned int phase;
+	const PhaseStats* ps;
+
+	fputs("{\"phases\": {", stderr);
+	for (phase = 0; phase < NUM_PHASES; phase++) {
+		ps = &(stats.phases[phase]);
+		fprintf(stderr, "%s\n  \"%s\": {\"wall_ms\": %.3f, "
+		        "\"dirs_opened\": %llu, \"stats\": %llu, "
+		        "\"files_opened\": %llu, \"bytes_read\": %llu, "
+		        "\"jars_skipped\": %llu}", phase ? "," : "", names[phase],
+		        ps->nsec / 1e6, (unsigned long long) ps->dirs_opened,
+		        (unsigned long long) ps->stats,
+		        (unsigned long long) ps->files_opened,
+		        (unsigned long long) ps->bytes_read,
+		        (unsigned long long) ps->jars_skipped);
+	}
+	fputs("\n}}\n", stderr);
+}
+
+void Arena_init(Arena* a)
+{
+	a->chunks = NULL;
+	a->free = NULL;
+	a->left = 0;
+}
+
+/* Copy the `len` bytes at `s` into `a`, with a NUL after them. */
+char* Arena_strndup(Arena* a, const char* s, size_t len)
+{
+	ArenaChunk* chunk;
+	size_t chunk_size;
+	char* copy;
+
+	if (len + 1 > a->left) {
+		chunk_size = (len + 1 > ARENA_CHUNK_SIZE) ? len + 1
+		                                          : ARENA_CHUNK_SIZE;
+		if ((chunk = malloc(sizeof(ArenaChunk) + chunk_size)) == NULL) {
+			return NULL;
+		}
+		chunk->next = a->chunks;
+		a->chunks = chunk;
+		a->free = (char*) (chunk + 1);
+		a->left = chunk_size;
+	}
+	copy = a->free;
+	memcpy(copy, s, len);
+	copy[len] = '\0';
+	a->free += len + 1;
+	a->left -= len + 1;
+	return copy;
+}
+
+/* Hand all of `from`'s chunks over to `a`, leaving `from` empty. `a`
+   carries on filling its own newest chunk. */
+void Arena_take(Arena* a, Arena* from)
+{
+	ArenaChunk* last;
+
+	if (from->chunks == NULL) {
+		return;
+	}
+	if (a->chunks == NULL) {
+		*a = *from;
+	} else {
+		for (last = from->chunks; last->next != NULL; last = last->next) {
+		}
+		last->next = a->chunks->next;
+		a->chunks->next = from->chunks;
+	}
+	Arena_init(from);
+}
+
+void Arena_free(Arena* a)
+{
+	ArenaChunk* chunk;
+
+	while ((chunk = a->chunks) != NULL) {
+		a->chunks = chunk->next;
+		free(chunk);
+	}
+	Arena_init(a);
+}
+
+/* Find the length of the directory part of `path`, including its final
+   slash; 0 if the path's the name of a file in the current directory. */
+size_t dir_part_length(const char* path)
+{
+	const char* last_slash = strrchr(path, '/');
+
+	return (last_slash == NULL) ? 0 : (size_t) (last_slash - path + 1);
+}
+
+/* Hash the first `len` bytes of `s` (with 64-bit FNV-1a). */
+uint64_t hash_bytes(const char* s, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	while (len--) {
+		h = (h ^ (unsigned char) *s++) * 1099511628211ULL;
+	}
+	return h;
+}
+
+/* Find the directory `path`, of `len` bytes, among `js`'s directories,
+   adding it if it's not there (copying it into the arena if `copy` is
+   set, or else keeping `path` itself, which must last as long as `js`
+   does), and put its number in `dir_id`. */
+unsigned char Jars_intern_dir(Jars* js, const char* path, size_t len,
+                              unsigned char copy, unsigned int* dir_id)
+{
+	JarDir* d;
+	unsigned int dir_no;
+	uint64_t h = hash_bytes(path, len);
+	JarDir* new_dirs;
+	unsigned int* new_slots;
+	unsigned int num_new_slots;
+	size_t slot;
+
+	/* Keep the table no more than half full. */
+	if (2 * (js->num_dirs + 1) > js->num_dir_slots) {
+		num_new_slots = js->num_dir_slots ? 2 * js->num_dir_slots : 64;
+		if ((new_slots = calloc(num_new_slots, sizeof(unsigned int)))
+		    == NULL) {
+			return 0;
+		}
+		for (dir_no = 0; dir_no < js->num_dirs; dir_no++) {
+			slot = js->dirs[dir_no].hash & (num_new_slots - 1);
+			while (new_slots[slot]) {
+				slot = (slot + 1) & (num_new_slots - 1);
+			}
+			new_slots[slot] = dir_no + 1;
+		}
+		free(js->dir_slots);
+		js->dir_slots = new_slots;
+		js->num_dir_slots = num_new_slots;
+	}
+
+	slot = h & (js->num_dir_slots - 1);
+	while (js->dir_slots[slot]) {
+		d = &(js->dirs[js->dir_slots[slot] - 1]);
+		if ((d->hash == h) && (d->len == len)
+		    && !memcmp(d->path, path, len)) {
+			*dir_id = js->dir_slots[slot] - 1;
+			return 1;
+		}
+		slot = (slot + 1) & (js->num_dir_slots - 1);
+	}
+
+	if (js->num_dirs == js->dirs_capacity) {
+		if ((new_dirs = realloc(js->dirs, (js->dirs_capacity + 8) * 2
+		                                  * sizeof(JarDir))) == NULL) {
+			return 0;
+		}
+		js->dirs = new_dirs;
+		js->dirs_capacity = (js->dirs_capacity + 8) * 2;
+	}
+	d = &(js->dirs[js->num_dirs]);
+	if (copy && ((path = Arena_strndup(&(js->strings), path, len)) == NULL)) {
+		return 0;
+	}
+	d->path = path;
+	d->len = len;
+	d->hash = h;
+	js->dir_slots[slot] = ++(js->num_dirs);
+	*dir_id = js->num_dirs - 1;
+	return 1;
+}
+
+/* Give jar `j` of `js` the path `dat_file_path` (less its ".dat"),
+   split into its directory, interned, and its name, kept in the
+   arena. */
+unsigned char Jars_set_path(Jars* js, Jar* j, const char* dat_file_path)
+{
+	size_t dir_len = dir_part_length(dat_file_path);
+	size_t len = strlen(dat_file_path);
+
+	if ((len >= dir_len + 4) && !strcmp(dat_file_path + len - 4, ".dat")) {
+		len -= 4;
+	}
+	if (!Jars_intern_dir(js, dat_file_path, dir_len, 1, &(j->dir_id))
+	    || ((j->name = Arena_strndup(&(js->strings), dat_file_path + dir_len,
+	                                 len - dir_len)) == NULL)) {
+		report("Cannot copy path to fortune data file %s.\n",
+		       dat_file_path);
+		return 0;
+	}
+	j->dir = js->dirs[j->dir_id].path;
+	j->group = 0;
+	return 1;
+}
+
+/* Write jar `j`'s path, followed by `suffix`, into `*buf`, which holds
+   `*buf_size` bytes, making it bigger if need be. */
+char* Jar_path(const Jar* j, const char* suffix, char** buf,
+               size_t* buf_size)
+{
+	size_t dir_len = strlen(j->dir);
+	size_t name_len = strlen(j->name);
+	char* new_buf;
+	size_t path_size = dir_len + name_len + strlen(suffix) + 1;
+
+	if (path_size > *buf_size) {
+		if ((new_buf = realloc(*buf, path_size)) == NULL) {
+			report("Cannot allocate memory for fortune file path.\n");
+			return NULL;
+		}
+		*buf = new_buf;
+		*buf_size = path_size;
+	}
+	memcpy(*buf, j->dir, dir_len);
+	memcpy(*buf + dir_len, j->name, name_len);
+	strcpy(*buf + dir_len + name_len, suffix);
+	return *buf;
+}
+
 unsigned char Jars_init(Jars* js, unsigned int initial_capacity)
 {
 	js->count = 0;
 	js->capacity = initial_capacity;
 	js->num_fortunes = 0;
+	js->cut = NULL;
+	js->alias = NULL;
+	js->groups = NULL;
+	js->num_groups = 0;
+	js->group_cut[0] = js->group_cut[1] = NULL;
+	js->group_alias[0] = js->group_alias[1] = NULL;
+	js->packs = NULL;
+	js->num_packs = 0;
+	Arena_init(&(js->strings));
+	js->dirs = NULL;
+	js->num_dirs = 0;
+	js->dirs_capacity = 0;
+	js->dir_slots = NULL;
+	js->num_dir_slots = 0;
+	js->seen = NULL;
 
 	if (js->capacity == 0) {
 		js->j = NULL;
 	} else if ((js->j = malloc(js->capacity * sizeof(Jar))) == NULL) {
-		fprintf(stderr, "Cannot allocate %lu bytes of memory "
-		        "for fortune file list.\n", js->capacity * sizeof(Jar));
+		report("Cannot allocate %lu bytes of memory "
+		       "for fortune file list.\n", js->capacity * sizeof(Jar));
 		return 0;
 	}
 	return 1;
 }
 
-unsigned char Jars_add(Jars* js, const char* dat_file_path)
+/* Make sure `js` has room for at least one more Jar. */
+unsigned char Jars_reserve(Jars* js)
 {
-	char dat_header[STRFILE_HEADER_SIZE];
-	FILE* fh;
-	struct stat file_info;
-	Jar* j;
-	char* last_dot_ptr;
 	Jar* old_jar_list_ptr;
 
 	/* If the jar list is full, try to make it bigger. */
@@ -74,65 +1082,152 @@ unsigned char Jars_add(Jars* js, const char* dat_file_path)
 		js->capacity = (js->capacity + 1) * 2;
 		old_jar_list_ptr = js->j;
 		if ((js->j = realloc(js->j, js->capacity * sizeof(Jar))) == NULL) {
-			fprintf(stderr, "Cannot reallocate %lu bytes of memory "
-			        "for fortune file list.\n", js->capacity * sizeof(Jar));
+			report("Cannot reallocate %lu bytes of memory "
+			       "for fortune file list.\n", js->capacity * sizeof(Jar));
 			js->capacity = (js->capacity / 2) - 1;
 			js->j = old_jar_list_ptr;
 			return 0;
 		}
 	}
+	return 1;
+}
+
+/* Copy the metadata in the strfile header `dat_header` into `j`. */
+void Jar_read_header(Jar* j, const char* dat_header)
+{
+	j->wide = (htonl(*(uint32_t*) dat_header) == STRFILE_VERSION_WIDE);
+	j->num_fortunes = htonl(*(uint32_t*) (dat_header + sizeof(uint32_t)));
+	j->max_len = htonl(*(uint32_t*) (dat_header + 2*sizeof(uint32_t)));
+	j->min_len = htonl(*(uint32_t*) (dat_header + 3*sizeof(uint32_t)));
+	j->flags = htonl(*(uint32_t*) (dat_header + 4*sizeof(uint32_t)));
+	j->delim = *(dat_header + 5*sizeof(uint32_t));
+}
+
+/* Add a jar whose metadata is already known (from the jar catalog, say)
+   to `js`, without touching the jar's files. */
+unsigned char Jars_add_known(Jars* js, const char* dat_file_path,
+                             const Jar* meta)
+{
+	Jar* j;
+
+	if (!Jars_reserve(js)) {
+		return 0;
+	}
+	j = &((js->j)[js->count]);
+	*j = *meta;
+	j->index = NULL;
+	j->index_size = 0;
+	j->by_length = NULL;
+	j->drawable = NULL;
+	if (!Jars_set_path(js, j, dat_file_path)) {
+		return 0;
+	}
+	js->count++;
+	js->num_fortunes += j->num_fortunes;
+	return 1;
+}
+
+/* Look up the seekable gzip copy (see -z) of the fortune file
+   `text_name` in `dir_fd`, in place of the fortune file itself. */
+unsigned char stat_compressed(int dir_fd, const char* text_name,
+                              struct stat* info)
+{
+	char* gz_name;
+	unsigned char found;
+
+	if ((gz_name = malloc(strlen(text_name) + 4)) == NULL) {
+		return 0;
+	}
+	sprintf(gz_name, "%s.gz", text_name);
+	STATS_COUNT(stats, 1);
+	found = !fstatat(dir_fd, gz_name, info, 0);
+	free(gz_name);
+	return found;
+}
+
+/* Add the jar whose dat file is `dat_file_path` to `js`. The dat file's
+   opened as `dat_name` relative to the directory `dir_fd`, which saves
+   the kernel from resolving the whole path again when the caller has
+   its directory open already; `dat_file_path` must end with `dat_name`.
+   Pass AT_FDCWD as `dir_fd` to use plain paths. */
+unsigned char Jars_add_at(Jars* js, int dir_fd, const char* dat_name,
+                          const char* dat_file_path)
+{
+	char dat_header[STRFILE_HEADER_SIZE];
+	int fd;
+	struct stat file_info;
+	Jar* j;
+	char* text_path = NULL;
+	size_t text_path_size = 0;
+	const char* text_name;
+
+	if (!Jars_reserve(js)) {
+		return 0;
+	}
 
 	/* Set up a convenient pointer to the appropriate Jar slot for storing
-	   this jar's metadata, then copy its dat file's path into it. */
+	   this jar's metadata, then store its path in `js`. */
 	j = &((js->j)[js->count]);
-	if ((j->dat = strdup(dat_file_path)) == NULL) {
-		fprintf(stderr, "Cannot copy path to fortune data file %s.\n",
-		        dat_file_path);
+	j->lazy = 0;
+	j->indexed = 0;
+	j->index = NULL;
+	j->index_size = 0;
+	j->pack_offsets = NULL;
+	j->pack_text = NULL;
+	j->by_length = NULL;
+	j->drawable = NULL;
+	memset(&(j->id), 0, sizeof(FileId));
+	j->dat_mtime = 0;
+	if (!Jars_set_path(js, j, dat_file_path)) {
 		return 0;
 	}
 
 	/* Open the dat file and read its strfile header. */
-	if ((fh = fopen(j->dat, "rb")) == NULL) {
-		fprintf(stderr, "Cannot open fortune data file %s.\n", dat_file_path);
-		free(j->dat);
+	STATS_COUNT(files_opened, 1);
+	if ((fd = openat(dir_fd, dat_name, O_RDONLY | O_CLOEXEC)) < 0) {
+		report("Cannot open fortune data file %s.\n", dat_file_path);
 		return 0;
 	}
-	if (fread(dat_header, STRFILE_HEADER_SIZE, 1, fh) != 1) {
-		fprintf(stderr, "Strfile header of %s is the wrong size.\n",
-		        dat_file_path);
-		free(j->dat);
+	STATS_COUNT(bytes_read, STRFILE_HEADER_SIZE);
+	if (read(fd, dat_header, STRFILE_HEADER_SIZE) != STRFILE_HEADER_SIZE) {
+		report("Strfile header of %s is the wrong size.\n",
+		       dat_file_path);
+		close(fd);
 		return 0;
 	}
 
 	/* Interpret the dat file's header and copy the appropriate metadata
 	   from it. */
-	j->num_fortunes = htonl(*(uint32_t*) (dat_header + sizeof(uint32_t)));
-	j->max_len = htonl(*(uint32_t*) (dat_header + 2*sizeof(uint32_t)));
-	j->min_len = htonl(*(uint32_t*) (dat_header + 3*sizeof(uint32_t)));
-	j->delim = *(dat_header + 5*sizeof(uint32_t));
-	if (htonl(*(uint32_t*) (dat_header + 4*sizeof(uint32_t))) != 0) {
-		/* Handling fortune files with special flags is unimplemented;
-		   fortunately I've yet to find a fortune file that uses any, but
-		   apologize to the user if it comes up. */
-		fprintf(stderr, "Fortune data file %s has special flags set, but "
-		        "these will be ignored; sorry.\n", dat_file_path);
-	}
+	Jar_read_header(j, dat_header);
 
 	/* Close the dat file. */
-	if (fclose(fh)) {
-		fprintf(stderr, "Cannot close fortune data file %s.\n", j->dat);
+	if (close(fd)) {
+		report("Cannot close fortune data file %s.\n",
+		       dat_file_path);
 	}
 
-	/* Look up the corresponding fortune cookie file's size. */
-	last_dot_ptr = strrchr(j->dat, '.');
-	*last_dot_ptr = '\0';
-	if (stat(j->dat, &file_info)) {
-		fprintf(stderr, "Cannot find size of fortune file %s.\n", j->dat);
-		free(j->dat);
+	/* Look up the corresponding fortune cookie file's size. When
+	   `dat_name` is just a file name, as it is when walking, the jar's
+	   name is the fortune file's; otherwise it's the end of the jar's
+	   path, which has to be put together. */
+	if (strchr(dat_name, '/') == NULL) {
+		text_name = j->name;
+	} else if (Jar_path(j, "", &text_path, &text_path_size) != NULL) {
+		text_name = text_path + strlen(text_path) - (strlen(dat_name) - 4);
+	} else {
+		return 0;
+	}
+	STATS_COUNT(stats, 1);
+	if (fstatat(dir_fd, text_name, &file_info, 0)
+	    && ((errno != ENOENT)
+	        || !stat_compressed(dir_fd, text_name, &file_info))) {
+		report("Cannot find size of fortune file %s%s.\n", j->dir,
+		       j->name);
+		free(text_path);
 		return 0;
 	}
 	j->file_size = file_info.st_size;
-	*last_dot_ptr = '.';
+	free(text_path);
 
 	/* The jar's been successfully added to the jar list, so increment the
 	   jar list's jar count and number of available fortune cookies. */
@@ -142,631 +1237,6325 @@ unsigned char Jars_add(Jars* js, const char* dat_file_path)
 	return 1;
 }
 
-unsigned char Jars_fortune(const Jars* js, Options opts)
+unsigned char Jars_add(Jars* js, const char* dat_file_path)
 {
-	size_t byte_idx;
-	float chance;
-	char* cookie_buf;
-	float cum_chance = 0.0;
-	char* dat;
-	double delay_time = 0.0;
-	FILE* fh;
-	unsigned int jar_no;
-	char* last_dot_ptr;
-	size_t num_bytes;
-	unsigned int num_offsets_read;
-	uint32_t offsets[2];
-	float prob;
+	return Jars_add_at(js, AT_FDCWD, dat_file_path, dat_file_path);
+}
 
-	if (!(js->count)) {
-		fputs("List of available fortune cookie files is empty.\n", stderr);
-		return 0;
-	}
+/* Add the jar whose dat file is `dat_name` in `dir_fd` to `js` as
+   Jars_add_at() does, but without opening anything: strfile writes a
+   header and then an offset for each cookie plus one for the end of
+   the file, so the dat file's size alone gives the number of cookies,
+   whether it's a classic or a wide dat file. The rest of the header is
+   read if and when the jar's opened. A dat file whose size doesn't fit
+   either pattern is read as usual. */
+unsigned char Jars_add_lazily_at(Jars* js, int dir_fd, const char* dat_name,
+                                 const char* dat_file_path)
+{
+	size_t header_space;
+	struct stat info;
+	Jar j;
+	size_t width;
 
-	if (!(js->num_fortunes)) {
-		fputs("The available fortune cookie files are all empty.\n", stderr);
+	STATS_COUNT(stats, 1);
+	if (fstatat(dir_fd, dat_name, &info, 0)) {
+		report("Cannot find size of fortune data file %s.\n",
+		       dat_file_path);
 		return 0;
 	}
+	memset(&j, 0, sizeof(Jar));
+	j.wide = (info.st_size % sizeof(uint32_t)) != 0;
+	header_space = j.wide ? STRFILE_WIDE_HEADER_SPACE : STRFILE_HEADER_SPACE;
+	width = j.wide ? sizeof(uint64_t) : sizeof(uint32_t);
+	if ((info.st_size < (off_t) (header_space + width))
+	    || ((info.st_size - header_space) % width)
+	    || ((info.st_size - header_space) / width - 1 > UINT32_MAX)) {
+		return Jars_add_at(js, dir_fd, dat_name, dat_file_path);
+	}
+	j.num_fortunes = (info.st_size - header_space) / width - 1;
+	j.delim = STRFILE_DEFAULT_DELIM;
+	j.file_size = -1;
+	j.lazy = 1;
+	return Jars_add_known(js, dat_file_path, &j);
+}
 
-	/* Choose a fortune cookie file at random. */
-	if (opts.e) {
-		/* Choose uniformly randomly from the files. */
-		jar_no = js->count * (rand() / (RAND_MAX + 1.0));
-	} else {
-		/* Choose a file with probability in proportion to the number
-		   of fortune cookies it has. */
-		prob = rand() / (float) RAND_MAX;
-		for (jar_no = 0; jar_no < js->count; jar_no++) {
-			chance = js->j[jar_no].num_fortunes / (float) js->num_fortunes;
-			if (cum_chance + chance >= prob) {
-				break;
-			}
-			cum_chance += chance;
+/* Find the first delimiter line (a line consisting of just `delim`) in
+   the fortune file text running from `text` to `end`, which starts at
+   or after `p`. Return a pointer to the line's delimiter character, or
+   NULL if there's no such line. */
+const char* find_delim_line_scalar(const char* text, const char* p,
+                                   const char* end, char delim)
+{
+	while ((p < end) && ((p = memchr(p, delim, end - p)) != NULL)) {
+		if (((p == text) || (p[-1] == '\n'))
+		    && (p + 1 < end) && (p[1] == '\n')) {
+			return p;
 		}
+		p++;
 	}
+	return NULL;
+}
 
-	if (jar_no >= js->count) {
-		/* If every available fortune cookie file was passed over, the
-		   program must have calculated the probabilities wrongly, which
-		   means it miscounted the number of available fortune cookies. */
-		fprintf(stderr, "Miscounted the number of available fortune "
-		        "cookies as %u.\n", js->num_fortunes);
-		return 0;
-	}
+#if defined(__x86_64__) && defined(__SSE2__)
 
-	dat = js->j[jar_no].dat;
+/* The vectorized searches below test every byte of a block at once for
+   being the delimiter, with a newline before and after it, by loading
+   the block three times over, offset by a byte each way. The first
+   byte of the text has no byte before it, so it's checked alone. */
 
-	if ((fh = fopen(dat, "rb")) == NULL) {
-		fprintf(stderr, "Cannot open fortune data file %s.\n", dat);
+const char* find_delim_line_sse2(const char* text, const char* p,
+                                 const char* end, char delim)
+{
+	const __m128i d = _mm_set1_epi8(delim);
+	unsigned int mask;
+	const __m128i nl = _mm_set1_epi8('\n');
+
+	if ((p == text) && (p + 1 < end) && (p[0] == delim) && (p[1] == '\n')) {
+		return p;
+	}
+	if (p == text) {
+		p++;
+	}
+	while (p + 17 <= end) {
+		mask = _mm_movemask_epi8(_mm_and_si128(
+			_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) p), d),
+			_mm_and_si128(
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (p - 1)), nl),
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (p + 1)), nl))));
+		if (mask) {
+			return p + __builtin_ctz(mask);
+		}
+		p += 16;
+	}
+	return find_delim_line_scalar(text, p, end, delim);
+}
+
+__attribute__((target("avx2")))
+const char* find_delim_line_avx2(const char* text, const char* p,
+                                 const char* end, char delim)
+{
+	const __m256i d = _mm256_set1_epi8(delim);
+	unsigned int mask;
+	const __m256i nl = _mm256_set1_epi8('\n');
+
+	if ((p == text) && (p + 1 < end) && (p[0] == delim) && (p[1] == '\n')) {
+		return p;
+	}
+	if (p == text) {
+		p++;
+	}
+	while (p + 33 <= end) {
+		mask = _mm256_movemask_epi8(_mm256_and_si256(
+			_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) p), d),
+			_mm256_and_si256(
+				_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (p - 1)),
+				                  nl),
+				_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (p + 1)),
+				                  nl))));
+		if (mask) {
+			return p + __builtin_ctz(mask);
+		}
+		p += 32;
+	}
+	return find_delim_line_sse2(text, p, end, delim);
+}
+
+#endif
+
+const char* find_delim_line(const char* text, const char* p,
+                            const char* end, char delim)
+{
+#if defined(__x86_64__) && defined(__SSE2__)
+	if (__builtin_cpu_supports("avx2")) {
+		return find_delim_line_avx2(text, p, end, delim);
+	}
+	return find_delim_line_sse2(text, p, end, delim);
+#else
+	return find_delim_line_scalar(text, p, end, delim);
+#endif
+}
+
+/* Decode the `num_bytes` bytes of rot13 text at `src` into `dst`, which
+   may be `src` itself (and rot13 being its own inverse, encode it). */
+void rot13_scalar(char* dst, const char* src, size_t num_bytes)
+{
+	size_t byte_idx;
+	unsigned char c;
+
+	for (byte_idx = 0; byte_idx < num_bytes; byte_idx++) {
+		c = src[byte_idx] | 0x20;
+		if ((c >= 'a') && (c <= 'm')) {
+			dst[byte_idx] = src[byte_idx] + 13;
+		} else if ((c >= 'n') && (c <= 'z')) {
+			dst[byte_idx] = src[byte_idx] - 13;
+		} else {
+			dst[byte_idx] = src[byte_idx];
+		}
+	}
+}
+
+#if defined(__x86_64__) && defined(__SSE2__)
+
+/* Fold each block of letters to lowercase, and add 13 to those from a
+   to m and -13 to those from n to z. The comparisons are signed, so
+   bytes over 127 are never letters. */
+void rot13_sse2(char* dst, const char* src, size_t num_bytes)
+{
+	const __m128i a = _mm_set1_epi8('a' - 1);
+	const __m128i case_bit = _mm_set1_epi8(0x20);
+	__m128i lower;
+	const __m128i m = _mm_set1_epi8('m' + 1);
+	const __m128i n = _mm_set1_epi8('n' - 1);
+	const __m128i plus = _mm_set1_epi8(13);
+	const __m128i minus = _mm_set1_epi8(-13);
+	size_t num_done = 0;
+	__m128i v;
+	const __m128i z = _mm_set1_epi8('z' + 1);
+
+	while (num_done + 16 <= num_bytes) {
+		v = _mm_loadu_si128((const __m128i*) (src + num_done));
+		lower = _mm_or_si128(v, case_bit);
+		v = _mm_add_epi8(v, _mm_or_si128(
+			_mm_and_si128(_mm_and_si128(_mm_cmpgt_epi8(lower, a),
+			                            _mm_cmplt_epi8(lower, m)), plus),
+			_mm_and_si128(_mm_and_si128(_mm_cmpgt_epi8(lower, n),
+			                            _mm_cmplt_epi8(lower, z)), minus)));
+		_mm_storeu_si128((__m128i*) (dst + num_done), v);
+		num_done += 16;
+	}
+	rot13_scalar(dst + num_done, src + num_done, num_bytes - num_done);
+}
+
+__attribute__((target("avx2")))
+void rot13_avx2(char* dst, const char* src, size_t num_bytes)
+{
+	const __m256i a = _mm256_set1_epi8('a' - 1);
+	const __m256i case_bit = _mm256_set1_epi8(0x20);
+	__m256i lower;
+	const __m256i m = _mm256_set1_epi8('m' + 1);
+	const __m256i n = _mm256_set1_epi8('n' - 1);
+	const __m256i plus = _mm256_set1_epi8(13);
+	const __m256i minus = _mm256_set1_epi8(-13);
+	size_t num_done = 0;
+	__m256i v;
+	const __m256i z = _mm256_set1_epi8('z' + 1);
+
+	while (num_done + 32 <= num_bytes) {
+		v = _mm256_loadu_si256((const __m256i*) (src + num_done));
+		lower = _mm256_or_si256(v, case_bit);
+		v = _mm256_add_epi8(v, _mm256_or_si256(
+			_mm256_and_si256(_mm256_and_si256(_mm256_cmpgt_epi8(lower, a),
+			                                  _mm256_cmpgt_epi8(m, lower)),
+			                 plus),
+			_mm256_and_si256(_mm256_and_si256(_mm256_cmpgt_epi8(lower, n),
+			                                  _mm256_cmpgt_epi8(z, lower)),
+			                 minus)));
+		_mm256_storeu_si256((__m256i*) (dst + num_done), v);
+		num_done += 32;
+	}
+	rot13_sse2(dst + num_done, src + num_done, num_bytes - num_done);
+}
+
+#endif
+
+void rot13(char* dst, const char* src, size_t num_bytes)
+{
+#if defined(__x86_64__) && defined(__SSE2__)
+	if (__builtin_cpu_supports("avx2")) {
+		rot13_avx2(dst, src, num_bytes);
+		return;
+	}
+	rot13_sse2(dst, src, num_bytes);
+#else
+	rot13_scalar(dst, src, num_bytes);
+#endif
+}
+
+/* Append `offset` (in big-endian order, as strfile writes it, and 64
+   bits wide if `j` is) to the dat file image being built in
+   `j->index`, which has room for `*capacity` bytes. */
+unsigned char Jar_index_offset(Jar* j, size_t* capacity, uint64_t offset)
+{
+	char* new_index;
+	uint32_t narrow = htonl(offset);
+	uint64_t wide = htobe64(offset);
+	size_t width = j->wide ? sizeof(uint64_t) : sizeof(uint32_t);
+
+	if (j->index_size + width > *capacity) {
+		*capacity *= 2;
+		if ((new_index = realloc(j->index, *capacity)) == NULL) {
+			return 0;
+		}
+		j->index = new_index;
+	}
+	memcpy(j->index + j->index_size, j->wide ? (void*) &wide : &narrow,
+	       width);
+	j->index_size += width;
+	return 1;
+}
+
+/* Index the `size` bytes of fortune file text at `text`, whose cookies
+   are separated by lines consisting of `delim`, the way strfile(1)
+   would. Put an image of the dat file strfile would've written in
+   `j->index` (and its size in `j->index_size`), and fill in `j`'s
+   header fields. Text too big for 32-bit offsets gets a wide dat file
+   image instead. Text without a single delimiter line probably isn't
+   a fortune file; leave it unindexed. */
+unsigned char Jar_index(Jar* j, const char* text, size_t size, char delim)
+{
+	size_t capacity = STRFILE_HEADER_SPACE + 256 + size / 32;
+	const char* end = text + size;
+	unsigned char found_delim = 0;
+	size_t last_off = 0;
+	size_t len;
+	const char* p = text;
+	uint32_t word;
+
+	if ((j->index = malloc(capacity)) == NULL) {
+		report("Cannot allocate memory for fortune file index.\n");
+		return 0;
+	}
+	j->wide = (size > UINT32_MAX);
+	j->index_size = j->wide ? STRFILE_WIDE_HEADER_SPACE
+	                        : STRFILE_HEADER_SPACE;
+	j->num_fortunes = 0;
+	j->max_len = 0;
+	j->min_len = UINT32_MAX;
+	j->delim = delim;
+	if (!Jar_index_offset(j, &capacity, 0)) {
+		goto out_of_memory;
+	}
+
+	/* Each cookie runs from the end of one delimiter line to the start
+	   of the next (or the end of the text). Like strfile, skip empty
+	   cookies without recording an offset for them. */
+	for (;;) {
+		p = find_delim_line(text, p, end, delim);
+		len = ((p == NULL) ? end : p) - (text + last_off);
+		if (p != NULL) {
+			found_delim = 1;
+			p += 2;
+		}
+		if (len) {
+			if (j->num_fortunes == UINT32_MAX) {
+				report("Fortune file has too many cookies to index.\n");
+				free(j->index);
+				j->index = NULL;
+				return 0;
+			}
+			if (!Jar_index_offset(j, &capacity,
+			                      (p == NULL) ? size : (size_t) (p - text))) {
+				goto out_of_memory;
+			}
+			j->num_fortunes++;
+			if (len > j->max_len) {
+				j->max_len = (len > UINT32_MAX) ? UINT32_MAX : len;
+			}
+			if (len < j->min_len) {
+				j->min_len = len;
+			}
+		}
+		if (p == NULL) {
+			break;
+		}
+		last_off = p - text;
+	}
+	if (!found_delim) {
+		free(j->index);
+		j->index = NULL;
+		return 0;
+	}
+	if (!j->num_fortunes) {
+		j->min_len = 0;
+	}
+
+	/* Fill in the header: version, count, longest and shortest lengths,
+	   flags, and the delimiter, padded to a whole word (or for a wide
+	   dat file, by a byte). */
+	memset(j->index, 0, j->wide ? STRFILE_WIDE_HEADER_SPACE
+	                            : STRFILE_HEADER_SPACE);
+	word = htonl(j->wide ? STRFILE_VERSION_WIDE : STRFILE_VERSION);
+	memcpy(j->index, &word, sizeof(uint32_t));
+	word = htonl(j->num_fortunes);
+	memcpy(j->index + sizeof(uint32_t), &word, sizeof(uint32_t));
+	word = htonl(j->max_len);
+	memcpy(j->index + 2*sizeof(uint32_t), &word, sizeof(uint32_t));
+	word = htonl(j->min_len);
+	memcpy(j->index + 3*sizeof(uint32_t), &word, sizeof(uint32_t));
+	j->index[5*sizeof(uint32_t)] = delim;
+	return 1;
+
+out_of_memory:
+	report("Cannot allocate memory for fortune file index.\n");
+	free(j->index);
+	j->index = NULL;
+	return 0;
+}
+
+/* Write the index built for `j` out as the dat file named `dat_name`
+   in the directory `dir_fd`, so later runs can use it like any other.
+   It's written under a temporary name first, so no other run can see
+   a partly written dat file. */
+unsigned char Jar_write_index(const Jar* j, int dir_fd, const char* dat_name)
+{
+	int fd;
+	unsigned char ok;
+	char* tmp_name;
+
+	if ((tmp_name = malloc(strlen(dat_name) + 32)) == NULL) {
+		return 0;
+	}
+	sprintf(tmp_name, "%s.%ld.tmp", dat_name, (long) getpid());
+	if ((fd = openat(dir_fd, tmp_name, O_WRONLY | O_CREAT | O_EXCL
+	                                   | O_CLOEXEC, 0644)) < 0) {
+		report("Cannot create fortune data file %s%s.dat.\n",
+		       j->dir, j->name);
+		free(tmp_name);
+		return 0;
+	}
+	ok = (write(fd, j->index, j->index_size) == (ssize_t) j->index_size);
+	ok = !close(fd) && ok;
+	if (!ok || renameat(dir_fd, tmp_name, dir_fd, dat_name)) {
+		report("Cannot write fortune data file %s%s.dat.\n",
+		       j->dir, j->name);
+		unlinkat(dir_fd, tmp_name, 0);
+		ok = 0;
+	}
+	free(tmp_name);
+	return ok;
+}
+
+/* Index the fortune file named `text_name` in the directory `dir_fd`,
+   which has no dat file, and add it to `js` as if it had; give it the
+   dat file path `dat_file_path` it would have if it did. If
+   `write_dat` is set, write the dat file too. Files that don't look
+   like fortune files are skipped without complaint. */
+unsigned char Jars_index_at(Jars* js, int dir_fd, const char* text_name,
+                            const char* dat_file_path,
+                            unsigned char write_dat)
+{
+	int fd;
+	struct stat info;
+	Jar* j;
+	void* map;
+	unsigned char ok;
+	char* text;
+
+	STATS_COUNT(files_opened, 1);
+	if ((fd = openat(dir_fd, text_name, O_RDONLY | O_CLOEXEC)) < 0) {
+		return 0;
+	}
+	STATS_COUNT(stats, 1);
+	if (fstat(fd, &info) || !S_ISREG(info.st_mode) || (info.st_size == 0)
+	    || !Jars_reserve(js)) {
+		close(fd);
+		return 0;
+	}
+
+	/* Map the text, falling back to reading it all in. */
+	map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map != MAP_FAILED) {
+		text = map;
+	} else if (((text = malloc(info.st_size)) == NULL)
+	           || (pread(fd, text, info.st_size, 0) != info.st_size)) {
+		report("Cannot read fortune file %s.\n", text_name);
+		free(text);
+		close(fd);
+		return 0;
+	}
+	close(fd);
+	STATS_COUNT(bytes_read, info.st_size);
+
+	j = &(js->j[js->count]);
+	memset(j, 0, sizeof(Jar));
+	ok = Jar_index(j, text, info.st_size, STRFILE_DEFAULT_DELIM);
+	if (map != MAP_FAILED) {
+		munmap(map, info.st_size);
+	} else {
+		free(text);
+	}
+	if (!ok) {
+		return 0;
+	}
+	if (!Jars_set_path(js, j, dat_file_path)) {
+		free(j->index);
+		return 0;
+	}
+	j->file_size = info.st_size;
+	j->indexed = 1;
+
+	if (write_dat
+	    && Jar_write_index(j, dir_fd, dat_file_path + strlen(dat_file_path)
+	                                  - strlen(text_name) - 4)) {
+		/* Now there's a dat file, it's an ordinary jar. */
+		free(j->index);
+		j->index = NULL;
+		j->index_size = 0;
+		j->indexed = 0;
+	}
+
+	js->count++;
+	js->num_fortunes += j->num_fortunes;
+	return 1;
+}
+
+/* Move all of `from`'s jars onto the end of `js`, leaving `from` empty.
+   Their strings move over with them, and their directories are
+   numbered afresh among `js`'s. */
+unsigned char Jars_merge(Jars* js, Jars* from)
+{
+	unsigned int* dir_ids;
+	unsigned int dir_no;
+	Jar* j;
+	unsigned int jar_no;
+	Jar* new_jar_list;
+
+	if (js->count + from->count > js->capacity) {
+		if ((new_jar_list = realloc(js->j, (js->count + from->count)
+		                                   * sizeof(Jar))) == NULL) {
+			report("Cannot reallocate %lu bytes of memory "
+			       "for fortune file list.\n",
+			       (js->count + from->count) * sizeof(Jar));
+			return 0;
+		}
+		js->j = new_jar_list;
+		js->capacity = js->count + from->count;
+	}
+	Arena_take(&(js->strings), &(from->strings));
+	if ((dir_ids = malloc((from->num_dirs + 1) * sizeof(unsigned int)))
+	    == NULL) {
+		report("Cannot allocate memory for fortune file directories.\n");
+		return 0;
+	}
+	for (dir_no = 0; dir_no < from->num_dirs; dir_no++) {
+		if (!Jars_intern_dir(js, from->dirs[dir_no].path,
+		                     from->dirs[dir_no].len, 0, &(dir_ids[dir_no]))) {
+			report("Cannot allocate memory for fortune file directories.\n");
+			free(dir_ids);
+			return 0;
+		}
+	}
+	if (from->count) {
+		memcpy(js->j + js->count, from->j, from->count * sizeof(Jar));
+	}
+	for (jar_no = 0; jar_no < from->count; jar_no++) {
+		j = &(js->j[js->count + jar_no]);
+		j->dir_id = dir_ids[j->dir_id];
+		j->dir = js->dirs[j->dir_id].path;
+	}
+	free(dir_ids);
+	free(from->dirs);
+	free(from->dir_slots);
+	from->dirs = NULL;
+	from->dir_slots = NULL;
+	from->num_dirs = 0;
+	from->dirs_capacity = 0;
+	from->num_dir_slots = 0;
+	js->count += from->count;
+	js->num_fortunes += from->num_fortunes;
+	from->count = 0;
+	from->num_fortunes = 0;
+	return 1;
+}
+
+/* Rank the path character `c` as compare_path_components() does: as
+   strcmp() would, but with '/' before any other character. */
+int path_char_rank(unsigned char c)
+{
+	if (c == '/') {
+		return 1;
+	}
+	return (c && (c < '/')) ? c + 1 : c;
+}
+
+/* Compare the paths `a` and `b` component by component: "d/j" comes
+   before "d-x/j", since "d" comes before "d-x", though strcmp() would
+   have it the other way around. A path comes before any path inside
+   it, so in this order what's reached by following a path further
+   never comes before the start of it. */
+int compare_path_components(const char* a, const char* b)
+{
+	while (*a && (*a == *b)) {
+		a++;
+		b++;
+	}
+	return path_char_rank(*a) - path_char_rank(*b);
+}
+
+/* Compare jars `a` and `b` as strcmp() would compare the paths of
+   their dat files, without putting the paths together; or, with
+   `by_component`, as compare_path_components() would. */
+int Jar_compare_paths_as(const Jar* a, const Jar* b,
+                         unsigned char by_component)
+{
+	const char* p[3];
+	unsigned int p_part = 0;
+	const char* q[3];
+	unsigned int q_part = 0;
+	const char* x;
+	const char* y;
+
+	p[0] = a->dir;
+	p[1] = a->name;
+	p[2] = ".dat";
+	q[0] = b->dir;
+	q[1] = b->name;
+	q[2] = ".dat";
+
+	/* Jars in the same directory share its path. */
+	if (p[0] == q[0]) {
+		p_part = q_part = 1;
+	}
+	x = p[p_part];
+	y = q[q_part];
+	for (;;) {
+		while (!*x && (p_part < 2)) {
+			x = p[++p_part];
+		}
+		while (!*y && (q_part < 2)) {
+			y = q[++q_part];
+		}
+		if ((*x != *y) || !*x) {
+			return by_component
+			       ? path_char_rank(*x) - path_char_rank(*y)
+			       : (unsigned char) *x - (unsigned char) *y;
+		}
+		x++;
+		y++;
+	}
+}
+
+int Jar_compare_paths(const void* a, const void* b)
+{
+	return Jar_compare_paths_as(a, b, 0);
+}
+
+/* Advance a splitmix64 generator, whose state is `x`. It's only used
+   to spread a seed over the state of the main generator. */
+uint64_t splitmix64(uint64_t* x)
+{
+	uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+void Rng_seed(Rng* r, uint64_t seed)
+{
+	unsigned int i;
+
+	for (i = 0; i < 4; i++) {
+		r->s[i] = splitmix64(&seed);
+	}
+}
+
+/* Draw 64 random bits from `r`, by Blackman & Vigna's xoshiro256**. */
+uint64_t Rng_next(Rng* r)
+{
+	uint64_t result = r->s[1] * 5;
+	uint64_t t = r->s[1] << 17;
+
+	result = ((result << 7) | (result >> 57)) * 9;
+	r->s[2] ^= r->s[0];
+	r->s[3] ^= r->s[1];
+	r->s[1] ^= r->s[2];
+	r->s[0] ^= r->s[3];
+	r->s[2] ^= t;
+	r->s[3] = (r->s[3] << 45) | (r->s[3] >> 19);
+	return result;
+}
+
+/* Draw an integer uniformly at random from 0 to `n` - 1 from `r`: take
+   just enough random bits to span `n`, and reject any value beyond it
+   (which, unlike taking a remainder or scaling a float, introduces no
+   bias, and on average takes fewer than two tries). */
+uint64_t Rng_below(Rng* r, uint64_t n)
+{
+	uint64_t mask;
+	uint64_t x;
+
+	if (n < 2) {
+		return 0;
+	}
+	mask = ~(uint64_t) 0 >> __builtin_clzll(n - 1);
+	do {
+		x = Rng_next(r) & mask;
+	} while (x >= n);
+	return x;
+}
+
+/* How many of jar `j`'s cookies may be drawn. */
+unsigned int Jar_num_drawable(const Jar* j)
+{
+	return (j->drawable != NULL) ? j->num_drawable : j->num_fortunes;
+}
+
+/* Build an alias table with Vose's method, in integers so the chances
+   come out exactly proportional to the weights, for choosing among `n`
+   things whose weights are in `cut` to begin with, and total `total`.
+   Scaling each weight by `n` makes every column of the table worth
+   exactly `total`; the things are then split into those under that
+   (filling less than a column) and those over it, and each under-full
+   column is topped up from an over-full thing, whose number plus `base`
+   goes in `alias`. `work` is room for `n` numbers. */
+void build_alias(uint64_t* cut, unsigned int* alias, unsigned int* work,
+                 unsigned int n, uint64_t total, unsigned int base)
+{
+	unsigned int i;
+	unsigned int large;
+	unsigned int num_large = 0;
+	unsigned int num_small = 0;
+	unsigned int small;
+
+	/* Scale the weights, and stack the under-full things from the
+	   bottom of `work` and the over-full ones from the top. */
+	for (i = 0; i < n; i++) {
+		cut[i] *= n;
+		alias[i] = base + i;
+		if (cut[i] < total) {
+			work[num_small++] = i;
+		} else {
+			work[n - 1 - num_large++] = i;
+		}
+	}
+
+	/* Pair each under-full thing with an over-full one, which donates
+	   the rest of the under-full thing's column and may itself become
+	   under-full as a result. Once either stack runs out, every thing
+	   left must fill exactly one column. */
+	while (num_small && num_large) {
+		small = work[--num_small];
+		large = work[n - num_large];
+		alias[small] = base + large;
+		cut[large] -= total - cut[small];
+		if (cut[large] < total) {
+			num_large--;
+			work[num_small++] = large;
+		}
+	}
+	while (num_large) {
+		cut[work[n - num_large--]] = total;
+	}
+	while (num_small) {
+		cut[work[--num_small]] = total;
+	}
+}
+
+/* Find which of `js`'s jars are in each of its groups, and weigh the
+   groups: a group given a percentage weighs that much, and what's left
+   of 100% is shared among the rest in proportion to their cookies (or,
+   for -e, their jars), as fortune does. To keep the weights whole, the
+   percentages are scaled by the rest's total cookies (or jars) rather
+   than the rest's shares being divided by it. A group with no cookies
+   to draw weighs nothing. Return 0 if none of the groups weighs
+   anything either way. */
+unsigned char Jars_weigh_groups(Jars* js)
+{
+	unsigned int e_opt;
+	JarGroup* g;
+	unsigned int group_no;
+	unsigned int jar_no;
+	unsigned int percent_left = 100;
+	uint64_t unweighted[2] = { 0, 0 };
+
+	for (group_no = 0; group_no < js->num_groups; group_no++) {
+		g = &(js->groups[group_no]);
+		g->first_jar = 0;
+		g->num_jars = 0;
+		g->num_fortunes = 0;
+	}
+	for (jar_no = js->count; jar_no-- > 0; ) {
+		g = &(js->groups[js->j[jar_no].group]);
+		g->first_jar = jar_no;
+		g->num_jars++;
+		g->num_fortunes += Jar_num_drawable(&(js->j[jar_no]));
+	}
+	for (group_no = 0; group_no < js->num_groups; group_no++) {
+		g = &(js->groups[group_no]);
+		if (g->weighted) {
+			percent_left -= g->percent;
+		} else {
+			unweighted[0] += g->num_fortunes;
+			unweighted[1] += g->num_jars;
+		}
+	}
+
+	for (e_opt = 0; e_opt < 2; e_opt++) {
+		js->group_total[e_opt] = 0;
+		for (group_no = 0; group_no < js->num_groups; group_no++) {
+			g = &(js->groups[group_no]);
+			if (!g->num_fortunes) {
+				g->weight[e_opt] = 0;
+			} else if (g->weighted) {
+				g->weight[e_opt] = g->percent * (unweighted[e_opt]
+				                                 ? unweighted[e_opt] : 1);
+			} else {
+				g->weight[e_opt] = (uint64_t) percent_left
+				                   * (e_opt ? g->num_jars : g->num_fortunes);
+			}
+			js->group_total[e_opt] += g->weight[e_opt];
+		}
+	}
+	return js->group_total[0] && js->group_total[1];
+}
+
+/* Build `js`'s alias tables, making the jars' selection probabilities
+   (within their groups, if they're in any) exactly proportional to
+   their drawable cookie counts. Since each jar's count and `count`
+   both fit in 32 bits, the scaled counts fit in 64, however many
+   cookies there are in all. */
+unsigned char Jars_build_alias(Jars* js)
+{
+	unsigned int e_opt;
+	const JarGroup* g;
+	unsigned int group_no;
+	unsigned int jar_no;
+	unsigned int* work;
+
+	free(js->cut);
+	free(js->alias);
+	for (e_opt = 0; e_opt < 2; e_opt++) {
+		free(js->group_cut[e_opt]);
+		free(js->group_alias[e_opt]);
+		js->group_cut[e_opt] = malloc((js->num_groups + 1)
+		                              * sizeof(uint64_t));
+		js->group_alias[e_opt] = malloc((js->num_groups + 1)
+		                                * sizeof(unsigned int));
+	}
+	js->cut = malloc((js->count + 1) * sizeof(uint64_t));
+	js->alias = malloc((js->count + 1) * sizeof(unsigned int));
+	work = malloc(((js->count > js->num_groups) ? js->count : js->num_groups)
+	              * sizeof(unsigned int) + sizeof(unsigned int));
+	if ((js->cut == NULL) || (js->alias == NULL) || (work == NULL)
+	    || (js->group_cut[0] == NULL) || (js->group_alias[0] == NULL)
+	    || (js->group_cut[1] == NULL) || (js->group_alias[1] == NULL)) {
+		report("Cannot allocate memory for fortune file alias table.\n");
+		free(js->cut);
+		free(js->alias);
+		free(work);
+		js->cut = NULL;
+		js->alias = NULL;
+		return 0;
+	}
+	for (jar_no = 0; jar_no < js->count; jar_no++) {
+		js->cut[jar_no] = Jar_num_drawable(&(js->j[jar_no]));
+	}
+
+	if (!js->num_groups) {
+		build_alias(js->cut, js->alias, work, js->count, js->num_fortunes,
+		            0);
+		free(work);
+		return 1;
+	}
+
+	if (!Jars_weigh_groups(js)) {
+		report("None of the fortune files with a chance of being chosen "
+		       "has any cookies.\n");
+		free(work);
+		return 0;
+	}
+	for (e_opt = 0; e_opt < 2; e_opt++) {
+		for (group_no = 0; group_no < js->num_groups; group_no++) {
+			js->group_cut[e_opt][group_no] = js->groups[group_no].weight[e_opt];
+		}
+		build_alias(js->group_cut[e_opt], js->group_alias[e_opt], work,
+		            js->num_groups, js->group_total[e_opt], 0);
+	}
+	for (group_no = 0; group_no < js->num_groups; group_no++) {
+		g = &(js->groups[group_no]);
+		build_alias(js->cut + g->first_jar, js->alias + g->first_jar, work,
+		            g->num_jars, g->num_fortunes, g->first_jar);
+	}
+	free(work);
+	return 1;
+}
+
+/* Choose one of `js`'s groups at random, drawing from `r`, with
+   probability in proportion to its weight (for -e, if `e_opt` is
+   set). */
+const JarGroup* Jars_choose_group(const Jars* js, unsigned char e_opt,
+                                  Rng* r)
+{
+	unsigned int column = Rng_below(r, js->num_groups);
+
+	if (Rng_below(r, js->group_total[e_opt]) >= js->group_cut[e_opt][column]) {
+		column = js->group_alias[e_opt][column];
+	}
+	return &(js->groups[column]);
+}
+
+/* Choose a jar at random from `js`, drawing from `r`, with probability
+   in proportion to the number of fortune cookies it has (once its
+   group, if it's in one, has been chosen). */
+unsigned int Jars_choose(const Jars* js, Rng* r)
+{
+	unsigned int column;
+	const JarGroup* g;
+
+	if (js->num_groups) {
+		g = Jars_choose_group(js, 0, r);
+		column = g->first_jar + Rng_below(r, g->num_jars);
+		if (Rng_below(r, g->num_fortunes) < js->cut[column]) {
+			return column;
+		}
+		return js->alias[column];
+	}
+	column = Rng_below(r, js->count);
+	if (Rng_below(r, js->num_fortunes) < js->cut[column]) {
+		return column;
+	}
+	return js->alias[column];
+}
+
+/* Choose one of the cookies that may be drawn from jar `j`, uniformly at
+   random, and return its number. */
+uint32_t Jar_draw(const Jar* j, Rng* r)
+{
+	if (j->drawable != NULL) {
+		return j->drawable[Rng_below(r, j->num_drawable)];
+	}
+	return Rng_below(r, j->num_fortunes);
+}
+
+void GzText_free(GzText* gz)
+{
+	if (gz != NULL) {
+		inflateEnd(&(gz->zs));
+		free(gz->index);
+		free(gz->frame);
+		free(gz->in);
+		free(gz);
+	}
+}
+
+/* Read the index of the seekable gzip fortune file `fd`, which is
+   `size` bytes long and whose path is `path`, checking that its frames
+   and their text follow one another. */
+GzText* GzText_open(int fd, off_t size, const char* path)
+{
+	GzFooter footer;
+	GzText* gz;
+	uint64_t frame_no;
+	size_t index_size;
+
+	STATS_COUNT(bytes_read, sizeof(GzFooter));
+	if ((size < (off_t) (sizeof(GzFrame) + sizeof(GzFooter)))
+	    || (pread(fd, &footer, sizeof(GzFooter), size - sizeof(GzFooter))
+	        != sizeof(GzFooter))
+	    || memcmp(footer.magic, GZ_INDEX_MAGIC, sizeof(footer.magic))
+	    || (be64toh(footer.num_frames)
+	        >= (size - sizeof(GzFooter)) / sizeof(GzFrame))) {
+		report("Compressed fortune file %s has no index; "
+		       "rewrite it with -z.\n", path);
+		return NULL;
+	}
+	if ((gz = calloc(1, sizeof(GzText))) == NULL) {
+		report("Cannot allocate memory to read %s.\n", path);
+		return NULL;
+	}
+	gz->num_frames = be64toh(footer.num_frames);
+	gz->frame_no = gz->num_frames;
+	index_size = (gz->num_frames + 1) * sizeof(GzFrame);
+	if (((gz->index = malloc(index_size)) == NULL)
+	    || (inflateInit2(&(gz->zs), 16 + MAX_WBITS) != Z_OK)) {
+		report("Cannot allocate memory to read %s.\n", path);
+		free(gz->index);
+		free(gz);
+		return NULL;
+	}
+	STATS_COUNT(bytes_read, index_size);
+	if (pread(fd, gz->index, index_size,
+	          size - sizeof(GzFooter) - index_size) != (ssize_t) index_size) {
+		report("Cannot read index of compressed fortune file %s.\n", path);
+		GzText_free(gz);
+		return NULL;
+	}
+	for (frame_no = 0; frame_no <= gz->num_frames; frame_no++) {
+		gz->index[frame_no].gz_off = be64toh(gz->index[frame_no].gz_off);
+		gz->index[frame_no].text_off = be64toh(gz->index[frame_no].text_off);
+		if (frame_no
+		    ? ((gz->index[frame_no].gz_off <= gz->index[frame_no-1].gz_off)
+		       || (gz->index[frame_no].text_off
+		           < gz->index[frame_no-1].text_off))
+		    : (gz->index[0].gz_off || gz->index[0].text_off)) {
+			break;
+		}
+	}
+	if ((frame_no <= gz->num_frames)
+	    || (gz->index[gz->num_frames].gz_off
+	        != size - sizeof(GzFooter) - index_size)
+	    || (gz->index[gz->num_frames].text_off > SIZE_MAX)) {
+		report("Index of compressed fortune file %s is corrupt.\n", path);
+		GzText_free(gz);
+		return NULL;
+	}
+	return gz;
+}
+
+/* Inflate the frame of `gz`, whose file is `fd`, holding the text at
+   `offset`, unless it's the frame inflated last. */
+unsigned char GzText_load(GzText* gz, int fd, uint64_t offset)
+{
+	uint64_t hi = gz->num_frames;
+	uint64_t lo = 0;
+	uint64_t mid;
+	size_t in_size;
+	void* p;
+	size_t text_size;
+
+	if ((gz->frame_no < gz->num_frames)
+	    && (gz->index[gz->frame_no].text_off <= offset)
+	    && (offset < gz->index[gz->frame_no + 1].text_off)) {
+		return 1;
+	}
+
+	/* Find the last frame starting at or before `offset`. */
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (gz->index[mid].text_off <= offset) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	in_size = gz->index[lo + 1].gz_off - gz->index[lo].gz_off;
+	text_size = gz->index[lo + 1].text_off - gz->index[lo].text_off;
+	if ((in_size > UINT32_MAX) || (text_size > UINT32_MAX)) {
+		report("Compressed fortune file frame is too big to read.\n");
+		return 0;
+	}
+	if (in_size > gz->in_size) {
+		if ((p = realloc(gz->in, in_size)) == NULL) {
+			report("Cannot allocate memory for compressed frame.\n");
+			return 0;
+		}
+		gz->in = p;
+		gz->in_size = in_size;
+	}
+	if (text_size > gz->frame_size) {
+		if ((p = realloc(gz->frame, text_size)) == NULL) {
+			report("Cannot allocate memory for decompressed frame.\n");
+			return 0;
+		}
+		gz->frame = p;
+		gz->frame_size = text_size;
+	}
+
+	/* The frame's no longer the one inflated last, whatever happens. */
+	gz->frame_no = gz->num_frames;
+	STATS_COUNT(bytes_read, in_size);
+	if (pread(fd, gz->in, in_size, gz->index[lo].gz_off)
+	    != (ssize_t) in_size) {
+		report("Cannot read compressed fortune file frame.\n");
+		return 0;
+	}
+	gz->zs.next_in = gz->in;
+	gz->zs.avail_in = in_size;
+	gz->zs.next_out = (unsigned char*) gz->frame;
+	gz->zs.avail_out = text_size;
+	if ((inflateReset(&(gz->zs)) != Z_OK)
+	    || (inflate(&(gz->zs), Z_FINISH) != Z_STREAM_END)
+	    || gz->zs.avail_in || gz->zs.avail_out) {
+		report("Compressed fortune file frame is corrupt.\n");
+		return 0;
+	}
+	gz->frame_no = lo;
+	return 1;
+}
+
+/* Copy up to `num_bytes` of `m`'s fortune file text, from `offset` on,
+   to `dst`, however the text's kept. Return how many bytes were copied
+   (fewer only at the end of the text), or -1 if they couldn't be read. */
+ssize_t JarMap_read(JarMap* m, char* dst, size_t num_bytes, uint64_t offset)
+{
+	size_t chunk;
+	size_t done = 0;
+	const GzFrame* f;
+
+	if (offset >= m->text_size) {
+		return 0;
+	}
+	if (num_bytes > m->text_size - offset) {
+		num_bytes = m->text_size - offset;
+	}
+	if (m->text_map != NULL) {
+		memcpy(dst, m->text_map + offset, num_bytes);
+		return num_bytes;
+	}
+	if (m->gz == NULL) {
+		return pread(m->text_fd, dst, num_bytes, offset);
+	}
+	while (done < num_bytes) {
+		if (!GzText_load(m->gz, m->text_fd, offset + done)) {
+			return -1;
+		}
+		f = &(m->gz->index[m->gz->frame_no]);
+		chunk = f[1].text_off - (offset + done);
+		if (chunk > num_bytes - done) {
+			chunk = num_bytes - done;
+		}
+		memcpy(dst + done, m->gz->frame + (offset + done - f->text_off),
+		       chunk);
+		done += chunk;
+	}
+	return done;
+}
+
+void JarMap_close(JarMap* m)
+{
+	if ((m->dat_map != NULL) && !m->dat_in_memory) {
+		munmap((void*) m->dat_map, m->dat_size);
+	}
+	m->dat_map = NULL;
+	m->dat_in_memory = 0;
+	free(m->own_index);
+	m->own_index = NULL;
+	if ((m->text_map != NULL) && !m->packed) {
+		munmap((void*) m->text_map, m->text_size);
+	}
+	m->text_map = NULL;
+	m->packed = 0;
+	GzText_free(m->gz);
+	m->gz = NULL;
+	if (m->dat_fd >= 0) {
+		close(m->dat_fd);
+		m->dat_fd = -1;
+	}
+	if (m->text_fd >= 0) {
+		close(m->text_fd);
+		m->text_fd = -1;
+	}
+	free(m->buf);
+	m->buf = NULL;
+	m->buf_size = 0;
+}
+
+/* Index the fortune file of the tfortune-indexed jar `m` afresh, and
+   use the result as its dat file. */
+unsigned char JarMap_reindex(JarMap* m)
+{
+	Jar fresh;
+	unsigned char ok;
+	char* text = (char*) m->text_map;
+
+	if ((text == NULL)
+	    && (((text = malloc(m->text_size + 1)) == NULL)
+	        || (JarMap_read(m, text, m->text_size, 0)
+	            != (ssize_t) m->text_size))) {
+		report("Cannot read fortune file to index it for %s%s.\n",
+		       m->jar->dir, m->jar->name);
+		free(text);
+		return 0;
+	}
+	STATS_COUNT(bytes_read, m->text_size);
+	memset(&fresh, 0, sizeof(Jar));
+	ok = Jar_index(&fresh, text, m->text_size, m->jar->delim);
+	if (text != m->text_map) {
+		free(text);
+	}
+	if (!ok) {
+		report("Cannot index fortune file for %s%s.\n",
+		       m->jar->dir, m->jar->name);
+		return 0;
+	}
+	m->own_index = fresh.index;
+	m->dat_map = (const unsigned char*) fresh.index;
+	m->dat_size = fresh.index_size;
+	m->num_fortunes = fresh.num_fortunes;
+	m->wide = fresh.wide;
+	m->offsets_at = fresh.wide ? STRFILE_WIDE_HEADER_SPACE
+	                           : STRFILE_HEADER_SPACE;
+	return 1;
+}
+
+/* Read the header of the dat file of `m`, for a jar added lazily, or
+   one whose dat file has changed since the jar catalog recorded it. */
+unsigned char JarMap_read_header(JarMap* m)
+{
+	char dat_header[STRFILE_HEADER_SIZE];
+
+	STATS_COUNT(bytes_read, STRFILE_HEADER_SIZE);
+	if (m->dat_map != NULL) {
+		if (m->dat_size < STRFILE_HEADER_SIZE) {
+			report("Strfile header of %s%s.dat is the wrong size.\n",
+			       m->jar->dir, m->jar->name);
+			return 0;
+		}
+		memcpy(dat_header, m->dat_map, STRFILE_HEADER_SIZE);
+	} else if (pread(m->dat_fd, dat_header, STRFILE_HEADER_SIZE, 0)
+	           != STRFILE_HEADER_SIZE) {
+		report("Strfile header of %s%s.dat is the wrong size.\n",
+		       m->jar->dir, m->jar->name);
+		return 0;
+	}
+	m->wide = (htonl(*(uint32_t*) dat_header) == STRFILE_VERSION_WIDE);
+	m->offsets_at = m->wide ? STRFILE_WIDE_HEADER_SPACE
+	                        : STRFILE_HEADER_SPACE;
+	m->num_fortunes = htonl(*(uint32_t*) (dat_header + sizeof(uint32_t)));
+	m->max_len = htonl(*(uint32_t*) (dat_header + 2*sizeof(uint32_t)));
+	m->min_len = htonl(*(uint32_t*) (dat_header + 3*sizeof(uint32_t)));
+	m->flags = htonl(*(uint32_t*) (dat_header + 4*sizeof(uint32_t)));
+	m->delim = *(dat_header + 5*sizeof(uint32_t));
+	return 1;
+}
+
+/* Open the files of the jar `j` for reading cookies, mapping them into
+   memory where possible. If a file can't be mapped (it's empty, say, or
+   on a filesystem that doesn't support mapping), it's left open for
+   JarMap_cookie() to read the old-fashioned way. */
+unsigned char JarMap_open(JarMap* m, const Jar* j)
+{
+	unsigned char compressed = 0;
+	struct stat info;
+	char* path = NULL;
+	size_t path_size = 0;
+	unsigned char stale;
+
+	m->jar = j;
+	m->dat_fd = -1;
+	m->dat_map = NULL;
+	m->dat_in_memory = 0;
+	m->wide = j->wide;
+	m->offsets_at = j->wide ? STRFILE_WIDE_HEADER_SPACE : STRFILE_HEADER_SPACE;
+	m->packed = 0;
+	m->own_index = NULL;
+	m->text_fd = -1;
+	m->text_map = NULL;
+	m->gz = NULL;
+	m->buf = NULL;
+	m->buf_size = 0;
+
+	/* A packed jar's already in memory, offsets, text and all. */
+	if (j->pack_text != NULL) {
+		m->dat_map = j->pack_offsets;
+		m->dat_size = (j->num_fortunes + (size_t) 1) * sizeof(uint64_t);
+		m->dat_in_memory = 1;
+		m->wide = 1;
+		m->offsets_at = 0;
+		m->text_map = j->pack_text;
+		m->text_size = j->file_size;
+		m->packed = 1;
+		m->num_fortunes = j->num_fortunes;
+		m->delim = j->delim;
+		m->min_len = j->min_len;
+		m->max_len = j->max_len;
+		m->flags = j->flags;
+		return 1;
+	}
+	m->num_fortunes = j->num_fortunes;
+	m->delim = j->delim;
+	m->min_len = j->min_len;
+	m->max_len = j->max_len;
+	m->flags = j->flags;
+	if (Jar_path(j, ".dat", &path, &path_size) == NULL) {
+		return 0;
+	}
+
+	/* Map the dat file, unless there's no dat file to map because the
+	   jar was indexed by tfortune. */
+	if (!j->indexed) {
+		STATS_COUNT(files_opened, 1);
+		if ((m->dat_fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+			report("Cannot open fortune data file %s.\n", path);
+			free(path);
+			return 0;
+		}
+		STATS_COUNT(stats, 1);
+		if (fstat(m->dat_fd, &info)) {
+			report("Cannot find size of fortune data file %s.\n",
+			       path);
+			free(path);
+			JarMap_close(m);
+			return 0;
+		}
+		m->dat_size = info.st_size;
+		if (m->dat_size
+		    && ((m->dat_map = mmap(NULL, m->dat_size, PROT_READ, MAP_SHARED,
+		                           m->dat_fd, 0)) == MAP_FAILED)) {
+			m->dat_map = NULL;
+		}
+		if (m->dat_map != NULL) {
+			/* A mapping outlives its file descriptor, and there may be
+			   many JarMaps open at once, so don't hog descriptors. */
+			close(m->dat_fd);
+			m->dat_fd = -1;
+		}
+
+		/* strfile rewrites a dat file in place, which doesn't change
+		   its directory's modification time, so the jar catalog may
+		   have recorded a header that's no longer there. If so, go by
+		   the header that is, and drop the catalog, so the next run
+		   that uses it rescans everything. */
+		stale = j->dat_mtime
+		        && ((info.st_size != j->dat_size)
+		            || (info.st_mtim.tv_sec * (int64_t) 1000000000
+		                + info.st_mtim.tv_nsec != j->dat_mtime));
+		if (stale) {
+			__atomic_store_n(&stale_catalog, 1, __ATOMIC_RELAXED);
+		}
+		if ((j->lazy || stale) && !JarMap_read_header(m)) {
+			free(path);
+			JarMap_close(m);
+			return 0;
+		}
+	}
+
+	/* The fortune file's path is the dat file's less ".dat". If there's
+	   no fortune file, there may be a seekable gzip copy of it, whose
+	   path has ".gz" in place of ".dat". */
+	path[strlen(path) - 4] = '\0';
+	STATS_COUNT(files_opened, 1);
+	STATS_COUNT(stats, 1);
+	m->text_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if ((m->text_fd < 0) && (errno == ENOENT)) {
+		strcat(path, ".gz");
+		STATS_COUNT(files_opened, 1);
+		if ((m->text_fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+			compressed = 1;
+		}
+	}
+	if ((m->text_fd < 0) || fstat(m->text_fd, &info)) {
+		report("Cannot open fortune cookie file %s.\n", path);
+		free(path);
+		if (m->text_fd >= 0) {
+			close(m->text_fd);
+			m->text_fd = -1;
+		}
+		JarMap_close(m);
+		return 0;
+	}
+	if (compressed) {
+		m->gz = GzText_open(m->text_fd, info.st_size, path);
+		free(path);
+		if (m->gz == NULL) {
+			JarMap_close(m);
+			return 0;
+		}
+		m->text_size = m->gz->index[m->gz->num_frames].text_off;
+	} else {
+		free(path);
+		m->text_size = info.st_size;
+	}
+	if (!compressed && m->text_size
+	    && ((m->text_map = mmap(NULL, m->text_size, PROT_READ, MAP_SHARED,
+	                            m->text_fd, 0)) == MAP_FAILED)) {
+		m->text_map = NULL;
+	}
+	if (m->text_map != NULL) {
+		close(m->text_fd);
+		m->text_fd = -1;
+	}
+
+	/* A jar indexed by tfortune has its dat file image in memory, unless
+	   it came out of the jar catalog, in which case index it again. */
+	if (j->indexed) {
+		if (j->index == NULL) {
+			if (!JarMap_reindex(m)) {
+				JarMap_close(m);
+				return 0;
+			}
+		} else {
+			m->dat_map = (const unsigned char*) j->index;
+			m->dat_size = j->index_size;
+		}
+		m->dat_in_memory = 1;
+	}
+	return 1;
+}
+
+/* Look up the offsets of the start of cookie `cookie_no` and the start
+   of the cookie after it, whether the dat file's are 32 or 64 bits. */
+unsigned char JarMap_offsets(const JarMap* m, uint32_t cookie_no,
+                             uint64_t* offsets)
+{
+	size_t width = m->wide ? sizeof(uint64_t) : sizeof(uint32_t);
+	size_t byte_idx = m->offsets_at + (size_t) cookie_no * width;
+	unsigned int i;
+	uint32_t narrow;
+	unsigned int num_offsets_read;
+	unsigned char raw[2 * sizeof(uint64_t)];
+	uint64_t wide;
+
+	if (m->dat_map != NULL) {
+		num_offsets_read = 0;
+		while ((num_offsets_read < 2)
+		       && (byte_idx + width <= m->dat_size)) {
+			memcpy(raw + num_offsets_read * width, m->dat_map + byte_idx,
+			       width);
+			byte_idx += width;
+			num_offsets_read++;
+		}
+	} else {
+		num_offsets_read = pread(m->dat_fd, raw, 2 * width, byte_idx)
+		                   / (ssize_t) width;
+	}
+	STATS_COUNT(bytes_read, num_offsets_read * width);
+	for (i = 0; i < num_offsets_read; i++) {
+		if (m->wide) {
+			memcpy(&wide, raw + i * width, width);
+			offsets[i] = be64toh(wide);
+		} else {
+			memcpy(&narrow, raw + i * width, width);
+			offsets[i] = be32toh(narrow);
+		}
+	}
+
+	if (num_offsets_read == 0) {
+		report("Cannot read offsets from data file %s%s.dat.\n",
+		       m->jar->dir, m->jar->name);
+		return 0;
+	} else if (num_offsets_read == 1) {
+		/* There was only one offset left to be read in the dat file, so
+		   that must have been the last offset in it, implying that
+		   offset refers to the last fortune cookie in the file. Set the
+		   2nd offset to the fortune cookie file's size, indicating that
+		   the cookie runs from the first offset to EOF. */
+		offsets[1] = m->text_size;
+	}
+	return 1;
+}
+
+/* Make sure `m`'s cookie buffer holds at least `num_bytes` bytes. */
+unsigned char JarMap_reserve(JarMap* m, size_t num_bytes)
+{
+	char* new_buf;
+
+	if (num_bytes > m->buf_size) {
+		if ((new_buf = realloc(m->buf, num_bytes)) == NULL) {
+			report("Cannot allocate %lu bytes of memory "
+			       "for fortune cookie.\n", num_bytes);
+			return 0;
+		}
+		m->buf = new_buf;
+		m->buf_size = num_bytes;
+	}
+	return 1;
+}
+
+/* Set `offsets[1]` to the end of the cookie starting at `offsets[0]`,
+   just after the delimiter line that follows it (or at the end of the
+   text), by looking for that line. A jar whose offsets are shuffled or
+   sorted needs this, since the next offset isn't where its cookie
+   ends. */
+unsigned char JarMap_find_end(JarMap* m, uint64_t* offsets)
+{
+	const char* delim_line;
+	size_t len = 0;
+	ssize_t num_read;
+	size_t search_from;
+
+	if (offsets[0] > m->text_size) {
+		/* Let the caller's range check catch it. */
+		offsets[1] = offsets[0];
+		return 1;
+	}
+	if (m->text_map != NULL) {
+		delim_line = find_delim_line(m->text_map, m->text_map + offsets[0],
+		                             m->text_map + m->text_size, m->delim);
+		offsets[1] = (delim_line == NULL)
+		             ? m->text_size : (size_t) (delim_line + 2 - m->text_map);
+		return 1;
+	}
+
+	/* Read on from the start of the cookie until the delimiter line
+	   turns up. A delimiter at the end of one read may only be shown
+	   to start a line by the next. */
+	for (;;) {
+		if ((len == m->buf_size)
+		    && !JarMap_reserve(m, (m->buf_size + 4096) * 2)) {
+			return 0;
+		}
+		if ((num_read = JarMap_read(m, m->buf + len, m->buf_size - len,
+		                            offsets[0] + len)) < 0) {
+			report("Cannot read cookie from %s%s.dat.\n",
+			       m->jar->dir, m->jar->name);
+			return 0;
+		}
+		STATS_COUNT(bytes_read, num_read);
+		search_from = len ? len - 1 : 0;
+		len += num_read;
+		if ((delim_line = find_delim_line(m->buf, m->buf + search_from,
+		                                  m->buf + len, m->delim)) != NULL) {
+			offsets[1] = offsets[0] + (delim_line + 2 - m->buf);
+			return 1;
+		}
+		if (!num_read || (offsets[0] + len >= m->text_size)) {
+			offsets[1] = m->text_size;
+			return 1;
+		}
+	}
+}
+
+/* Put the cookie `*cookie` into `m`'s cookie buffer as the jar's flags
+   say it should be read, leaving out comment lines and undoing rot13,
+   and point `*cookie` at the result. The cookie may be in the buffer
+   already, in which case it's decoded in place. */
+unsigned char JarMap_decode(JarMap* m, const char** cookie,
+                            size_t* num_bytes)
+{
+	const char* end = *cookie + *num_bytes;
+	size_t len = 0;
+	const char* line;
+	const char* next;
+	const char* src = *cookie;
+
+	if ((*cookie != m->buf) && !JarMap_reserve(m, *num_bytes)) {
+		return 0;
+	}
+	if (m->flags & STR_COMMENTS) {
+		for (line = *cookie; line < end; line = next) {
+			next = memchr(line, '\n', end - line);
+			next = (next == NULL) ? end : next + 1;
+			if ((next - line >= 2) && (line[0] == m->delim)
+			    && (line[1] == m->delim)) {
+				continue;
+			}
+			memmove(m->buf + len, line, next - line);
+			len += next - line;
+		}
+		src = m->buf;
+	} else {
+		len = *num_bytes;
+	}
+	if (m->flags & STR_ROTATED) {
+		rot13(m->buf, src, len);
+	} else if (src != m->buf) {
+		memcpy(m->buf, src, len);
+	}
+	*cookie = m->buf;
+	*num_bytes = len;
+	return 1;
+}
+
+/* Find cookie number `cookie_no` in the mapped jar `m`, pointing
+   `cookie` at its text and setting `num_bytes` to its length. The text
+   points straight into the file's mapping if there is one, and into a
+   buffer belonging to `m` otherwise; either way it stays valid only
+   until the next call. */
+unsigned char JarMap_cookie(JarMap* m, uint32_t cookie_no,
+                            const char** cookie, size_t* num_bytes)
+{
+	uint64_t offsets[2];
+
+	/* If the jar's dat file has been rewritten with fewer cookies than
+	   it had when the cookie was chosen, make do with one that's still
+	   there. */
+	if (m->num_fortunes && (cookie_no >= m->num_fortunes)) {
+		cookie_no %= m->num_fortunes;
+	}
+	if (!JarMap_offsets(m, cookie_no, offsets)
+	    || ((m->flags & (STR_RANDOM | STR_ORDERED))
+	        && !JarMap_find_end(m, offsets))) {
+		return 0;
+	}
+	if ((offsets[0] > offsets[1]) || (offsets[1] > m->text_size)) {
+		report("Offsets of cookie %u in %s%s.dat are out of range.\n",
+		       cookie_no, m->jar->dir, m->jar->name);
+		return 0;
+	}
+	*num_bytes = offsets[1] - offsets[0];
+	STATS_COUNT(bytes_read, *num_bytes);
+
+	if ((m->gz != NULL) && *num_bytes
+	    && !GzText_load(m->gz, m->text_fd, offsets[0])) {
+		return 0;
+	}
+	if (m->text_map != NULL) {
+		*cookie = m->text_map + offsets[0];
+	} else if ((m->gz != NULL) && *num_bytes
+	           && (offsets[1]
+	               <= m->gz->index[m->gz->frame_no + 1].text_off)) {
+		/* -z ends every frame with a delimiter line, so a cookie's
+		   all in one frame, and can be used where it is. */
+		*cookie = m->gz->frame
+		          + (offsets[0] - m->gz->index[m->gz->frame_no].text_off);
+	} else {
+		if (!JarMap_reserve(m, *num_bytes)) {
+			return 0;
+		}
+		if (JarMap_read(m, m->buf, *num_bytes, offsets[0])
+		    != (ssize_t) *num_bytes) {
+			report("Cannot read cookie from %s%s.dat.\n",
+			       m->jar->dir, m->jar->name);
+			return 0;
+		}
+		*cookie = m->buf;
+	}
+
+	/* strfile doesn't calculate offsets so as to exclude the delimiter
+	   character and newline, so check to see whether the fortune cookie
+	   has a delimiter and newline at the end of it, and if so, deduct 2
+	   from the cookie's byte count to hide them. Note the assumption of
+	   Unix-style line endings. */
+	if ((*num_bytes >= 2) && ((*cookie)[*num_bytes-2] == m->delim)
+	    && ((*cookie)[*num_bytes-1] == '\n')) {
+		*num_bytes -= 2;
+	}
+	if (m->flags & (STR_ROTATED | STR_COMMENTS)) {
+		return JarMap_decode(m, cookie, num_bytes);
+	}
+	return 1;
+}
+
+/* Free what jar `j` owns; its path belongs to its Jars. */
+void Jar_free(Jar* j)
+{
+	free(j->index);
+	free(j->by_length);
+}
+
+/* Guess, as fortune would, whether jar `j` holds offensive fortune
+   cookies: whether it's rot13 encoded, or its fortune file's in a
+   directory called "off" or has a name ending in "-o". */
+unsigned char Jar_is_offensive(const Jar* j)
+{
+	size_t len = strlen(j->name);
+	const char* p;
+
+	if (j->flags & STR_ROTATED) {
+		return 1;
+	}
+	if ((len >= 2) && !memcmp(j->name + len - 2, "-o", 2)) {
+		return 1;
+	}
+	for (p = j->dir; (p = strstr(p, "off/")) != NULL; p++) {
+		if ((p == j->dir) || (p[-1] == '/')) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Read just the flags word of the header of lazily added jar `j`'s dat
+   file, since Jar_is_offensive() can't do without it. */
+unsigned char Jar_read_flags(Jar* j)
+{
+	int fd;
+	uint32_t flags;
+	char* path = NULL;
+	size_t path_size = 0;
+
+	if (j->lazy != 1) {
+		return 1;
+	}
+	if (Jar_path(j, ".dat", &path, &path_size) == NULL) {
+		return 0;
+	}
+	STATS_COUNT(files_opened, 1);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		report("Cannot open fortune data file %s.\n", path);
+		free(path);
+		return 0;
+	}
+	STATS_COUNT(bytes_read, sizeof(uint32_t));
+	if (pread(fd, &flags, sizeof(uint32_t), 4 * sizeof(uint32_t))
+	    != sizeof(uint32_t)) {
+		report("Strfile header of %s is the wrong size.\n", path);
+		close(fd);
+		free(path);
+		return 0;
+	}
+	close(fd);
+	free(path);
+	j->flags = htonl(flags);
+	j->lazy = 2;
+	return 1;
+}
+
+/* Order pointers to jars by their groups, then their IDs, and jars
+   that are the same file in the same group by
+   compare_path_components(). */
+int Jar_compare_ids(const void* a, const void* b)
+{
+	const Jar* p = *(const Jar* const*) a;
+	const Jar* q = *(const Jar* const*) b;
+
+	if (p->group != q->group) {
+		return (p->group < q->group) ? -1 : 1;
+	}
+	if (p->id.dev != q->id.dev) {
+		return (p->id.dev < q->id.dev) ? -1 : 1;
+	}
+	if (p->id.ino != q->id.ino) {
+		return (p->id.ino < q->id.ino) ? -1 : 1;
+	}
+	return Jar_compare_paths_as(p, q, 1);
+}
+
+/* Of the jars of `js` in the same group that are the same file (by
+   their IDs) found by different paths, as hard links, say, keep just
+   the one whose path comes first by compare_path_components(), leaving
+   the rest of the jars in the order they were in. Jars ruled out (see
+   Jars_keep_offensive()) should be gone already, so that the copy kept
+   is the first that may be drawn from, as Jars_sample() would have
+   it. */
+void Jars_drop_duplicates(Jars* js)
+{
+	unsigned char* drop;
+	unsigned int jar_no;
+	Jar** by_id;
+	unsigned int num_ids = 0;
+	unsigned int num_kept = 0;
+
+	if (js->count < 2) {
+		return;
+	}
+	by_id = malloc(js->count * sizeof(Jar*));
+	drop = calloc(js->count, 1);
+	if ((by_id == NULL) || (drop == NULL)) {
+		report("Cannot allocate memory for fortune file list.\n");
+		free(by_id);
+		free(drop);
+		return;
+	}
+	for (jar_no = 0; jar_no < js->count; jar_no++) {
+		if (js->j[jar_no].id.dev || js->j[jar_no].id.ino) {
+			by_id[num_ids++] = &(js->j[jar_no]);
+		}
+	}
+	qsort(by_id, num_ids, sizeof(Jar*), Jar_compare_ids);
+	for (jar_no = 1; jar_no < num_ids; jar_no++) {
+		if ((by_id[jar_no]->group == by_id[jar_no - 1]->group)
+		    && (by_id[jar_no]->id.dev == by_id[jar_no - 1]->id.dev)
+		    && (by_id[jar_no]->id.ino == by_id[jar_no - 1]->id.ino)) {
+			drop[by_id[jar_no] - js->j] = 1;
+		}
+	}
+	free(by_id);
+
+	for (jar_no = 0; jar_no < js->count; jar_no++) {
+		if (drop[jar_no]) {
+			js->num_fortunes -= js->j[jar_no].num_fortunes;
+			Jar_free(&(js->j[jar_no]));
+		} else {
+			js->j[num_kept++] = js->j[jar_no];
+		}
+	}
+	js->count = num_kept;
+	free(drop);
+}
+
+/* Keep just the jars of `js` that are offensive, if `offensive` is set,
+   or just those that aren't otherwise. */
+void Jars_keep_offensive(Jars* js, unsigned char offensive)
+{
+	unsigned int jar_no;
+	unsigned int num_kept = 0;
+
+	js->num_fortunes = 0;
+	for (jar_no = 0; jar_no < js->count; jar_no++) {
+		if (Jar_read_flags(&(js->j[jar_no]))
+		    && (Jar_is_offensive(&(js->j[jar_no])) == offensive)) {
+			js->j[num_kept] = js->j[jar_no];
+			js->num_fortunes += js->j[num_kept++].num_fortunes;
+		} else {
+			Jar_free(&(js->j[jar_no]));
+		}
+	}
+	js->count = num_kept;
+}
+
+/* Work out jar `j`'s key for Jars_sample(), returning 0 if `wopts`
+   rule the jar out. As in Efraimidis & Spirakis's weighted reservoir
+   sampling, the key is u^(1/w), for a jar of weight w and u uniform on
+   (0, 1), so that the jar with the greatest key is any given jar with
+   probability in proportion to its weight; logarithms keep the keys of
+   heavy jars apart. u comes from hashing the seed with the jar's ID
+   (or its path, if it hasn't one), so a jar's key doesn't depend on
+   when, or by which walker, it was found, and a jar reached by several
+   paths has the same key by all of them. */
+unsigned char Jar_sample_key(const Jar* j, const WalkOptions* wopts,
+                             double* key)
+{
+	uint64_t x = wopts->seed;
+
+	if (!j->num_fortunes
+	    || ((wopts->offensive < 2)
+	        && (Jar_is_offensive(j) != wopts->offensive))) {
+		return 0;
+	}
+	if (j->id.dev || j->id.ino) {
+		x ^= hash_bytes((const char*) &(j->id), sizeof(FileId));
+	} else {
+		x ^= hash_bytes(j->dir, strlen(j->dir));
+		x = splitmix64(&x) ^ hash_bytes(j->name, strlen(j->name));
+	}
+	x = splitmix64(&x);
+	*key = log(((x >> 11) + 0.5) / 9007199254740992.0)
+	       / (wopts->uniform ? 1 : j->num_fortunes);
+	return 1;
+}
+
+/* Keep just one of `js`'s jars, the one with the greatest key (see
+   Jar_sample_key()), if any jar has a key at all; of jars with the same
+   key, the same jar by several paths, the one whose path comes first
+   as Jars_drop_duplicates() would have it. However the jars are split
+   up among calls, the jar kept in the end is the same. */
+void Jars_sample(Jars* js, const WalkOptions* wopts)
+{
+	unsigned int best = js->count;
+	double best_key = 0.0;
+	double key;
+	unsigned int jar_no;
+
+	for (jar_no = 0; jar_no < js->count; jar_no++) {
+		if (((wopts->offensive == 2) || Jar_read_flags(&(js->j[jar_no])))
+		    && Jar_sample_key(&(js->j[jar_no]), wopts, &key)
+		    && ((best == js->count) || (key > best_key)
+		        || ((key == best_key)
+		            && (Jar_compare_paths_as(&(js->j[jar_no]),
+		                                     &(js->j[best]), 1) < 0)))) {
+			best = jar_no;
+			best_key = key;
+		}
+	}
+	for (jar_no = 0; jar_no < js->count; jar_no++) {
+		if (jar_no != best) {
+			Jar_free(&(js->j[jar_no]));
+		}
+	}
+	if (best < js->count) {
+		js->j[0] = js->j[best];
+		js->count = 1;
+		js->num_fortunes = js->j[0].num_fortunes;
+	} else {
+		js->count = 0;
+		js->num_fortunes = 0;
+	}
+}
+
+int uint64_compare(const void* a, const void* b)
+{
+	uint64_t p = *(const uint64_t*) a;
+	uint64_t q = *(const uint64_t*) b;
+
+	return (p < q) ? -1 : (p > q);
+}
+
+/* Sort jar `j`'s cookies by length, working out their lengths as
+   fortune does, from where each cookie starts and the next begins, less
+   the delimiter line between (finding the next cookie in the text if
+   the offsets are out of order), and point `j->drawable` at those which
+   are short (at most `short_len` bytes long) or, with `long_only`,
+   long. Lengths are of the text as stored, rot13 and comments and all,
+   so a cookie counts the same however its jar's flagged. */
+unsigned char Jar_index_lengths(Jar* j, unsigned char long_only,
+                                uint32_t short_len)
+{
+	uint32_t cookie_no;
+	size_t first_long;
+	size_t hi;
+	uint64_t* keys;
+	uint64_t len;
+	size_t lo;
+	JarMap m;
+	uint64_t offsets[2];
+
+	if (!JarMap_open(&m, j)) {
+		return 0;
+	}
+	j->num_fortunes = m.num_fortunes;
+	keys = malloc((j->num_fortunes + (size_t) 1) * sizeof(uint64_t));
+	j->by_length = malloc((j->num_fortunes + (size_t) 1) * sizeof(uint32_t));
+	if ((keys == NULL) || (j->by_length == NULL)) {
+		report("Cannot allocate memory for fortune cookie lengths.\n");
+		goto fail;
+	}
+
+	/* Sort on each cookie's length, then number, together in one key;
+	   the offsets include the delimiter line that ends each cookie. */
+	for (cookie_no = 0; cookie_no < j->num_fortunes; cookie_no++) {
+		if (!JarMap_offsets(&m, cookie_no, offsets)
+		    || ((m.flags & (STR_RANDOM | STR_ORDERED))
+		        && !JarMap_find_end(&m, offsets))) {
+			goto fail;
+		}
+		len = (offsets[1] >= offsets[0] + 2) ? offsets[1] - offsets[0] - 2
+		                                     : 0;
+		if (len > UINT32_MAX) {
+			len = UINT32_MAX;  /* long enough to count as long, anyway */
+		}
+		keys[cookie_no] = ((uint64_t) len << 32) | cookie_no;
+	}
+	qsort(keys, j->num_fortunes, sizeof(uint64_t), uint64_compare);
+
+	/* Binary search for the first long cookie; the short ones are the
+	   run before it, and the long ones the rest. */
+	lo = 0;
+	hi = j->num_fortunes;
+	while (lo < hi) {
+		if ((keys[lo + (hi - lo) / 2] >> 32) <= short_len) {
+			lo = lo + (hi - lo) / 2 + 1;
+		} else {
+			hi = lo + (hi - lo) / 2;
+		}
+	}
+	first_long = lo;
+	for (cookie_no = 0; cookie_no < j->num_fortunes; cookie_no++) {
+		j->by_length[cookie_no] = (uint32_t) keys[cookie_no];
+	}
+	if (long_only) {
+		j->drawable = j->by_length + first_long;
+		j->num_drawable = j->num_fortunes - first_long;
+	} else {
+		j->drawable = j->by_length;
+		j->num_drawable = first_long;
+	}
+	free(keys);
+	JarMap_close(&m);
+	return 1;
+
+fail:
+	free(keys);
+	free(j->by_length);
+	j->by_length = NULL;
+	JarMap_close(&m);
+	return 0;
+}
+
+/* Cut `js` down to the jars with short fortune cookies (at most
+   `short_len` bytes long), or with `long_only` long ones, so that only
+   those cookies are drawn. Most jars' headers give the lengths of
+   their shortest and longest cookies, which settle whether to keep or
+   drop the whole jar without opening it; only the jars with cookies
+   both ways (and lazily added ones) get their cookies sorted by length
+   for Jar_draw() to draw from. `js->num_fortunes` then counts only the
+   cookies that may be drawn. */
+unsigned char Jars_restrict_lengths(Jars* js, unsigned char long_only,
+                                    unsigned long short_len)
+{
+	Jar* j;
+	unsigned int jar_no;
+	unsigned int num_kept = 0;
+
+	if (short_len > UINT32_MAX) {
+		short_len = UINT32_MAX;
+	}
+	js->num_fortunes = 0;
+	for (jar_no = 0; jar_no < js->count; jar_no++) {
+		j = &(js->j[jar_no]);
+		if (!j->lazy && !j->num_fortunes) {
+			/* There's nothing to keep. */
+		} else if (!j->lazy && (long_only ? (j->min_len > short_len)
+		                                  : (j->max_len <= short_len))) {
+			js->j[num_kept++] = *j;
+			js->num_fortunes += j->num_fortunes;
+			continue;
+		} else if (!j->lazy && (long_only ? (j->max_len <= short_len)
+		                                  : (j->min_len > short_len))) {
+			STATS_COUNT(jars_skipped, 1);
+		} else if (Jar_index_lengths(j, long_only, short_len)
+		           && j->num_drawable) {
+			js->j[num_kept++] = *j;
+			js->num_fortunes += j->num_drawable;
+			continue;
+		}
+		Jar_free(j);
+	}
+	js->count = num_kept;
+	if (!js->num_fortunes && long_only) {
+		report("No fortune cookies are longer than %lu bytes.\n",
+		       short_len);
+		return 0;
+	} else if (!js->num_fortunes) {
+		report("No fortune cookies are %lu bytes long or less.\n",
+		       short_len);
+		return 0;
+	}
+	return 1;
+}
+
+/* Write all of the `iov_count` buffers `iov` to `fd`, carrying on after
+   partial writes. `iov` is used up in the process. */
+unsigned char writev_all(int fd, struct iovec* iov, int iov_count)
+{
+	ssize_t written;
+
+	while (iov_count) {
+		if ((written = writev(fd, iov, iov_count)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 0;
+		}
+		while (iov_count && ((size_t) written >= iov->iov_len)) {
+			written -= iov->iov_len;
+			iov++;
+			iov_count--;
+		}
+		if (iov_count) {
+			iov->iov_base = (char*) iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return 1;
+}
+
+/* Write a cookie to standard output, preceded (if `j` isn't NULL) by the
+   path of the file it came from, in a single system call. */
+unsigned char write_cookie(const Jar* j, const char* cookie,
+                           size_t num_bytes)
+{
+	struct iovec iov[4];
+	int iov_count = 0;
+
+	if (j != NULL) {
+		iov[iov_count].iov_base = (char*) j->dir;
+		iov[iov_count++].iov_len = strlen(j->dir);
+		iov[iov_count].iov_base = (char*) j->name;
+		iov[iov_count++].iov_len = strlen(j->name);
+		iov[iov_count].iov_base = "\n%\n";
+		iov[iov_count++].iov_len = 3;
+	}
+	iov[iov_count].iov_base = (char*) cookie;
+	iov[iov_count++].iov_len = num_bytes;
+	if (!writev_all(STDOUT_FILENO, iov, iov_count)) {
+		report("Cannot write fortune cookie.\n");
+		return 0;
+	}
+	return 1;
+}
+
+/* Check that `js` is ready for fortune cookies to be drawn from it. */
+unsigned char Jars_ready(const Jars* js, Options opts)
+{
+	if (!(js->count)) {
+		report("List of available fortune cookie files is empty.\n");
+		return 0;
+	}
+
+	if (!(js->num_fortunes)) {
+		report("The available fortune cookie files are all empty.\n");
+		return 0;
+	}
+
+	if (!opts.e && (js->cut == NULL)) {
+		report("No alias table was built for the fortune files.\n");
+		return 0;
+	}
+	return 1;
+}
+
+/* Choose a fortune cookie file at random: uniformly if `e_opt` is set,
+   and with probability in proportion to its number of fortune cookies
+   otherwise. */
+unsigned int Jars_pick(const Jars* js, unsigned char e_opt, Rng* r)
+{
+	const JarGroup* g;
+
+	if (e_opt && js->num_groups) {
+		g = Jars_choose_group(js, 1, r);
+		return g->first_jar + Rng_below(r, g->num_jars);
+	}
+	if (e_opt) {
+		return Rng_below(r, js->count);
+	}
+	return Jars_choose(js, r);
+}
+
+void Seen_close(Seen* seen)
+{
+	if (seen->map != NULL) {
+		if (msync(seen->map, seen->map_size, MS_SYNC)) {
+			report("Cannot update no-repeat state file %s.\n",
+			       seen->path);
+		}
+		munmap(seen->map, seen->map_size);
+		seen->map = NULL;
+	}
+	if (seen->fd >= 0) {
+		close(seen->fd);
+		seen->fd = -1;
+	}
+	free(seen->first_cookie);
+	free(seen->block_seen);
+	seen->first_cookie = NULL;
+	seen->block_seen = NULL;
+}
+
+/* Start `seen`'s state file afresh, with the header `h` and no cookies
+   seen. The new file's built under a temporary name, locked, and only
+   renamed over the old one once it's safely on disk, so a crash leaves
+   one whole file or the other, never a half-written one. Runs waiting
+   for the old file's lock find it's been replaced (see Seen_open()). */
+unsigned char Seen_reset(Seen* seen, const SeenHeader* h)
+{
+	int fd;
+	char* tmp_path;
+
+	if ((tmp_path = malloc(strlen(seen->path) + 8)) == NULL) {
+		return 0;
+	}
+	sprintf(tmp_path, "%s.XXXXXX", seen->path);
+	if ((fd = mkostemp(tmp_path, O_CLOEXEC)) < 0) {
+		free(tmp_path);
+		return 0;
+	}
+
+	/* Extending the empty file zeroes all its bits. */
+	if (flock(fd, LOCK_EX) || ftruncate(fd, seen->map_size)
+	    || (pwrite(fd, h, sizeof(SeenHeader), 0) != sizeof(SeenHeader))
+	    || fsync(fd) || rename(tmp_path, seen->path)) {
+		close(fd);
+		unlink(tmp_path);
+		free(tmp_path);
+		return 0;
+	}
+	free(tmp_path);
+	close(seen->fd);
+	seen->fd = fd;
+	return 1;
+}
+
+/* Open the no-repeat state file at `path` for drawing from `js`, and
+   lock it until Seen_close(), so runs sharing it take turns. If the
+   file's new, or was kept for a different set of jars, it's started
+   afresh. */
+unsigned char Seen_open(Seen* seen, const char* path, const Jars* js)
+{
+	uint64_t block_no;
+	SeenHeader h;
+	unsigned int jar_no;
+	uint64_t num_words;
+	SeenHeader old_h;
+	struct stat info;
+	struct stat path_info;
+	uint64_t word_no;
+
+	memset(seen, 0, sizeof(Seen));
+	seen->fd = -1;
+	seen->path = path;
+
+	/* The bits are for these jars, in this order, with these numbers of
+	   cookies; any change to them starts the state afresh. */
+	memset(&h, 0, sizeof(SeenHeader));
+	memcpy(h.magic, SEEN_MAGIC, sizeof(h.magic));
+	h.jars_hash = 14695981039346656037ULL;
+	for (jar_no = 0; jar_no < js->count; jar_no++) {
+		h.jars_hash = (h.jars_hash * 1099511628211ULL)
+		              ^ hash_bytes(js->j[jar_no].dir,
+		                           strlen(js->j[jar_no].dir));
+		h.jars_hash = (h.jars_hash * 1099511628211ULL)
+		              ^ hash_bytes(js->j[jar_no].name,
+		                           strlen(js->j[jar_no].name));
+		h.jars_hash = (h.jars_hash * 1099511628211ULL)
+		              ^ js->j[jar_no].num_fortunes;
+	}
+	h.num_cookies = js->num_fortunes;
+	num_words = (h.num_cookies + 63) / 64;
+	seen->num_cookies = h.num_cookies;
+	seen->num_blocks = (num_words + SEEN_BLOCK_WORDS - 1) / SEEN_BLOCK_WORDS;
+	seen->map_size = sizeof(SeenHeader) + num_words * sizeof(uint64_t);
+
+	seen->first_cookie = malloc((js->count + 1) * sizeof(uint64_t));
+	seen->block_seen = malloc((seen->num_blocks + 1) * sizeof(uint32_t));
+	if ((seen->first_cookie == NULL) || (seen->block_seen == NULL)) {
+		report("Cannot allocate memory for no-repeat state.\n");
+		Seen_close(seen);
+		return 0;
+	}
+	seen->first_cookie[0] = 0;
+	for (jar_no = 0; jar_no < js->count; jar_no++) {
+		seen->first_cookie[jar_no + 1] = seen->first_cookie[jar_no]
+		                                 + js->j[jar_no].num_fortunes;
+	}
+	seen->num_jars = js->count;
+
+	/* Another run may have replaced the file (see Seen_reset()) while
+	   this one waited for the lock, leaving this one holding the lock
+	   on a file that's gone; if so, try again with the new file. */
+	for (;;) {
+		if (((seen->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600))
+		     < 0)
+		    || flock(seen->fd, LOCK_EX) || fstat(seen->fd, &info)) {
+			report("Cannot open no-repeat state file %s.\n", path);
+			Seen_close(seen);
+			return 0;
+		}
+		if (!stat(path, &path_info) && (path_info.st_dev == info.st_dev)
+		    && (path_info.st_ino == info.st_ino)) {
+			break;
+		}
+		close(seen->fd);
+	}
+	if (((uint64_t) info.st_size != seen->map_size)
+	    || (pread(seen->fd, &old_h, sizeof(SeenHeader), 0)
+	        != sizeof(SeenHeader))
+	    || memcmp(&old_h, &h, sizeof(SeenHeader))) {
+		if (!Seen_reset(seen, &h)) {
+			report("Cannot reset no-repeat state file %s.\n",
+			       path);
+			Seen_close(seen);
+			return 0;
+		}
+	}
+	if ((seen->map = mmap(NULL, seen->map_size, PROT_READ | PROT_WRITE,
+	                      MAP_SHARED, seen->fd, 0)) == MAP_FAILED) {
+		seen->map = NULL;
+		report("Cannot map no-repeat state file %s.\n", path);
+		Seen_close(seen);
+		return 0;
+	}
+	seen->bits = (uint64_t*) (seen->map + sizeof(SeenHeader));
+
+	/* Count the cookies seen in each block, for finding unseen cookies
+	   by rank. The bits past the last cookie count as seen, so they're
+	   never chosen. */
+	if (seen->num_cookies % 64) {
+		seen->bits[num_words - 1] |= ~(uint64_t) 0 << (seen->num_cookies % 64);
+	}
+	for (block_no = 0; block_no < seen->num_blocks; block_no++) {
+		seen->block_seen[block_no] = 0;
+		for (word_no = block_no * SEEN_BLOCK_WORDS;
+		     (word_no < num_words)
+		     && (word_no < (block_no + 1) * SEEN_BLOCK_WORDS); word_no++) {
+			seen->block_seen[block_no]
+				+= __builtin_popcountll(seen->bits[word_no]);
+		}
+		seen->num_seen += seen->block_seen[block_no];
+	}
+	seen->num_seen -= num_words * 64 - seen->num_cookies;
+	return 1;
+}
+
+/* Forget every cookie `seen` has seen, to begin a new round. */
+void Seen_clear(Seen* seen)
+{
+	uint64_t block_no;
+	uint64_t num_words = (seen->num_cookies + 63) / 64;
+
+	memset(seen->bits, 0, num_words * sizeof(uint64_t));
+	for (block_no = 0; block_no < seen->num_blocks; block_no++) {
+		seen->block_seen[block_no] = 0;
+	}
+	if (seen->num_cookies % 64) {
+		seen->bits[num_words - 1] = ~(uint64_t) 0 << (seen->num_cookies % 64);
+		seen->block_seen[seen->num_blocks - 1]
+			= 64 - seen->num_cookies % 64;
+	}
+	seen->num_seen = 0;
+}
+
+/* Draw a cookie uniformly from those `seen` hasn't seen, and mark it
+   seen, putting its jar and its number within the jar in `jar_no` and
+   `cookie_no`. Once every cookie's been seen, they're all forgotten
+   and the next round begins. The cookie is found by rank: it's the
+   `rank`th unseen cookie, so the blocks' counts lead to its block, the
+   words' counts to its word, and its word's zero bits to the cookie. */
+void Seen_draw(Seen* seen, Rng* r, unsigned int* jar_no, uint32_t* cookie_no)
+{
+	unsigned int bit_no;
+	uint64_t block_no = 0;
+	uint64_t cookie;
+	unsigned int hi;
+	unsigned int lo;
+	unsigned int mid;
+	uint64_t rank;
+	uint64_t unseen;
+	uint64_t word;
+	uint64_t word_no;
+
+	if (seen->num_seen >= seen->num_cookies) {
+		Seen_clear(seen);
+	}
+	rank = Rng_below(r, seen->num_cookies - seen->num_seen);
+	while (rank >= (unseen = SEEN_BLOCK_WORDS * 64
+	                         - seen->block_seen[block_no])) {
+		rank -= unseen;
+		block_no++;
+	}
+	word_no = block_no * SEEN_BLOCK_WORDS;
+	while (rank >= (unseen = 64 - __builtin_popcountll(seen->bits[word_no]))) {
+		rank -= unseen;
+		word_no++;
+	}
+	word = ~seen->bits[word_no];
+	while (rank--) {
+		word &= word - 1;
+	}
+	bit_no = __builtin_ctzll(word);
+	seen->bits[word_no] |= (uint64_t) 1 << bit_no;
+	seen->block_seen[block_no]++;
+	seen->num_seen++;
+
+	/* Find the jar whose cookies' numbers span the cookie's. */
+	cookie = word_no * 64 + bit_no;
+	lo = 0;
+	hi = seen->num_jars;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (seen->first_cookie[mid] <= cookie) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	*jar_no = lo;
+	*cookie_no = cookie - seen->first_cookie[lo];
+}
+
+/* Choose a jar and a cookie in it, drawing from `r`: from the cookies
+   not yet seen, if there's no-repeat state, or else by Jars_pick() and
+   Jar_draw(). */
+void Jars_draw(const Jars* js, unsigned char e_opt, Rng* r,
+               unsigned int* jar_no, uint32_t* cookie_no)
+{
+	if (js->seen != NULL) {
+		Seen_draw(js->seen, r, jar_no, cookie_no);
+		return;
+	}
+	*jar_no = Jars_pick(js, e_opt, r);
+	*cookie_no = Jar_draw(&(js->j[*jar_no]), r);
+}
+
+unsigned char Jars_fortune(const Jars* js, Options opts)
+{
+	size_t byte_idx;
+	const char* cookie;
+	uint32_t cookie_no;
+	double delay_time = 0.0;
+	unsigned int jar_no;
+	JarMap m;
+	size_t num_bytes;
+	unsigned char ok;
+	unsigned int prev_phase;
+	struct timespec start;
+
+	if (!Jars_ready(js, opts)) {
+		return 0;
+	}
+	prev_phase = stats_enter(PHASE_SELECTION, &start);
+	Jars_draw(js, opts.e, &rng, &jar_no, &cookie_no);
+	stats_leave(prev_phase, &start);
+
+	/* Hand the no-repeat state over to any other run waiting for it,
+	   rather than holding it through the printing and the wait. */
+	if (js->seen != NULL) {
+		Seen_close(js->seen);
+	}
+
+	/* Pick out a uniformly randomly chosen fortune cookie in the
+	   selected file, and write it straight from the file's mapping. */
+	prev_phase = stats_enter(PHASE_COOKIE_READ, &start);
+	ok = JarMap_open(&m, &(js->j[jar_no]))
+	     && JarMap_cookie(&m, cookie_no, &cookie, &num_bytes);
+	stats_leave(prev_phase, &start);
+	if (ok) {
+		prev_phase = stats_enter(PHASE_OUTPUT, &start);
+		ok = write_cookie(opts.c ? &(js->j[jar_no]) : NULL, cookie,
+		                  num_bytes);
+		stats_leave(prev_phase, &start);
+	}
+	if (!ok) {
+		JarMap_close(&m);
+		return 0;
+	}
+
+	if (opts.w) {
+		/* Compute a time period for which to wait for the user to read
+		   the fortune cookie. Using the length of the entire cookie is a
+		   bad idea (it gives too long a waiting time for ASCII art);
+		   instead, use the number of lines, letters and numeric digits. */
+		for (byte_idx = 0; byte_idx < num_bytes; byte_idx++) {
+			if (isalpha((unsigned char) cookie[byte_idx])) {
+				delay_time += 0.06;
+			} else if (isdigit((unsigned char) cookie[byte_idx])) {
+				delay_time += 0.03;
+			} else if (cookie[byte_idx] == '\n') {
+				delay_time += 0.07;
+			}
+		}
+		delay_time = 1 + (unsigned int) (opts.w * delay_time);
+		JarMap_close(&m);
+		sleep(delay_time);
+	} else {
+		JarMap_close(&m);
+	}
+
+	return 1;
+}
+
+unsigned char JarCache_init(JarCache* cache, const Jars* js,
+                            unsigned int num_slots)
+{
+	unsigned int jar_no;
+
+	cache->js = js;
+	cache->num_slots = num_slots;
+	cache->num_used = 0;
+	cache->clock = 0;
+	cache->maps = malloc(num_slots * sizeof(JarMap));
+	cache->jar_of_slot = malloc(num_slots * sizeof(unsigned int));
+	cache->last_used = malloc(num_slots * sizeof(unsigned long));
+	cache->slot_of_jar = malloc((js->count + 1) * sizeof(int));
+	if ((cache->maps == NULL) || (cache->jar_of_slot == NULL)
+	    || (cache->last_used == NULL) || (cache->slot_of_jar == NULL)) {
+		report("Cannot allocate memory for fortune file cache.\n");
+		free(cache->maps);
+		free(cache->jar_of_slot);
+		free(cache->last_used);
+		free(cache->slot_of_jar);
+		return 0;
+	}
+	for (jar_no = 0; jar_no < js->count; jar_no++) {
+		cache->slot_of_jar[jar_no] = -1;
+	}
+	return 1;
+}
+
+/* Get the opened files of jar `jar_no` from `cache`, opening them if
+   they aren't there already, and closing the least recently used jar's
+   files if the cache is full. */
+JarMap* JarCache_get(JarCache* cache, unsigned int jar_no)
+{
+	unsigned int slot;
+	unsigned int victim;
+
+	cache->clock++;
+	if (cache->slot_of_jar[jar_no] >= 0) {
+		slot = cache->slot_of_jar[jar_no];
+		cache->last_used[slot] = cache->clock;
+		return &(cache->maps[slot]);
+	}
+
+	if (cache->num_used < cache->num_slots) {
+		slot = cache->num_used++;
+	} else {
+		/* Misses cost a couple of opens and mmaps anyway, so a linear
+		   search for the stalest slot is no great extra expense. */
+		slot = 0;
+		for (victim = 1; victim < cache->num_slots; victim++) {
+			if (cache->last_used[victim] < cache->last_used[slot]) {
+				slot = victim;
+			}
+		}
+		JarMap_close(&(cache->maps[slot]));
+		cache->slot_of_jar[cache->jar_of_slot[slot]] = -1;
+	}
+
+	cache->jar_of_slot[slot] = jar_no;
+	if (!JarMap_open(&(cache->maps[slot]), &(cache->js->j[jar_no]))) {
+		/* The slot's left holding a closed JarMap, first in line to be
+		   evicted. */
+		cache->last_used[slot] = 0;
+		return NULL;
+	}
+	cache->last_used[slot] = cache->clock;
+	cache->slot_of_jar[jar_no] = slot;
+	return &(cache->maps[slot]);
+}
+
+void JarCache_free(JarCache* cache)
+{
+	unsigned int slot;
+
+	for (slot = 0; slot < cache->num_used; slot++) {
+		JarMap_close(&(cache->maps[slot]));
+	}
+	free(cache->maps);
+	free(cache->jar_of_slot);
+	free(cache->last_used);
+	free(cache->slot_of_jar);
+	cache->num_used = 0;
+}
+
+int Draw_compare(const void* a, const void* b)
+{
+	const Draw* p = a;
+	const Draw* q = b;
+
+	if (p->jar_no != q->jar_no) {
+		return (p->jar_no < q->jar_no) ? -1 : 1;
+	}
+	if (p->cookie_no != q->cookie_no) {
+		return (p->cookie_no < q->cookie_no) ? -1 : 1;
+	}
+	return 0;
+}
+
+/* Write `count` randomly chosen fortune cookies to standard output, each
+   followed by a "%" line, so the output's itself a fortune file. The
+   cookies are drawn a chunk at a time; with `opts.S` each chunk's
+   sorted by jar and cookie before it's written, so each jar's files
+   are visited once per chunk and read front to back. */
+unsigned char Jars_fortunes(const Jars* js, Options opts, unsigned long count)
+{
+	JarCache cache;
+	unsigned long chunk_size;
+	const char* cookie;
+	Draw* draws;
+	unsigned long draw_no;
+	JarMap* m;
+	size_t num_bytes;
+	unsigned char ok = 1;
+	unsigned int prev_phase;
+	struct timespec start;
+
+	if (!Jars_ready(js, opts)) {
+		return 0;
+	}
+	chunk_size = (count < BATCH_CHUNK_SIZE) ? count : BATCH_CHUNK_SIZE;
+	if ((draws = malloc(chunk_size * sizeof(Draw))) == NULL) {
+		report("Cannot allocate memory for fortune cookie draws.\n");
+		return 0;
+	}
+	if (!JarCache_init(&cache, js, JAR_CACHE_SLOTS)) {
+		free(draws);
+		return 0;
+	}
+
+	while (count && ok) {
+		if (chunk_size > count) {
+			chunk_size = count;
+		}
+		prev_phase = stats_enter(PHASE_SELECTION, &start);
+		for (draw_no = 0; draw_no < chunk_size; draw_no++) {
+			Jars_draw(js, opts.e, &rng, &(draws[draw_no].jar_no),
+			          &(draws[draw_no].cookie_no));
+		}
+		if (opts.S) {
+			qsort(draws, chunk_size, sizeof(Draw), Draw_compare);
+		}
+		if ((js->seen != NULL) && (chunk_size == count)) {
+			Seen_close(js->seen);  /* that was the last draw */
+		}
+		stats_leave(prev_phase, &start);
+		for (draw_no = 0; (draw_no < chunk_size) && ok; draw_no++) {
+			prev_phase = stats_enter(PHASE_COOKIE_READ, &start);
+			ok = ((m = JarCache_get(&cache, draws[draw_no].jar_no)) != NULL)
+			     && JarMap_cookie(m, draws[draw_no].cookie_no, &cookie,
+			                      &num_bytes);
+			stats_leave(prev_phase, &start);
+			if (!ok) {
+				break;
+			}
+			prev_phase = stats_enter(PHASE_OUTPUT, &start);
+			if (opts.c) {
+				fputs(m->jar->dir, stdout);
+				fputs(m->jar->name, stdout);
+				fputs("\n%\n", stdout);
+			}
+			fwrite(cookie, num_bytes, 1, stdout);
+			if (num_bytes && (cookie[num_bytes-1] != '\n')) {
+				putchar('\n');
+			}
+			fputs("%\n", stdout);
+			stats_leave(prev_phase, &start);
+		}
+		count -= chunk_size;
+	}
+
+	prev_phase = stats_enter(PHASE_OUTPUT, &start);
+	if (fflush(stdout) || ferror(stdout)) {
+		report("Cannot write fortune cookies.\n");
+		ok = 0;
+	}
+	stats_leave(prev_phase, &start);
+	JarCache_free(&cache);
+	free(draws);
+	return ok;
+}
+
+/* Find the first occurrence of the `len`-byte string `needle` (`len`
+   being at least 1) in the text from `p` to `end`, or return NULL. */
+const char* find_literal_scalar(const char* p, const char* end,
+                                const char* needle, size_t len)
+{
+	return memmem(p, end - p, needle, len);
+}
+
+#if defined(__x86_64__) && defined(__SSE2__)
+
+/* Test a block of positions at a time for the needle's first byte, and
+   the positions `len` - 1 bytes on for its last byte, and only compare
+   the whole needle where both match. */
+const char* find_literal_sse2(const char* p, const char* end,
+                              const char* needle, size_t len)
+{
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i last = _mm_set1_epi8(needle[len - 1]);
+	unsigned int mask;
+
+	while ((size_t) (end - p) >= len + 15) {
+		mask = _mm_movemask_epi8(_mm_and_si128(
+			_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) p), first),
+			_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (p + len - 1)),
+			               last)));
+		while (mask) {
+			if (!memcmp(p + __builtin_ctz(mask), needle, len)) {
+				return p + __builtin_ctz(mask);
+			}
+			mask &= mask - 1;
+		}
+		p += 16;
+	}
+	return find_literal_scalar(p, end, needle, len);
+}
+
+__attribute__((target("avx2")))
+const char* find_literal_avx2(const char* p, const char* end,
+                              const char* needle, size_t len)
+{
+	const __m256i first = _mm256_set1_epi8(needle[0]);
+	const __m256i last = _mm256_set1_epi8(needle[len - 1]);
+	unsigned int mask;
+
+	while ((size_t) (end - p) >= len + 31) {
+		mask = _mm256_movemask_epi8(_mm256_and_si256(
+			_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) p), first),
+			_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)
+			                                     (p + len - 1)),
+			                  last)));
+		while (mask) {
+			if (!memcmp(p + __builtin_ctz(mask), needle, len)) {
+				return p + __builtin_ctz(mask);
+			}
+			mask &= mask - 1;
+		}
+		p += 32;
+	}
+	return find_literal_sse2(p, end, needle, len);
+}
+
+#endif
+
+const char* find_literal(const char* p, const char* end,
+                         const char* needle, size_t len)
+{
+#if defined(__x86_64__) && defined(__SSE2__)
+	if (__builtin_cpu_supports("avx2")) {
+		return find_literal_avx2(p, end, needle, len);
+	}
+	return find_literal_sse2(p, end, needle, len);
+#else
+	return find_literal_scalar(p, end, needle, len);
+#endif
+}
+
+/* Work out a string which any text matching the basic regular
+   expression `pattern` must contain, and write it to `literal`, which
+   needs room for `pattern`'s length. Return its length, which is 0 if
+   there's no such string to be had. This takes the longest run of
+   ordinary characters outside any group, leaving out any character a
+   repetition applies to; alternation means giving up altogether. */
+size_t required_literal(const char* pattern, char* literal)
+{
+	size_t best_len = 0;
+	unsigned int depth = 0;
+	const char* p = pattern;
+	char* run;
+	size_t run_len = 0;
+
+	if ((run = malloc(strlen(pattern) + 1)) == NULL) {
+		return 0;
+	}
+	for (;;) {
+		/* A repetition makes the character before it optional. */
+		if (run_len && ((*p == '*')
+		                || ((p[0] == '\\') && ((p[1] == '{') || (p[1] == '?')
+		                                       || (p[1] == '+'))))) {
+			run_len--;
+		}
+
+		/* Ordinary characters, and escaped special ones, extend the
+		   run. */
+		if ((*p != '\0') && (strchr("*.[^$\\", *p) == NULL)) {
+			if (!depth) {
+				run[run_len++] = *p;
+			}
+			p++;
+			continue;
+		}
+		if ((p[0] == '\\') && (p[1] != '\0')
+		    && (strchr("*.[]^$\\", p[1]) != NULL)) {
+			if (!depth) {
+				run[run_len++] = p[1];
+			}
+			p += 2;
+			continue;
+		}
+
+		/* Anything else ends it. */
+		if (run_len > best_len) {
+			memcpy(literal, run, run_len);
+			best_len = run_len;
+		}
+		run_len = 0;
+		if (*p == '\0') {
+			break;
+		} else if (*p == '[') {
+			/* Skip the bracket expression, which may begin with ']',
+			   and may hold classes like "[:alpha:]". */
+			p++;
+			if (*p == '^') {
+				p++;
+			}
+			if (*p == ']') {
+				p++;
+			}
+			while ((*p != '\0') && (*p != ']')) {
+				if ((p[0] == '[') && (p[1] != '\0')
+				    && (strchr(":.=", p[1]) != NULL)
+				    && ((p = strchr(p + 2, ']')) == NULL)) {
+					break;
+				}
+				p++;
+			}
+			if ((p == NULL) || (*p == '\0')) {
+				best_len = 0;
+				break;
+			}
+			p++;
+		} else if (*p == '\\') {
+			if (p[1] == '|') {
+				best_len = 0;
+				break;
+			} else if (p[1] == '(') {
+				depth++;
+			} else if ((p[1] == ')') && depth) {
+				depth--;
+			} else if ((p[1] == '{') && ((p = strstr(p, "\\}")) == NULL)) {
+				best_len = 0;
+				break;
+			}
+			p += (p[1] == '\0') ? 1 : 2;
+		} else {
+			p++;
+		}
+	}
+	free(run);
+	return best_len;
+}
+
+/* Append `num_bytes` bytes at `p` to `mo`'s output. */
+unsigned char MatchOut_put(MatchOut* mo, const char* p, size_t num_bytes)
+{
+	char* new_out;
+	size_t new_capacity;
+
+	if (mo->len + num_bytes > mo->capacity) {
+		new_capacity = (mo->capacity + num_bytes) * 2;
+		if ((new_out = realloc(mo->out, new_capacity)) == NULL) {
+			report("Cannot allocate memory for matching fortune cookies.\n");
+			return 0;
+		}
+		mo->out = new_out;
+		mo->capacity = new_capacity;
+	}
+	memcpy(mo->out + mo->len, p, num_bytes);
+	mo->len += num_bytes;
+	return 1;
+}
+
+/* Find the cookies of jar `jar_no` that match `sw`'s regular
+   expression, and format them in the jar's MatchOut as -N would. When
+   there's a string every match has to contain, and the jar's text is
+   mapped, the text's scanned for that string first (rot13 encoded, if
+   the text is), and only the cookies it turns up in go to the regular
+   expression matcher. While the cookies are in the order of the text,
+   one scan serves them all; otherwise each cookie's scanned in turn.
+   Cutting comment lines out of cookies can join up text, so a jar with
+   comments isn't scanned. */
+unsigned char SearchWorker_jar(SearchWorker* sw, unsigned int jar_no)
+{
+	const char* cookie;
+	uint32_t cookie_no;
+	const char* end;
+	const char* hit = NULL;
+	unsigned char in_order;
+	const Jar* j = &(sw->search->js->j[jar_no]);
+	const char* literal;
+	size_t literal_len = sw->search->literal_len;
+	JarMap m;
+	MatchOut* mo = &(sw->search->outs[jar_no]);
+	size_t num_bytes;
+	uint64_t offsets[2];
+	unsigned char ok = 1;
+	const char* raw = NULL;
+	regmatch_t span;
+
+	if (!JarMap_open(&m, j)) {
+		return 0;
+	}
+	end = m.text_map + m.text_size;
+	in_order = !(m.flags & (STR_RANDOM | STR_ORDERED));
+	literal = (m.flags & STR_ROTATED) ? sw->search->rot_literal
+	                                  : sw->search->literal;
+	if ((m.text_map == NULL) || (m.flags & STR_COMMENTS)) {
+		literal_len = 0;
+	}
+	for (cookie_no = 0; cookie_no < m.num_fortunes; cookie_no++) {
+		/* Look for the required string from the start of this cookie
+		   on, unless the last occurrence found is still ahead. */
+		if (literal_len) {
+			if (!JarMap_offsets(&m, cookie_no, offsets)) {
+				ok = 0;
+				break;
+			}
+			raw = m.text_map + ((offsets[0] < m.text_size) ? offsets[0]
+			                                               : m.text_size);
+			if (in_order && ((hit == NULL) || (hit < raw))
+			    && ((hit = find_literal(raw, end, literal,
+			                            literal_len)) == NULL)) {
+				break;
+			}
+		}
+
+		if (!JarMap_cookie(&m, cookie_no, &cookie, &num_bytes)) {
+			ok = 0;
+			break;
+		}
+
+		/* Skip the cookie if there's no occurrence wholly inside it. */
+		if (literal_len) {
+			if (!in_order) {
+				hit = find_literal(raw, raw + num_bytes, literal,
+				                   literal_len);
+			}
+			if ((hit == NULL) || (hit + literal_len > raw + num_bytes)) {
+				continue;
+			}
+		}
+
+		span.rm_so = 0;
+		span.rm_eo = num_bytes;
+		if (regexec(&(sw->re), cookie, 1, &span, REG_STARTEND)) {
+			continue;
+		}
+		mo->count++;
+		if (!MatchOut_put(mo, cookie, num_bytes)
+		    || (num_bytes && (cookie[num_bytes-1] != '\n')
+		        && !MatchOut_put(mo, "\n", 1))
+		    || !MatchOut_put(mo, "%\n", 2)) {
+			ok = 0;
+			break;
+		}
+	}
+	JarMap_close(&m);
+	return ok;
+}
+
+/* Search jars until there are none left to take, posting each jar's
+   results as it's finished. */
+void* SearchWorker_run(void* arg)
+{
+	unsigned int jar_no;
+	unsigned char ok;
+	unsigned int prev_phase;
+	Search* search;
+	struct timespec start;
+	SearchWorker* sw = arg;
+
+	search = sw->search;
+	prev_phase = stats_enter(PHASE_COOKIE_READ, &start);
+	while ((jar_no = __atomic_fetch_add(&(search->next_jar), 1,
+	                                    __ATOMIC_RELAXED))
+	       < search->js->count) {
+		ok = SearchWorker_jar(sw, jar_no);
+		pthread_mutex_lock(&(search->lock));
+		search->outs[jar_no].done = ok ? 1 : 2;
+		pthread_cond_signal(&(search->jar_done));
+		pthread_mutex_unlock(&(search->lock));
+	}
+	stats_leave(prev_phase, &start);
+	return NULL;
+}
+
+/* Write every fortune cookie matching the basic regular expression
+   `pattern` to standard output as fortune's -m does, each jar's matches
+   preceded by a header on standard error naming the jar. Jars are
+   searched by up to `num_threads` threads at once, but their matches
+   are written in the jars' order, each jar's as soon as it and every
+   jar before it have been searched. */
+unsigned char Jars_search(const Jars* js, const char* pattern,
+                          unsigned int num_threads)
+{
+	int err;
+	char err_msg[256];
+	unsigned int jar_no;
+	MatchOut* mo;
+	unsigned int num_started;
+	unsigned char ok = 1;
+	unsigned int prev_phase;
+	regex_t re;
+	Search search;
+	struct timespec start;
+	SearchWorker* workers;
+
+	/* Compile the pattern once here, just to report any error in it. */
+	if ((err = regcomp(&re, pattern, REG_NOSUB))) {
+		regerror(err, &re, err_msg, sizeof(err_msg));
+		report("Cannot search for \"%s\": %s.\n", pattern, err_msg);
+		return 0;
+	}
+	regfree(&re);
+	if (!js->count) {
+		return 1;
+	}
+
+	if (num_threads > js->count) {
+		num_threads = js->count;
+	} else if (!num_threads) {
+		num_threads = 1;
+	}
+	search.js = js;
+	search.literal = malloc(strlen(pattern) + 1);
+	search.rot_literal = malloc(strlen(pattern) + 1);
+	search.outs = calloc(js->count, sizeof(MatchOut));
+	workers = malloc(num_threads * sizeof(SearchWorker));
+	if ((search.literal == NULL) || (search.rot_literal == NULL)
+	    || (search.outs == NULL) || (workers == NULL)) {
+		report("Cannot allocate memory for search.\n");
+		free(search.literal);
+		free(search.rot_literal);
+		free(search.outs);
+		free(workers);
+		return 0;
+	}
+	search.literal_len = required_literal(pattern, search.literal);
+	rot13(search.rot_literal, search.literal, search.literal_len);
+	search.next_jar = 0;
+	pthread_mutex_init(&(search.lock), NULL);
+	pthread_cond_init(&(search.jar_done), NULL);
+
+	/* Each thread needs its own compiled pattern, since regexec() locks
+	   the one it's given. */
+	for (num_started = 0; num_started < num_threads; num_started++) {
+		workers[num_started].search = &search;
+		if (regcomp(&(workers[num_started].re), pattern, REG_NOSUB)) {
+			break;
+		}
+		if (pthread_create(&(workers[num_started].thread), NULL,
+		                   SearchWorker_run, &(workers[num_started]))) {
+			regfree(&(workers[num_started].re));
+			break;
+		}
+	}
+	if (!num_started) {
+		report("Cannot start search threads.\n");
+		ok = 0;
+	}
+
+	/* Write out each jar's matches in turn, waiting as needed for it to
+	   be searched. A jar that couldn't be read fails the search, but
+	   doesn't stop it. */
+	for (jar_no = 0; num_started && (jar_no < js->count); jar_no++) {
+		mo = &(search.outs[jar_no]);
+		pthread_mutex_lock(&(search.lock));
+		while (!mo->done) {
+			pthread_cond_wait(&(search.jar_done), &(search.lock));
+		}
+		pthread_mutex_unlock(&(search.lock));
+		if (mo->done > 1) {
+			ok = 0;
+		}
+		if (mo->count) {
+			prev_phase = stats_enter(PHASE_OUTPUT, &start);
+			fflush(stdout);
+			fprintf(stderr, "(%s%s)\n%%\n", js->j[jar_no].dir,
+			        js->j[jar_no].name);
+			fwrite(mo->out, mo->len, 1, stdout);
+			stats_leave(prev_phase, &start);
+		}
+		free(mo->out);
+	}
+	while (num_started--) {
+		pthread_join(workers[num_started].thread, NULL);
+		regfree(&(workers[num_started].re));
+	}
+	if (fflush(stdout) || ferror(stdout)) {
+		report("Cannot write fortune cookies.\n");
+		ok = 0;
+	}
+	pthread_mutex_destroy(&(search.lock));
+	pthread_cond_destroy(&(search.jar_done));
+	free(search.literal);
+	free(search.rot_literal);
+	free(search.outs);
+	free(workers);
+	return ok;
+}
+
+/* The chance of jar `j` of `js` being chosen (with -e, if `e_opt` is
+   set). If the jars are in groups, they must have been weighed. */
+float Jars_chance(const Jars* js, const Jar* j, unsigned char e_opt)
+{
+	const JarGroup* g;
+
+	if (js->num_groups) {
+		g = &(js->groups[j->group]);
+		if (!g->weight[e_opt]) {
+			return 0.0;
+		}
+		return (double) g->weight[e_opt] / js->group_total[e_opt]
+		       * (e_opt ? 1.0 / g->num_jars
+		                : Jar_num_drawable(j) / (double) g->num_fortunes);
+	}
+	if (e_opt) {
+		return 1.0 / (float) js->count;
+	} else if (js->num_fortunes) {
+		return j->num_fortunes / (float) js->num_fortunes;
+	}
+	return 0.0;
+}
+
+/* Display the selection probability and short name of a Jar's file, or
+   (with `F_opt`) the probability, the number of cookies and the whole
+   path, separated by tabs. */
+void Jar_chance(const Jar* j, const Jars* js, unsigned char e_opt,
+                unsigned char F_opt)
+{
+	float chance = Jars_chance(js, j, e_opt);
+
+	if (F_opt) {
+		printf("%.6f\t%u\t%s%s\n", 100.0 * chance, j->num_fortunes, j->dir,
+		       j->name);
+	} else {
+		printf("    %5.2f%% %s\n", 100.0 * chance, j->name);
+	}
+}
+
+/* List `js`'s jars grouped by directory, with each directory's and each
+   jar's chance of being chosen, or just list the jars one per line in a
+   machine-readable form if `F_opt` is set. Directories are listed in
+   the order their first jars appear in `js->j`, and jars within each
+   directory in the order they appear there. If the jars are in groups,
+   they must have been weighed. */
+void Jars_list(const Jars* js, unsigned char e_opt, unsigned char F_opt)
+{
+	float chance;
+	unsigned int dir_no;
+	uint64_t* dir_num_fortunes = NULL;
+	unsigned int* dir_of_jar = NULL;
+	unsigned int* dir_start = NULL;
+	unsigned int* first_jar = NULL;
+	unsigned int i;
+	unsigned int jar_no;
+	unsigned int* listed_dir = NULL;
+	unsigned int num_dirs = 0;
+	unsigned int* order = NULL;
+
+	if (!(js->count)) {
+		/* `js` has no jars. The caller should've handled this case
+		   itself -- when `js` is empty this function lacks the
+		   information to list the directories searched. */
+		return;
+	}
+	if (F_opt) {
+		for (jar_no = 0; jar_no < js->count; jar_no++) {
+			Jar_chance(&(js->j[jar_no]), js, e_opt, 1);
+		}
+		return;
+	}
+
+	/* When it lists the available fortune files, this function has
+	   to group them by directory, even though the fortune files in a
+	   subdirectory might not be in a contiguous sequence in `js->j`.
+	   It begins by numbering the directories with jars in order of
+	   first appearance, which, since each jar knows its directory's
+	   number in `js`, costs a lookup per jar in `listed_dir` (holding
+	   each directory's number in the listing plus 1, or 0 if it's not
+	   been seen yet). */
+	dir_num_fortunes = calloc(js->count, sizeof(uint64_t));
+	dir_of_jar = malloc(js->count * sizeof(unsigned int));
+	dir_start = calloc(js->count + 1, sizeof(unsigned int));
+	first_jar = malloc(js->count * sizeof(unsigned int));
+	listed_dir = calloc(js->num_dirs + 1, sizeof(unsigned int));
+	order = malloc(js->count * sizeof(unsigned int));
+	if ((dir_num_fortunes == NULL) || (dir_of_jar == NULL)
+	    || (dir_start == NULL) || (first_jar == NULL) || (listed_dir == NULL)
+	    || (order == NULL)) {
+		report("Can't allocate memory for directory list.\n");
+		goto done;
+	}
+	for (jar_no = 0; jar_no < js->count; jar_no++) {
+		if (!listed_dir[js->j[jar_no].dir_id]) {
+			first_jar[num_dirs] = jar_no;
+			listed_dir[js->j[jar_no].dir_id] = ++num_dirs;
+		}
+		dir_no = listed_dir[js->j[jar_no].dir_id] - 1;
+		dir_of_jar[jar_no] = dir_no;
+		dir_num_fortunes[dir_no] += js->j[jar_no].num_fortunes;
+		dir_start[dir_no + 1]++;
+	}
+
+	/* Then it sorts the jars by directory number, keeping them in order
+	   within each directory, by counting. */
+	for (dir_no = 0; dir_no < num_dirs; dir_no++) {
+		dir_start[dir_no + 1] += dir_start[dir_no];
+	}
+	for (jar_no = 0; jar_no < js->count; jar_no++) {
+		order[dir_start[dir_of_jar[jar_no]]++] = jar_no;
+	}
+
+	/* Now `order` lists the jars directory by directory, with each
+	   directory's jars ending just before `dir_start` for it. Display
+	   each directory's total selection probability and path, then list
+	   the files in it and their probabilities. */
+	jar_no = 0;
+	for (dir_no = 0; dir_no < num_dirs; dir_no++) {
+		if (js->num_groups) {
+			chance = 0.0;
+			for (i = jar_no; i < dir_start[dir_no]; i++) {
+				chance += Jars_chance(js, &(js->j[order[i]]), e_opt);
+			}
+			printf("%5.2f%% ", 100.0 * chance);
+		} else if (js->num_fortunes) {
+			if (e_opt) {
+				printf("%5.2f%% ", 100.0 / (float) num_dirs);
+			} else {
+				printf("%5.2f%% ", 100.0 * dir_num_fortunes[dir_no]
+				                   / (float) js->num_fortunes);
+			}
+		} else {
+			printf("  0.00%% ");
+		}
+		if (*(js->j[first_jar[dir_no]].dir)) {
+			puts(js->j[first_jar[dir_no]].dir);
+		} else {
+			puts("./");
+		}
+		for (; jar_no < dir_start[dir_no]; jar_no++) {
+			Jar_chance(&(js->j[order[jar_no]]), js, e_opt, 0);
+		}
+	}
+
+done:
+	free(dir_num_fortunes);
+	free(dir_of_jar);
+	free(dir_start);
+	free(first_jar);
+	free(listed_dir);
+	free(order);
+}
+
+void Jars_free(Jars* js)
+{
+	unsigned int i;
+	unsigned int jar_no;
+
+	if (js->j != NULL) {
+		for (jar_no = 0; jar_no < js->count; jar_no++) {
+			Jar_free(&(js->j[jar_no]));
+		}
+		free(js->j);
+		js->j = NULL;
+	}
+	while (js->num_packs) {
+		js->num_packs--;
+		munmap(js->packs[js->num_packs].map, js->packs[js->num_packs].size);
+	}
+	free(js->packs);
+	js->packs = NULL;
+	Arena_free(&(js->strings));
+	free(js->dirs);
+	free(js->dir_slots);
+	js->dirs = NULL;
+	js->dir_slots = NULL;
+	js->num_dirs = 0;
+	js->dirs_capacity = 0;
+	js->num_dir_slots = 0;
+	free(js->cut);
+	free(js->alias);
+	js->cut = NULL;
+	js->alias = NULL;
+	free(js->groups);
+	js->groups = NULL;
+	js->num_groups = 0;
+	for (i = 0; i < 2; i++) {
+		free(js->group_cut[i]);
+		free(js->group_alias[i]);
+		js->group_cut[i] = NULL;
+		js->group_alias[i] = NULL;
+	}
+	js->count = 0;
+	js->capacity = 0;
+}
+
+/* Check whether the file at `path` is a pack, by its first bytes. */
+unsigned char is_pack_file(const char* path)
+{
+	int fd;
+	char magic[sizeof(PACK_MAGIC) - 1];
+	unsigned char ok;
+
+	STATS_COUNT(files_opened, 1);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		return 0;
+	}
+	STATS_COUNT(bytes_read, sizeof(magic));
+	ok = (read(fd, magic, sizeof(magic)) == (ssize_t) sizeof(magic))
+	     && !memcmp(magic, PACK_MAGIC, sizeof(magic));
+	close(fd);
+	return ok;
+}
+
+/* Map the pack at `path` and add all of its jars to `js`. Every jar's
+   checked to lie within the pack before it's added, so a truncated or
+   corrupt pack can't lead to a wild read later. */
+unsigned char Jars_add_pack(Jars* js, const char* path)
+{
+	char* dat_file_path = NULL;
+	size_t dat_file_path_size = 0;
+	int fd;
+	uint64_t first_offset;
+	PackHeader h;
+	struct stat info;
+	Jar j;
+	unsigned int jar_no;
+	const PackJar* jars;
+	void* map;
+	const char* names;
+	size_t name_len;
+	char* new_dat_file_path;
+	Pack* new_packs;
+	uint64_t num_offsets;
+	const unsigned char* offsets;
+	size_t size_needed;
+	const char* text;
+	uint64_t text_off;
+
+	STATS_COUNT(files_opened, 1);
+	STATS_COUNT(stats, 1);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		report("Cannot open fortune pack %s.\n", path);
+		return 0;
+	}
+	if (fstat(fd, &info) || (info.st_size < (off_t) sizeof(PackHeader))) {
+		report("Fortune pack %s is too small.\n", path);
+		close(fd);
+		return 0;
+	}
+	map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		report("Cannot map fortune pack %s.\n", path);
+		return 0;
+	}
+
+	memcpy(&h, map, sizeof(PackHeader));
+	h.num_jars = be32toh(h.num_jars);
+	h.names_size = be32toh(h.names_size);
+	h.num_offsets = be64toh(h.num_offsets);
+	h.text_size = be64toh(h.text_size);
+	jars = (const PackJar*) ((const char*) map + sizeof(PackHeader));
+	names = (const char*) (jars + h.num_jars);
+	size_needed = sizeof(PackHeader) + h.num_jars * (size_t) sizeof(PackJar)
+	              + h.names_size;
+	if (memcmp(h.magic, PACK_MAGIC, sizeof(h.magic))
+	    || (size_needed > (size_t) info.st_size) || (h.names_size == 0)
+	    || names[h.names_size - 1]
+	    || (h.num_offsets > ((size_t) info.st_size - size_needed)
+	                        / sizeof(uint64_t))
+	    || (h.text_size != (size_t) info.st_size - size_needed
+	                       - h.num_offsets * sizeof(uint64_t))) {
+		report("Fortune pack %s is malformed.\n", path);
+		munmap(map, info.st_size);
+		return 0;
+	}
+	offsets = (const unsigned char*) (names + h.names_size);
+	text = (const char*) (offsets + h.num_offsets * sizeof(uint64_t));
+
+	if ((new_packs = realloc(js->packs, (js->num_packs + 1)
+	                                    * sizeof(Pack))) == NULL) {
+		report("Cannot allocate memory for fortune pack list.\n");
+		munmap(map, info.st_size);
+		return 0;
+	}
+	js->packs = new_packs;
+	js->packs[js->num_packs].map = map;
+	js->packs[js->num_packs].size = info.st_size;
+	js->num_packs++;
+
+	memset(&j, 0, sizeof(Jar));
+	for (jar_no = 0; jar_no < h.num_jars; jar_no++) {
+		first_offset = be64toh(jars[jar_no].first_offset);
+		text_off = be64toh(jars[jar_no].text_off);
+		j.num_fortunes = be32toh(jars[jar_no].num_fortunes);
+		j.min_len = be32toh(jars[jar_no].min_len);
+		j.max_len = be32toh(jars[jar_no].max_len);
+		j.delim = jars[jar_no].delim;
+		j.flags = jars[jar_no].flags;
+		j.file_size = be64toh(jars[jar_no].text_size);
+		num_offsets = j.num_fortunes + (uint64_t) 1;
+		if ((be32toh(jars[jar_no].name_off) >= h.names_size)
+		    || (first_offset > h.num_offsets)
+		    || (num_offsets > h.num_offsets - first_offset)
+		    || (text_off > h.text_size)
+		    || ((uint64_t) j.file_size > h.text_size - text_off)) {
+			report("Jar %u of fortune pack %s is malformed.\n",
+			       jar_no, path);
+			free(dat_file_path);
+			return 0;
+		}
+		j.pack_offsets = offsets + first_offset * sizeof(uint64_t);
+		j.pack_text = text + text_off;
+
+		/* Give the jar a dat file path, as if it were unpacked. */
+		name_len = strlen(names + be32toh(jars[jar_no].name_off));
+		if (name_len + 5 > dat_file_path_size) {
+			if ((new_dat_file_path = realloc(dat_file_path,
+			                                 name_len + 5)) == NULL) {
+				report("Cannot allocate memory for fortune file path.\n");
+				free(dat_file_path);
+				return 0;
+			}
+			dat_file_path = new_dat_file_path;
+			dat_file_path_size = name_len + 5;
+		}
+		memcpy(dat_file_path, names + be32toh(jars[jar_no].name_off),
+		       name_len);
+		strcpy(dat_file_path + name_len, ".dat");
+		if (!Jars_add_known(js, dat_file_path, &j)) {
+			free(dat_file_path);
+			return 0;
+		}
+	}
+
+	free(dat_file_path);
+	return 1;
+}
+
+/* Write all of `js`'s jars into a new pack at `path`. The pack's
+   written to a temporary file which is then renamed over `path`, so
+   anyone reading the pack only ever sees a complete one. The text's
+   written as each jar's read, leaving a gap for the jar table and
+   offsets, which are collected in memory and written into the gap at
+   the end. */
+unsigned char Jars_pack(const Jars* js, const char* path)
+{
+	char* buf = NULL;
+	size_t chunk;
+	uint32_t cookie_no;
+	size_t done;
+	FILE* fh = NULL;
+	int fd;
+	PackHeader h;
+	const Jar* j;
+	unsigned int jar_no;
+	PackJar* jars = NULL;
+	JarMap m;
+	mode_t mask;
+	char* names = NULL;
+	uint64_t next_offset = 0;
+	uint64_t next_text = 0;
+	uint64_t* offsets = NULL;
+	uint64_t pair[2];
+	unsigned char packed = 0;
+	size_t text_at;
+	char* tmp_path = NULL;
+
+	if (!(js->count)) {
+		report("List of fortune cookie files to pack is empty.\n");
+		return 0;
+	}
+
+	/* Lay out the jar table and names, and work out how much room the
+	   offsets and text will take. */
+	memset(&h, 0, sizeof(PackHeader));
+	memcpy(h.magic, PACK_MAGIC, sizeof(h.magic));
+	for (jar_no = 0; jar_no < js->count; jar_no++) {
+		h.names_size += strlen(js->j[jar_no].dir)
+		                + strlen(js->j[jar_no].name) + 1;
+		h.num_offsets += js->j[jar_no].num_fortunes + (uint64_t) 1;
+	}
+	jars = calloc(js->count + 1, sizeof(PackJar));
+	names = malloc(h.names_size + 1);
+	offsets = malloc(h.num_offsets * sizeof(uint64_t));
+	buf = malloc(SERVER_OUTPUT_CHUNK);
+	tmp_path = malloc(strlen(path) + 8);
+	if ((jars == NULL) || (names == NULL) || (offsets == NULL)
+	    || (buf == NULL) || (tmp_path == NULL)) {
+		report("Cannot allocate memory to write fortune pack.\n");
+		goto done;
+	}
+	h.names_size = 0;
+	for (jar_no = 0; jar_no < js->count; jar_no++) {
+		j = &(js->j[jar_no]);
+		jars[jar_no].first_offset = htobe64(next_offset);
+		jars[jar_no].name_off = htobe32(h.names_size);
+		jars[jar_no].num_fortunes = htobe32(j->num_fortunes);
+		strcpy(names + h.names_size, j->dir);
+		strcat(names + h.names_size, j->name);
+		h.names_size += strlen(names + h.names_size) + 1;
+		next_offset += j->num_fortunes + (uint64_t) 1;
+	}
+	text_at = sizeof(PackHeader) + js->count * sizeof(PackJar)
+	          + h.names_size + h.num_offsets * sizeof(uint64_t);
+
+	sprintf(tmp_path, "%s.XXXXXX", path);
+	if (((fd = mkstemp(tmp_path)) < 0)
+	    || ((fh = fdopen(fd, "wb")) == NULL)) {
+		report("Cannot create fortune pack %s.\n", tmp_path);
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp_path);
+		}
+		goto done;
+	}
+	/* mkstemp() makes the file private, but a pack's for sharing. */
+	mask = umask(0);
+	umask(mask);
+	if (fchmod(fd, 0666 & ~mask) || fseeko(fh, text_at, SEEK_SET)) {
+		goto write_failed;
+	}
+
+	/* Copy each jar's text, and collect its offsets and the rest of its
+	   header, which a lazily added jar only has once it's opened. */
+	next_offset = 0;
+	for (jar_no = 0; jar_no < js->count; jar_no++) {
+		j = &(js->j[jar_no]);
+		if (!JarMap_open(&m, j)) {
+			goto write_failed;
+		}
+		if (m.num_fortunes != j->num_fortunes) {
+			report("Fortune data file %s%s.dat has changed since the jar "
+			       "catalog recorded it.\n", j->dir, j->name);
+			JarMap_close(&m);
+			goto write_failed;
+		}
+		jars[jar_no].text_off = htobe64(next_text);
+		jars[jar_no].text_size = htobe64(m.text_size);
+		jars[jar_no].min_len = htobe32(m.min_len);
+		jars[jar_no].max_len = htobe32(m.max_len);
+		jars[jar_no].delim = m.delim;
+		jars[jar_no].flags = m.flags;
+		next_text += m.text_size;
+		pair[1] = 0;
+		for (cookie_no = 0; cookie_no < j->num_fortunes; cookie_no++) {
+			if (!JarMap_offsets(&m, cookie_no, pair)) {
+				JarMap_close(&m);
+				goto write_failed;
+			}
+			offsets[next_offset++] = htobe64(pair[0]);
+		}
+		offsets[next_offset++] = htobe64(pair[1]);
+		if (m.text_map != NULL) {
+			if (m.text_size
+			    && (fwrite(m.text_map, m.text_size, 1, fh) != 1)) {
+				JarMap_close(&m);
+				goto write_failed;
+			}
+		} else {
+			for (done = 0; done < m.text_size; done += chunk) {
+				chunk = m.text_size - done;
+				if (chunk > SERVER_OUTPUT_CHUNK) {
+					chunk = SERVER_OUTPUT_CHUNK;
+				}
+				if ((JarMap_read(&m, buf, chunk, done) != (ssize_t) chunk)
+				    || (fwrite(buf, chunk, 1, fh) != 1)) {
+					JarMap_close(&m);
+					goto write_failed;
+				}
+			}
+		}
+		JarMap_close(&m);
+	}
+
+	/* Go back and fill in the front of the pack. */
+	h.text_size = next_text;
+	h.num_jars = htobe32(js->count);
+	h.names_size = htobe32(h.names_size);
+	h.num_offsets = htobe64(h.num_offsets);
+	h.text_size = htobe64(h.text_size);
+	if (fseeko(fh, 0, SEEK_SET)
+	    || (fwrite(&h, sizeof(PackHeader), 1, fh) != 1)
+	    || (fwrite(jars, sizeof(PackJar), js->count, fh) != js->count)
+	    || (fwrite(names, 1, be32toh(h.names_size), fh)
+	        != be32toh(h.names_size))
+	    || (fwrite(offsets, sizeof(uint64_t), next_offset, fh)
+	        != next_offset)) {
+		goto write_failed;
+	}
+	if (fclose(fh) || rename(tmp_path, path)) {
+		report("Cannot replace fortune pack %s.\n", path);
+		unlink(tmp_path);
+		goto done;
+	}
+	packed = 1;
+	goto done;
+
+write_failed:
+	report("Cannot write fortune pack %s.\n", tmp_path);
+	fclose(fh);
+	unlink(tmp_path);
+
+done:
+	free(buf);
+	free(jars);
+	free(names);
+	free(offsets);
+	free(tmp_path);
+	return packed;
+}
+
+/* Write a seekable gzip copy of the fortune file text of the opened
+   jar `m` next to its dat file, with ".gz" in place of ".dat",
+   splitting the text into frames at the first delimiter line at least
+   GZ_FRAME_SIZE bytes into each, so that every cookie's in a single
+   frame. */
+unsigned char JarMap_compress(JarMap* m)
+{
+	char* buf = NULL;
+	size_t buf_size = GZ_FRAME_SIZE * (size_t) 2;
+	unsigned char compressed = 0;
+	size_t cut;
+	const char* delim_line;
+	uint64_t done = 0;
+	FILE* fh = NULL;
+	int fd = -1;
+	GzFooter footer;
+	size_t from;
+	uint64_t gz_off = 0;
+	GzFrame* index = NULL;
+	size_t index_size = 16;
+	size_t len = 0;
+	const Jar* j = m->jar;
+	mode_t mask;
+	ssize_t num_read;
+	uint64_t num_frames = 0;
+	unsigned char* out = NULL;
+	size_t out_size = 0;
+	char* path = NULL;
+	size_t path_size = 0;
+	void* p;
+	char* tmp_path = NULL;
+	z_stream zs;
+
+	memset(&zs, 0, sizeof(z_stream));
+	if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8,
+	                 Z_DEFAULT_STRATEGY) != Z_OK) {
+		report("Cannot set up compression of %s%s.\n", j->dir, j->name);
+		return 0;
+	}
+	if ((Jar_path(j, ".gz", &path, &path_size) == NULL)
+	    || ((tmp_path = malloc(strlen(path) + 8)) == NULL)
+	    || ((buf = malloc(buf_size)) == NULL)
+	    || ((index = malloc(index_size * sizeof(GzFrame))) == NULL)) {
+		report("Cannot allocate memory to compress %s%s.\n", j->dir,
+		       j->name);
+		goto done;
+	}
+	sprintf(tmp_path, "%s.XXXXXX", path);
+	if (((fd = mkstemp(tmp_path)) < 0)
+	    || ((fh = fdopen(fd, "wb")) == NULL)) {
+		report("Cannot create compressed fortune file %s.\n", tmp_path);
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp_path);
+		}
+		goto done;
+	}
+	mask = umask(0);
+	umask(mask);
+	if (fchmod(fd, 0666 & ~mask)) {
+		goto write_failed;
+	}
+
+	while (done < m->text_size) {
+		/* Read on until the frame's long enough and a delimiter line
+		   ends it, or the text does. */
+		from = GZ_FRAME_SIZE - 1;
+		for (;;) {
+			if ((len >= GZ_FRAME_SIZE)
+			    && ((delim_line = find_delim_line(buf, buf + from,
+			                                      buf + len, m->delim))
+			        != NULL)) {
+				cut = delim_line + 2 - buf;
+				break;
+			}
+			if (len >= GZ_FRAME_SIZE) {
+				from = len - 1;
+			}
+			if (done + len >= m->text_size) {
+				cut = len;
+				break;
+			}
+			if (len + GZ_FRAME_SIZE > buf_size) {
+				if ((p = realloc(buf, buf_size * 2)) == NULL) {
+					report("Cannot allocate memory to compress %s%s.\n",
+					       j->dir, j->name);
+					goto write_failed;
+				}
+				buf = p;
+				buf_size *= 2;
+			}
+			if ((num_read = JarMap_read(m, buf + len, GZ_FRAME_SIZE,
+			                            done + len)) <= 0) {
+				report("Cannot read fortune file of %s%s.\n", j->dir,
+				       j->name);
+				goto write_failed;
+			}
+			len += num_read;
+		}
+
+		/* Compress the frame as a gzip member of its own. */
+		if (deflateReset(&zs) != Z_OK) {
+			goto write_failed;
+		}
+		if (deflateBound(&zs, cut) > out_size) {
+			out_size = deflateBound(&zs, cut);
+			if ((p = realloc(out, out_size)) == NULL) {
+				report("Cannot allocate memory to compress %s%s.\n",
+				       j->dir, j->name);
+				goto write_failed;
+			}
+			out = p;
+		}
+		if (num_frames + 1 == index_size) {
+			if ((p = realloc(index, 2 * index_size * sizeof(GzFrame)))
+			    == NULL) {
+				report("Cannot allocate memory to compress %s%s.\n",
+				       j->dir, j->name);
+				goto write_failed;
+			}
+			index = p;
+			index_size *= 2;
+		}
+		zs.next_in = (unsigned char*) buf;
+		zs.avail_in = cut;
+		zs.next_out = out;
+		zs.avail_out = out_size;
+		if ((deflate(&zs, Z_FINISH) != Z_STREAM_END)
+		    || (fwrite(out, out_size - zs.avail_out, 1, fh) != 1)) {
+			goto write_failed;
+		}
+		index[num_frames].gz_off = htobe64(gz_off);
+		index[num_frames].text_off = htobe64(done);
+		num_frames++;
+		gz_off += out_size - zs.avail_out;
+		done += cut;
+		len -= cut;
+		memmove(buf, buf + cut, len);
+	}
+
+	/* Finish with the index and footer. */
+	index[num_frames].gz_off = htobe64(gz_off);
+	index[num_frames].text_off = htobe64(done);
+	footer.num_frames = htobe64(num_frames);
+	memcpy(footer.magic, GZ_INDEX_MAGIC, sizeof(footer.magic));
+	if ((fwrite(index, sizeof(GzFrame), num_frames + 1, fh)
+	     != num_frames + 1)
+	    || (fwrite(&footer, sizeof(GzFooter), 1, fh) != 1)) {
+		goto write_failed;
+	}
+	if (fclose(fh) || rename(tmp_path, path)) {
+		report("Cannot replace compressed fortune file %s.\n", path);
+		unlink(tmp_path);
+		goto done;
+	}
+	compressed = 1;
+	goto done;
+
+write_failed:
+	report("Cannot write compressed fortune file %s.\n", tmp_path);
+	fclose(fh);
+	unlink(tmp_path);
+
+done:
+	deflateEnd(&zs);
+	free(buf);
+	free(index);
+	free(out);
+	free(path);
+	free(tmp_path);
+	return compressed;
+}
+
+/* Write a seekable gzip copy of each of `js`'s jars' fortune files,
+   except those that are only there compressed already. */
+unsigned char Jars_compress(const Jars* js)
+{
+	unsigned int jar_no;
+	JarMap m;
+	unsigned char ok = 1;
+
+	for (jar_no = 0; jar_no < js->count; jar_no++) {
+		if (js->j[jar_no].pack_text != NULL) {
+			continue;
+		}
+		if (!JarMap_open(&m, &(js->j[jar_no]))) {
+			ok = 0;
+			continue;
+		}
+		if ((m.gz == NULL) && !JarMap_compress(&m)) {
+			ok = 0;
+		}
+		JarMap_close(&m);
+	}
+	return ok;
+}
+
+unsigned char ends_with_dot_dat(const char* s)
+{
+	unsigned int len = strlen(s);
+	if (len < 4) {
+		return 0;
+	}
+	return ((s[len-4] == '.') && (s[len-3] == 'd')
+	        && (s[len-2] == 'a') && (s[len-1] == 't'));
+}
+
+unsigned char is_dot_or_dot_dot(const char* s)
+{
+	if (s[0] != '.') {
+		return 0;
+	}
+	return (s[1] == '\0') || ((s[1] == '.') && (s[2] == '\0'));
+}
+
+void Catalog_init(Catalog* cat, const char* path, uint32_t mode)
+{
+	memset(cat, 0, sizeof(Catalog));
+	cat->path = path;
+	cat->mode = mode;
+}
+
+/* Map the catalog left by a previous run, if there's a usable one. A
+   missing or malformed catalog, or one built in another mode, isn't an
+   error; it just means every directory has to be scanned afresh. */
+void Catalog_load(Catalog* cat)
+{
+	int fd;
+	const CatHeader* h;
+	uint32_t idx;
+	struct stat info;
+	void* map;
+	size_t size_needed;
+
+	STATS_COUNT(files_opened, 1);
+	if ((fd = open(cat->path, O_RDONLY)) < 0) {
+		return;
+	}
+	STATS_COUNT(stats, 1);
+	if (fstat(fd, &info) || (info.st_size < (off_t) sizeof(CatHeader))) {
+		close(fd);
+		return;
+	}
+	map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return;
+	}
+
+	/* Check the catalog is self-consistent before trusting anything in
+	   it, so a truncated or corrupt catalog can't lead to a wild read. */
+	h = map;
+	size_needed = sizeof(CatHeader) + h->num_dirs * (size_t) sizeof(CatDir)
+	              + h->num_ents * (size_t) sizeof(CatEnt) + h->str_size;
+	if (memcmp(h->magic, CATALOG_MAGIC, sizeof(h->magic))
+	    || (size_needed != (size_t) info.st_size) || (h->str_size == 0)) {
+		report("Ignoring malformed jar catalog %s.\n", cat->path);
+		munmap(map, info.st_size);
+		return;
+	}
+	cat->dirs = (const CatDir*) (h + 1);
+	cat->ents = (const CatEnt*) (cat->dirs + h->num_dirs);
+	cat->strs = (const char*) (cat->ents + h->num_ents);
+	for (idx = 0; idx < h->num_dirs; idx++) {
+		if ((cat->dirs[idx].path_off >= h->str_size)
+		    || (cat->dirs[idx].first_ent > h->num_ents)
+		    || (cat->dirs[idx].num_ents
+		        > h->num_ents - cat->dirs[idx].first_ent)) {
+			break;
+		}
+	}
+	if ((idx < h->num_dirs) || cat->strs[h->str_size - 1]) {
+		report("Ignoring malformed jar catalog %s.\n", cat->path);
+		munmap(map, info.st_size);
+		return;
+	}
+	for (idx = 0; idx < h->num_ents; idx++) {
+		if (cat->ents[idx].name_off >= h->str_size) {
+			report("Ignoring malformed jar catalog %s.\n",
+			       cat->path);
+			munmap(map, info.st_size);
+			return;
+		}
+	}
+
+	if (h->mode != cat->mode) {
+		munmap(map, info.st_size);
+		return;
+	}
+
+	cat->map = map;
+	cat->map_size = info.st_size;
+	cat->num_dirs = h->num_dirs;
+}
+
+/* Look up the previous run's record of the directory at `path`, and
+   return it if the directory's unchanged since then; otherwise return
+   NULL. A directory's modification time changes whenever an entry is
+   added to, removed from, or renamed within it, so an unchanged time
+   (and inode) means the recorded list of entries is still good. */
+const CatDir* Catalog_find(const Catalog* cat, const char* path,
+                           const struct stat* info)
+{
+	const CatDir* cd;
+	int cmp;
+	uint32_t hi = cat->num_dirs;
+	uint32_t lo = 0;
+	uint32_t mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		cd = &(cat->dirs[mid]);
+		cmp = strcmp(path, cat->strs + cd->path_off);
+		if (cmp < 0) {
+			hi = mid;
+		} else if (cmp > 0) {
+			lo = mid + 1;
+		} else {
+			if ((cd->dev == (uint64_t) info->st_dev)
+			    && (cd->ino == (uint64_t) info->st_ino)
+			    && (cd->mtime_sec == (int64_t) info->st_mtim.tv_sec)
+			    && (cd->mtime_nsec == (int64_t) info->st_mtim.tv_nsec)) {
+				return cd;
+			}
+			return NULL;
+		}
+	}
+	return NULL;
+}
+
+/* Copy the string `s` into the string table of the catalog being built,
+   storing its offset there in `off`. */
+unsigned char Catalog_intern(Catalog* cat, const char* s, uint32_t* off)
+{
+	size_t len = strlen(s) + 1;
+	char* new_strs;
+
+	while (cat->new_strs_size + len > cat->new_strs_capacity) {
+		cat->new_strs_capacity = (cat->new_strs_capacity + 256) * 2;
+		if ((new_strs = realloc(cat->new_strs, cat->new_strs_capacity))
+		    == NULL) {
+			report("Cannot reallocate jar catalog string memory.\n");
+			cat->new_strs_capacity = cat->new_strs_size;
+			return 0;
+		}
+		cat->new_strs = new_strs;
+	}
+	memcpy(cat->new_strs + cat->new_strs_size, s, len);
+	*off = cat->new_strs_size;
+	cat->new_strs_size += len;
+	return 1;
+}
+
+/* Start recording, in the catalog being built, the directory at `path`
+   with inode information `info`; its index goes into `dir_idx`. */
+unsigned char Catalog_add_dir(Catalog* cat, const char* path,
+                              const struct stat* info, uint32_t* dir_idx)
+{
+	CatDir* cd;
+	CatDir* new_dirs;
+
+	if (cat->new_dirs_count == cat->new_dirs_capacity) {
+		cat->new_dirs_capacity = (cat->new_dirs_capacity + 8) * 2;
+		if ((new_dirs = realloc(cat->new_dirs,
+		                        cat->new_dirs_capacity * sizeof(CatDir)))
+		    == NULL) {
+			report("Cannot reallocate jar catalog directory memory.\n");
+			cat->new_dirs_capacity = cat->new_dirs_count;
+			return 0;
+		}
+		cat->new_dirs = new_dirs;
+	}
+	cd = &(cat->new_dirs[cat->new_dirs_count]);
+	memset(cd, 0, sizeof(CatDir));
+	if (!Catalog_intern(cat, path, &(cd->path_off))) {
+		return 0;
+	}
+	cd->dev = info->st_dev;
+	cd->ino = info->st_ino;
+	cd->mtime_sec = info->st_mtim.tv_sec;
+	cd->mtime_nsec = info->st_mtim.tv_nsec;
+	*dir_idx = cat->new_dirs_count++;
+	return 1;
+}
+
+/* Record, in the catalog being built, an entry named `name` in the
+   directory numbered `dir_idx`. The entry's a jar, with the file ID
+   `id`, if `j` isn't NULL, and a subdirectory otherwise. */
+unsigned char Catalog_add_ent(Catalog* cat, uint32_t dir_idx,
+                              const char* name, const Jar* j,
+                              const FileId* id, unsigned char is_link)
+{
+	CatEnt* ce;
+	CatEnt* new_ents;
+	uint32_t* owner;
+
+	if (cat->new_ents_count == cat->new_ents_capacity) {
+		cat->new_ents_capacity = (cat->new_ents_capacity + 8) * 2;
+		new_ents = realloc(cat->new_ents,
+		                   cat->new_ents_capacity * sizeof(CatEnt));
+		if (new_ents != NULL) {
+			cat->new_ents = new_ents;
+		}
+		owner = realloc(cat->owner,
+		                cat->new_ents_capacity * sizeof(uint32_t));
+		if (owner != NULL) {
+			cat->owner = owner;
+		}
+		if ((new_ents == NULL) || (owner == NULL)) {
+			report("Cannot reallocate jar catalog entry memory.\n");
+			cat->new_ents_capacity = cat->new_ents_count;
+			return 0;
+		}
+	}
+	ce = &(cat->new_ents[cat->new_ents_count]);
+	memset(ce, 0, sizeof(CatEnt));
+	if (!Catalog_intern(cat, name, &(ce->name_off))) {
+		return 0;
+	}
+	if (j == NULL) {
+		ce->num_fortunes = CATENT_SUBDIR;
+	} else {
+		ce->file_size = j->file_size;
+		ce->num_fortunes = j->num_fortunes;
+		ce->min_len = j->min_len;
+		ce->max_len = j->max_len;
+		ce->delim = j->delim;
+		ce->flags = j->flags;
+		ce->indexed = j->indexed;
+		ce->lazy = j->lazy;
+		ce->wide = j->wide;
+	}
+	if (id != NULL) {
+		ce->id = *id;
+	}
+	ce->is_link = is_link;
+	cat->owner[cat->new_ents_count++] = dir_idx;
+	return 1;
+}
+
+typedef struct CatSortKey {
+	const char* path;
+	uint32_t dir_idx;
+} CatSortKey;
+
+int CatSortKey_compare(const void* a, const void* b)
+{
+	return strcmp(((const CatSortKey*) a)->path,
+	              ((const CatSortKey*) b)->path);
+}
+
+/* Replace the catalog on disk with the one built during this run, unless
+   nothing's changed. The new catalog's written to a temporary file which
+   is then renamed over the old one, so a concurrent run only ever sees
+   a complete catalog. */
+unsigned char Catalog_save(Catalog* cat)
+{
+	FILE* fh;
+	int fd;
+	CatHeader h;
+	uint32_t idx;
+	CatSortKey* keys = NULL;
+	uint32_t next = 0;
+	uint32_t* next_ent = NULL;
+	CatDir* out_dirs = NULL;
+	CatEnt* out_ents = NULL;
+	unsigned char saved = 0;
+	char* tmp_path;
+
+	if (cat->failed) {
+		return 0;
+	}
+	if (!cat->dirty && (cat->new_dirs_count == cat->num_dirs)) {
+		return 1;
+	}
+
+	/* Sort the directories by path, then lay out each directory's
+	   entries contiguously, in the same order. */
+	keys = malloc((cat->new_dirs_count + 1) * sizeof(CatSortKey));
+	next_ent = calloc(cat->new_dirs_count + 1, sizeof(uint32_t));
+	out_dirs = malloc((cat->new_dirs_count + 1) * sizeof(CatDir));
+	out_ents = malloc((cat->new_ents_count + 1) * sizeof(CatEnt));
+	tmp_path = malloc(strlen(cat->path) + 8);
+	if ((keys == NULL) || (next_ent == NULL) || (out_dirs == NULL)
+	    || (out_ents == NULL) || (tmp_path == NULL)) {
+		report("Cannot allocate memory to write jar catalog.\n");
+		goto done;
+	}
+	for (idx = 0; idx < cat->new_dirs_count; idx++) {
+		keys[idx].path = cat->new_strs + cat->new_dirs[idx].path_off;
+		keys[idx].dir_idx = idx;
+	}
+	qsort(keys, cat->new_dirs_count, sizeof(CatSortKey), CatSortKey_compare);
+	for (idx = 0; idx < cat->new_ents_count; idx++) {
+		cat->new_dirs[cat->owner[idx]].num_ents++;
+	}
+	for (idx = 0; idx < cat->new_dirs_count; idx++) {
+		out_dirs[idx] = cat->new_dirs[keys[idx].dir_idx];
+		out_dirs[idx].first_ent = next;
+		next_ent[keys[idx].dir_idx] = next;
+		next += out_dirs[idx].num_ents;
+	}
+	for (idx = 0; idx < cat->new_ents_count; idx++) {
+		out_ents[next_ent[cat->owner[idx]]++] = cat->new_ents[idx];
+	}
+
+	memset(&h, 0, sizeof(CatHeader));
+	memcpy(h.magic, CATALOG_MAGIC, sizeof(h.magic));
+	h.num_dirs = cat->new_dirs_count;
+	h.num_ents = cat->new_ents_count;
+	h.str_size = cat->new_strs_size;
+	h.mode = cat->mode;
+
+	sprintf(tmp_path, "%s.XXXXXX", cat->path);
+	if ((fd = mkstemp(tmp_path)) < 0) {
+		report("Cannot create jar catalog %s.\n", tmp_path);
+		goto done;
+	}
+	if ((fh = fdopen(fd, "wb")) == NULL) {
+		report("Cannot write jar catalog %s.\n", tmp_path);
+		close(fd);
+		unlink(tmp_path);
+		goto done;
+	}
+	if ((fwrite(&h, sizeof(CatHeader), 1, fh) != 1)
+	    || (fwrite(out_dirs, sizeof(CatDir), h.num_dirs, fh) != h.num_dirs)
+	    || (fwrite(out_ents, sizeof(CatEnt), h.num_ents, fh) != h.num_ents)
+	    || (fwrite(cat->new_strs, 1, h.str_size, fh) != h.str_size)) {
+		report("Cannot write jar catalog %s.\n", tmp_path);
+		fclose(fh);
+		unlink(tmp_path);
+		goto done;
+	}
+	if (fclose(fh) || rename(tmp_path, cat->path)) {
+		report("Cannot replace jar catalog %s.\n", cat->path);
+		unlink(tmp_path);
+		goto done;
+	}
+	saved = 1;
+
+done:
+	free(keys);
+	free(next_ent);
+	free(out_dirs);
+	free(out_ents);
+	free(tmp_path);
+	return saved;
+}
+
+void Catalog_free(Catalog* cat)
+{
+	if (cat->map != NULL) {
+		munmap(cat->map, cat->map_size);
+		cat->map = NULL;
+	}
+	free(cat->new_dirs);
+	free(cat->new_ents);
+	free(cat->owner);
+	free(cat->new_strs);
+	cat->new_dirs = NULL;
+	cat->new_ents = NULL;
+	cat->owner = NULL;
+	cat->new_strs = NULL;
+}
+
+unsigned char Jars_build_dat_file_path_and_add(Jars* js, const char* path,
+                                               unsigned char index_mode)
+{
+	unsigned char added;
+	char* dat_file_path;
+	size_t dat_file_path_len = 5 + strlen(path);
+	struct stat info;
+	unsigned int prev_phase;
+	struct timespec start;
+
+	if ((dat_file_path = malloc(dat_file_path_len)) == NULL) {
+		report("Cannot allocate %lu bytes for data file path.\n",
+		       dat_file_path_len);
+		return 0;
+	}
+
+	strcpy(dat_file_path, path);
+	strcat(dat_file_path, ".dat");
+
+	prev_phase = stats_enter(PHASE_HEADERS, &start);
+	if (index_mode) {
+		STATS_COUNT(stats, 1);
+	}
+	if (index_mode && stat(dat_file_path, &info) && (errno == ENOENT)) {
+		if (!(added = Jars_index_at(js, AT_FDCWD, path, dat_file_path,
+		                            index_mode == 2))) {
+			report("Cannot index %s as a fortune file.\n", path);
+		}
+	} else if (!(added = Jars_add(js, dat_file_path))) {
+		report("Cannot add %s to data file list.\n", dat_file_path);
+	}
+	if (!added) {
+		STATS_COUNT(jars_skipped, 1);
+	}
+	stats_leave(prev_phase, &start);
+
+	free(dat_file_path);
+	return added;
+}
+
+/* Join the directory path `dir` and the entry name `name` in `w`'s
+   scratch path buffer, and return the buffer (or NULL if it couldn't be
+   made big enough). The buffer has room to append ".dat". */
+char* Walker_path(Walker* w, const char* dir, const char* name)
+{
+	size_t dir_len = strlen(dir);
+	char* new_path;
+	size_t path_needing_alloc = dir_len + strlen(name) + 6;
+
+	if (path_needing_alloc > w->path_alloc) {
+		if ((new_path = realloc(w->path, path_needing_alloc)) == NULL) {
+			report("Cannot reallocate %lu bytes for file path.\n",
+			       path_needing_alloc);
+			return NULL;
+		}
+		w->path = new_path;
+		w->path_alloc = path_needing_alloc;
+	}
+	memcpy(w->path, dir, dir_len);
+	if (dir_len && (dir[dir_len - 1] != '/')) {
+		w->path[dir_len++] = '/';
+	}
+	strcpy(w->path + dir_len, name);
+	return w->path;
+}
+
+void WalkDir_release(WalkDir* wd)
+{
+	if (__atomic_sub_fetch(&(wd->refs), 1, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+	if (wd->d != NULL) {
+		closedir(wd->d);
+	} else {
+		close(wd->fd);
+	}
+	free(wd);
+}
+
+void WalkTask_free(WalkTask* task)
+{
+	if (task->parent != NULL) {
+		WalkDir_release(task->parent);
+	}
+	free(task->path);
+	free(task);
+}
+
+/* Add `task` to the tail of `q`. */
+unsigned char WalkQueue_push(WalkQueue* q, WalkTask* task)
+{
+	WalkTask** new_tasks;
+	unsigned char pushed = 1;
+
+	pthread_mutex_lock(&(q->lock));
+	if (q->tail == q->capacity) {
+		if (q->head) {
+			/* Slide the queue back to the start of its array, which
+			   the front of the queue's been stolen from. */
+			memmove(q->tasks, q->tasks + q->head,
+			        (q->tail - q->head) * sizeof(WalkTask*));
+			q->tail -= q->head;
+			q->head = 0;
+		} else if ((new_tasks = realloc(q->tasks, (q->capacity + 16) * 2
+		                                          * sizeof(WalkTask*)))
+		           == NULL) {
+			report("Cannot reallocate directory queue memory.\n");
+			pushed = 0;
+		} else {
+			q->tasks = new_tasks;
+			q->capacity = (q->capacity + 16) * 2;
+		}
+	}
+	if (pushed) {
+		q->tasks[q->tail++] = task;
+	}
+	pthread_mutex_unlock(&(q->lock));
+	return pushed;
+}
+
+/* Take a task from the tail of `q` (if `steal` is 0) or from its head
+   (if `steal` is 1). A walker works through its own queue newest first,
+   which keeps its walk depth-first and its open directories few, but
+   steals the oldest tasks from other walkers' queues, since those tend
+   to be the roots of the biggest unexplored subtrees. */
+WalkTask* WalkQueue_take(WalkQueue* q, unsigned char steal)
+{
+	WalkTask* task = NULL;
+
+	pthread_mutex_lock(&(q->lock));
+	if (q->head < q->tail) {
+		task = steal ? q->tasks[q->head++] : q->tasks[--(q->tail)];
+		if (q->head == q->tail) {
+			q->head = 0;
+			q->tail = 0;
+		}
+	}
+	pthread_mutex_unlock(&(q->lock));
+	return task;
+}
+
+/* Queue `task` for `w`, and wake an idle walker to steal it if there is
+   one. (Idle walkers recheck `queued` before sleeping, under the lock,
+   so one that goes idle just after `num_idle` is read here won't sleep
+   through the new task.) */
+void Walker_push(Walker* w, WalkTask* task)
+{
+	Walk* walk = w->walk;
+
+	__atomic_add_fetch(&(walk->pending), 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&(walk->queued), 1, __ATOMIC_SEQ_CST);
+	if (!WalkQueue_push(&(w->queue), task)) {
+		report("Cannot queue directory %s.\n", task->path);
+		__atomic_sub_fetch(&(walk->queued), 1, __ATOMIC_SEQ_CST);
+		__atomic_sub_fetch(&(walk->pending), 1, __ATOMIC_SEQ_CST);
+		WalkTask_free(task);
+		return;
+	}
+	if (__atomic_load_n(&(walk->num_idle), __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&(walk->lock));
+		pthread_cond_signal(&(walk->wake));
+		pthread_mutex_unlock(&(walk->lock));
+	}
+}
+
+/* Queue the subdirectory `name` of the directory `wd`, which `task` is
+   scanning. `is_link` says whether `name` is a symbolic link. */
+void Walker_descend(Walker* w, WalkDir* wd, const WalkTask* task,
+                    const char* name, unsigned char is_link)
+{
+	WalkTask* subtask;
+
+	if (Walker_path(w, task->path, name) == NULL) {
+		return;
+	}
+
+	/* Directories are opened relative to their parents, so the kernel
+	   never resolves a path with more than one symbolic link in it,
+	   and never fails with ELOOP. Count the links followed instead,
+	   in case Walk_visit() can't remember a directory it's been to
+	   and a link to an ancestor traps the walk. */
+	if (task->hops + is_link > MAX_SYMLINK_HOPS) {
+		report("Cannot access information about path %s.\n",
+		       w->path);
+		return;
+	}
+
+	if ((subtask = malloc(sizeof(WalkTask))) == NULL) {
+		report("Cannot allocate directory record memory.\n");
+		return;
+	}
+	if ((subtask->path = strdup(w->path)) == NULL) {
+		report("Cannot allocate directory name memory.\n");
+		free(subtask);
+		return;
+	}
+	subtask->name = subtask->path + strlen(subtask->path) - strlen(name);
+	subtask->hops = task->hops + is_link;
+	subtask->parent = wd;
+	subtask->parent_id = wd->id;
+	__atomic_add_fetch(&(wd->refs), 1, __ATOMIC_ACQ_REL);
+	Walker_push(w, subtask);
+}
+
+/* Note the directory at `path`, with inode information `info`, in the
+   jar catalog, putting its index in the new catalog into `cat_dir`.
+   If the old catalog has an up-to-date record of the directory, carry
+   its entries over and return the record; otherwise return NULL. */
+const CatDir* Walk_catalog_dir(Walk* walk, const char* path,
+                               const struct stat* info, uint32_t* cat_dir)
+{
+	Catalog* cat = walk->cat;
+	const CatDir* cd;
+	CatEnt* ce;
+	uint32_t idx;
+	uint32_t name_off;
+
+	cd = Catalog_find(cat, path, info);
+	pthread_mutex_lock(&(walk->lock));
+	if (cd == NULL) {
+		cat->dirty = 1;
+	}
+	if (!cat->failed && !Catalog_add_dir(cat, path, info, cat_dir)) {
+		cat->failed = 1;
+	}
+	for (idx = 0; (cd != NULL) && (idx < cd->num_ents) && !cat->failed;
+	     idx++) {
+		if (!Catalog_add_ent(cat, *cat_dir,
+		                     cat->strs + cat->ents[cd->first_ent + idx].name_off,
+		                     NULL, NULL, 0)) {
+			cat->failed = 1;
+			break;
+		}
+		ce = &(cat->new_ents[cat->new_ents_count - 1]);
+		name_off = ce->name_off;
+		*ce = cat->ents[cd->first_ent + idx];
+		ce->name_off = name_off;
+	}
+	pthread_mutex_unlock(&(walk->lock));
+	return cd;
+}
+
+/* Find the slot for the directory `id` in `walk`'s table of visits:
+   the slot it's in, or the empty slot it would go in. */
+WalkVisit* Walk_find_visit(const Walk* walk, const FileId* id)
+{
+	size_t slot = hash_bytes((const char*) id, sizeof(FileId))
+	              & (walk->num_visit_slots - 1);
+
+	while ((walk->visits[slot].path != NULL)
+	       && ((walk->visits[slot].id.dev != id->dev)
+	           || (walk->visits[slot].id.ino != id->ino))) {
+		slot = (slot + 1) & (walk->num_visit_slots - 1);
+	}
+	return &(walk->visits[slot]);
+}
+
+/* Note that the walk has reached the directory `id` as `task`, and
+   return whether to scan it: only if the walk hasn't been there before,
+   by any path. Every link to a directory is kept, though, so that
+   Walk_name_dirs() can work out which path to it comes first, however
+   it happened to be reached first. If there's no memory to remember
+   `id`, the walk can only carry on as if it hadn't, and rely on its
+   limit on symbolic links to escape any cycle. */
+unsigned char Walk_visit(Walk* walk, const WalkTask* task, const FileId* id)
+{
+	WalkLink* link;
+	WalkLink* new_links;
+	WalkVisit* new_visits;
+	size_t num_new_slots;
+	size_t slot;
+	WalkVisit* v;
+	size_t visit_no;
+
+	pthread_mutex_lock(&(walk->visit_lock));
+
+	if (walk->num_links == walk->links_capacity) {
+		new_links = realloc(walk->links, (walk->links_capacity + 64) * 2
+		                                 * sizeof(WalkLink));
+		if (new_links != NULL) {
+			walk->links = new_links;
+			walk->links_capacity = (walk->links_capacity + 64) * 2;
+		}
+	}
+	if (walk->num_links < walk->links_capacity) {
+		link = &(walk->links[walk->num_links]);
+		link->from = task->parent_id;
+		link->to = *id;
+		if ((link->name = strdup(task->name)) != NULL) {
+			walk->num_links++;
+		}
+	}
+
+	/* Keep the table no more than half full. */
+	if (2 * (walk->num_visits + 1) > walk->num_visit_slots) {
+		num_new_slots = walk->num_visit_slots ? 2 * walk->num_visit_slots
+		                                      : 256;
+		if ((new_visits = calloc(num_new_slots, sizeof(WalkVisit)))
+		    == NULL) {
+			pthread_mutex_unlock(&(walk->visit_lock));
+			return 1;
+		}
+		for (visit_no = 0; visit_no < walk->num_visit_slots; visit_no++) {
+			if (walk->visits[visit_no].path == NULL) {
+				continue;
+			}
+			slot = hash_bytes((const char*) &(walk->visits[visit_no].id),
+			                  sizeof(FileId)) & (num_new_slots - 1);
+			while (new_visits[slot].path != NULL) {
+				slot = (slot + 1) & (num_new_slots - 1);
+			}
+			new_visits[slot] = walk->visits[visit_no];
+		}
+		free(walk->visits);
+		walk->visits = new_visits;
+		walk->num_visit_slots = num_new_slots;
+	}
+
+	v = Walk_find_visit(walk, id);
+	if (v->path != NULL) {
+		walk->aliased = 1;
+		pthread_mutex_unlock(&(walk->visit_lock));
+		return 0;
+	}
+	if ((v->path = strdup(task->path)) != NULL) {
+		v->id = *id;
+		walk->num_visits++;
+	}
+	pthread_mutex_unlock(&(walk->visit_lock));
+	return 1;
+}
+
+int WalkLink_compare(const void* a, const void* b)
+{
+	const FileId* p = &(((const WalkLink*) a)->from);
+	const FileId* q = &(((const WalkLink*) b)->from);
+
+	if (p->dev != q->dev) {
+		return (p->dev < q->dev) ? -1 : 1;
+	}
+	return (p->ino < q->ino) ? -1 : (p->ino > q->ino);
+}
+
+/* Add `route` to the heap of `*num_routes` routes at `routes`, which
+   has room for it, keeping the route whose path comes first by
+   compare_path_components() at the top. */
+void WalkRoute_push(WalkRoute* routes, size_t* num_routes,
+                    const WalkRoute* route)
+{
+	size_t at = (*num_routes)++;
+
+	while (at && (compare_path_components(route->path,
+	                                      routes[(at - 1) / 2].path) < 0)) {
+		routes[at] = routes[(at - 1) / 2];
+		at = (at - 1) / 2;
+	}
+	routes[at] = *route;
+}
+
+/* Take the top route off the heap of `*num_routes` routes at `routes`,
+   putting it in `route`. */
+void WalkRoute_pop(WalkRoute* routes, size_t* num_routes, WalkRoute* route)
+{
+	size_t at = 0;
+	size_t child;
+	WalkRoute last = routes[--(*num_routes)];
+
+	*route = routes[0];
+	while ((child = 2 * at + 1) < *num_routes) {
+		if ((child + 1 < *num_routes)
+		    && (compare_path_components(routes[child + 1].path,
+		                                routes[child].path) < 0)) {
+			child++;
+		}
+		if (compare_path_components(last.path, routes[child].path) <= 0) {
+			break;
+		}
+		routes[at] = routes[child];
+		at = child;
+	}
+	routes[at] = last;
+}
+
+/* Work out, for every directory `walk` reached by more than one link,
+   the path to it that comes first by compare_path_components(), and
+   put it in the directory's `first_path`. Which link a directory was
+   scanned by is down to how the walk's threads happened to run, but the
+   links themselves aren't, so neither is the answer. Following a link
+   only ever makes a path come later, so the paths can be found much as
+   Dijkstra finds shortest paths, taking the first path waiting from a
+   heap each time; a directory's paths through itself are never first,
+   so cycles are no trouble. */
+void Walk_name_dirs(Walk* walk)
+{
+	size_t dir_len;
+	size_t hi;
+	WalkLink key;
+	WalkLink* link;
+	size_t link_no;
+	size_t lo;
+	WalkRoute next;
+	size_t num_routes = 0;
+	WalkRoute route;
+	WalkRoute* routes;
+	WalkVisit* v;
+
+	if ((routes = malloc((walk->num_links + 1) * sizeof(WalkRoute)))
+	    == NULL) {
+		report("Cannot allocate memory to name directories.\n");
+		return;
+	}
+	qsort(walk->links, walk->num_links, sizeof(WalkLink), WalkLink_compare);
+
+	/* The links from the walk's starting point sort first. */
+	for (link_no = 0; (link_no < walk->num_links)
+	                  && !walk->links[link_no].from.dev
+	                  && !walk->links[link_no].from.ino; link_no++) {
+		if ((next.path = strdup(walk->links[link_no].name)) != NULL) {
+			next.to = walk->links[link_no].to;
+			WalkRoute_push(routes, &num_routes, &next);
+		}
+	}
+	while (num_routes) {
+		WalkRoute_pop(routes, &num_routes, &route);
+		v = Walk_find_visit(walk, &(route.to));
+		if ((v->path == NULL) || (v->first_path != NULL)) {
+			free(route.path);
+			continue;
+		}
+		v->first_path = route.path;
+
+		/* Follow the links out of the directory. Each link's followed
+		   once at most, so the heap has room. */
+		key.from = route.to;
+		lo = 0;
+		hi = walk->num_links;
+		while (lo < hi) {
+			if (WalkLink_compare(&(walk->links[lo + (hi - lo) / 2]), &key)
+			    < 0) {
+				lo = lo + (hi - lo) / 2 + 1;
+			} else {
+				hi = lo + (hi - lo) / 2;
+			}
+		}
+		dir_len = strlen(route.path);
+		for (link = &(walk->links[lo]);
+		     (link < walk->links + walk->num_links)
+		     && !WalkLink_compare(link, &key); link++) {
+			if ((next.path = malloc(dir_len + strlen(link->name) + 2))
+			    == NULL) {
+				continue;
+			}
+			strcpy(next.path, route.path);
+			if (dir_len && (route.path[dir_len - 1] != '/')) {
+				strcat(next.path, "/");
+			}
+			strcat(next.path, link->name);
+			next.to = link->to;
+			WalkRoute_push(routes, &num_routes, &next);
+		}
+	}
+	free(routes);
+}
+
+/* Find the directory `path`, of `len` bytes, among `js`'s directories,
+   putting its number in `dir_id`; return 0 if it isn't there. */
+unsigned char Jars_find_dir(const Jars* js, const char* path, size_t len,
+                            unsigned int* dir_id)
+{
+	const JarDir* d;
+	uint64_t h = hash_bytes(path, len);
+	size_t slot;
+
+	if (!js->num_dir_slots) {
+		return 0;
+	}
+	slot = h & (js->num_dir_slots - 1);
+	while (js->dir_slots[slot]) {
+		d = &(js->dirs[js->dir_slots[slot] - 1]);
+		if ((d->hash == h) && (d->len == len)
+		    && !memcmp(d->path, path, len)) {
+			*dir_id = js->dir_slots[slot] - 1;
+			return 1;
+		}
+		slot = (slot + 1) & (js->num_dir_slots - 1);
+	}
+	return 0;
+}
+
+/* Move the jars of `js` from `first_jar` on that `walk` found in a
+   directory it reached by more than one link from wherever they were
+   found to the first path to their directory (see Walk_name_dirs()). */
+void Walk_move_jars(const Walk* walk, Jars* js, unsigned int first_jar)
+{
+	char* dir;
+	unsigned int dir_id;
+	size_t dir_len;
+	unsigned int jar_no;
+	unsigned int* moved_to;
+	unsigned int num_dirs = js->num_dirs;
+	const WalkVisit* v;
+	size_t visit_no;
+
+	if ((moved_to = malloc((num_dirs + 1) * sizeof(unsigned int))) == NULL) {
+		report("Cannot allocate memory for fortune file directories.\n");
+		return;
+	}
+	for (dir_id = 0; dir_id < num_dirs; dir_id++) {
+		moved_to[dir_id] = dir_id;
+	}
+	for (visit_no = 0; visit_no < walk->num_visit_slots; visit_no++) {
+		v = &(walk->visits[visit_no]);
+		if ((v->path == NULL) || (v->first_path == NULL)
+		    || !strcmp(v->path, v->first_path)) {
+			continue;
+		}
+
+		/* Jars' directories end with a slash. */
+		dir_len = strlen(v->path);
+		if ((dir = malloc(dir_len + strlen(v->first_path) + 2)) == NULL) {
+			continue;
+		}
+		strcpy(dir, v->path);
+		if (dir_len && (dir[dir_len - 1] != '/')) {
+			dir[dir_len++] = '/';
+		}
+		if (Jars_find_dir(js, dir, dir_len, &dir_id)
+		    && (dir_id < num_dirs)) {
+			strcpy(dir, v->first_path);
+			dir_len = strlen(dir);
+			if (dir_len && (dir[dir_len - 1] != '/')) {
+				dir[dir_len++] = '/';
+			}
+			if (!Jars_intern_dir(js, dir, dir_len, 1, &(moved_to[dir_id]))) {
+				moved_to[dir_id] = dir_id;
+			}
+		}
+		free(dir);
+	}
+	for (jar_no = first_jar; jar_no < js->count; jar_no++) {
+		js->j[jar_no].dir_id = moved_to[js->j[jar_no].dir_id];
+		js->j[jar_no].dir = js->dirs[js->j[jar_no].dir_id].path;
+	}
+	free(moved_to);
+}
+
+/* Note an entry `name` of a freshly scanned directory, open as
+   `dir_fd`, in the jar catalog. A jar's dat file is looked up again, so
+   that a jar drawn from later can be checked against it. */
+void Walk_catalog_ent(Walk* walk, uint32_t cat_dir, int dir_fd,
+                      const char* name, const Jar* j, const FileId* id,
+                      unsigned char is_link)
+{
+	Catalog* cat = walk->cat;
+	CatEnt* ce;
+	struct stat info;
+	unsigned char stamped = 0;
+
+	if ((j != NULL) && !j->indexed) {
+		STATS_COUNT(stats, 1);
+		stamped = !fstatat(dir_fd, name, &info, 0);
+	}
+	pthread_mutex_lock(&(walk->lock));
+	if (cat->failed) {
+		/* There's no catalog to save. */
+	} else if (!Catalog_add_ent(cat, cat_dir, name, j, id, is_link)) {
+		cat->failed = 1;
+	} else if (stamped) {
+		ce = &(cat->new_ents[cat->new_ents_count - 1]);
+		ce->dat_size = info.st_size;
+		ce->dat_mtime = info.st_mtim.tv_sec * (int64_t) 1000000000
+		                + info.st_mtim.tv_nsec;
+	}
+	pthread_mutex_unlock(&(walk->lock));
+}
+
+/* Set up `r` as an io_uring of `entries` entries. It fails quietly,
+   since the kernel may be too old for io_uring, or forbid it. */
+unsigned char Ring_init(Ring* r, unsigned int entries)
+{
+	struct io_uring_params params;
+
+	memset(r, 0, sizeof(Ring));
+	memset(&params, 0, sizeof(params));
+	if ((r->fd = syscall(__NR_io_uring_setup, entries, &params)) < 0) {
+		return 0;
+	}
+	r->sq_map_size = params.sq_off.array
+	                 + params.sq_entries * sizeof(unsigned int);
+	r->cq_map_size = params.cq_off.cqes
+	                 + params.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE,
+	                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->cq_map = mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE,
+	                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+	               MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if ((r->sq_map == MAP_FAILED) || (r->cq_map == MAP_FAILED)
+	    || (r->sqes == MAP_FAILED)) {
+		if (r->sq_map != MAP_FAILED) {
+			munmap(r->sq_map, r->sq_map_size);
+		}
+		if (r->cq_map != MAP_FAILED) {
+			munmap(r->cq_map, r->cq_map_size);
+		}
+		if (r->sqes != MAP_FAILED) {
+			munmap(r->sqes, r->sqes_size);
+		}
+		close(r->fd);
+		return 0;
+	}
+	r->sq_head = (unsigned int*) (r->sq_map + params.sq_off.head);
+	r->sq_tail = (unsigned int*) (r->sq_map + params.sq_off.tail);
+	r->sq_mask = (unsigned int*) (r->sq_map + params.sq_off.ring_mask);
+	r->sq_array = (unsigned int*) (r->sq_map + params.sq_off.array);
+	r->cq_head = (unsigned int*) (r->cq_map + params.cq_off.head);
+	r->cq_tail = (unsigned int*) (r->cq_map + params.cq_off.tail);
+	r->cq_mask = (unsigned int*) (r->cq_map + params.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*) (r->cq_map + params.cq_off.cqes);
+	return 1;
+}
+
+void Ring_free(Ring* r)
+{
+	munmap(r->sq_map, r->sq_map_size);
+	munmap(r->cq_map, r->cq_map_size);
+	munmap(r->sqes, r->sqes_size);
+	close(r->fd);
+}
+
+/* Queue a cleared submission entry on `r` for the caller to fill in,
+   with `user_data` to identify its completion. The caller mustn't
+   queue more entries than it has collected completions for, plus the
+   ring's size. */
+struct io_uring_sqe* Ring_queue(Ring* r, uint64_t user_data)
+{
+	unsigned int tail = *(r->sq_tail);
+	unsigned int slot = tail & *(r->sq_mask);
+	struct io_uring_sqe* sqe = &(r->sqes[slot]);
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->user_data = user_data;
+	r->sq_array[slot] = slot;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->to_submit++;
+	return sqe;
+}
+
+/* Submit everything queued on `r`, and wait until at least
+   `num_completions` completions are waiting to be collected. */
+unsigned char Ring_run(Ring* r, unsigned int num_completions)
+{
+	unsigned int ready;
+	int submitted;
+
+	for (;;) {
+		ready = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)
+		        - *(r->cq_head);
+		if (!r->to_submit && (ready >= num_completions)) {
+			return 1;
+		}
+		submitted = syscall(__NR_io_uring_enter, r->fd, r->to_submit,
+		                    (ready < num_completions)
+		                    ? num_completions - ready : 0,
+		                    IORING_ENTER_GETEVENTS, NULL, 0);
+		if (submitted < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 0;
+		}
+		r->to_submit -= submitted;
+	}
+}
+
+/* Collect a completion from `r`, if there's one waiting. */
+unsigned char Ring_reap(Ring* r, uint64_t* user_data, int* res)
+{
+	unsigned int head = *(r->cq_head);
+	const struct io_uring_cqe* cqe;
+
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+	cqe = &(r->cqes[head & *(r->cq_mask)]);
+	*user_data = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Note the dat file `name`, at `w->path` and with the file ID `id`, to
+   have its header loaded by Walker_load_headers(). */
+unsigned char Walker_defer_header(Walker* w, const char* name,
+                                  const FileId* id, unsigned char is_link)
+{
+	HeaderBatch* b = &(w->batch);
+	HeaderLoad* load = &(b->loads[b->count]);
+	size_t name_len = strlen(name);
+	char* new_strs;
+	size_t path_len = strlen(w->path);
+	size_t needed = b->strs_len + path_len + 2 * name_len;
+
+	if (needed > b->strs_size) {
+		if ((new_strs = realloc(b->strs, 2 * needed)) == NULL) {
+			return 0;
+		}
+		b->strs = new_strs;
+		b->strs_size = 2 * needed;
+	}
+	load->path_off = b->strs_len;
+	memcpy(b->strs + b->strs_len, w->path, path_len + 1);
+	load->name_off = load->path_off + path_len - name_len;
+	b->strs_len += path_len + 1;
+	load->text_name_off = b->strs_len;
+	memcpy(b->strs + b->strs_len, name, name_len - 4);
+	b->strs[b->strs_len + name_len - 4] = '\0';
+	b->strs_len += name_len - 3;
+	load->id = *id;
+	load->is_link = is_link;
+	b->count++;
+	return 1;
+}
+
+/* Load the headers of the dat files in `w`'s batch, which are all in
+   the directory `dir_fd`, and add their jars to `w`'s jar list (and to
+   the jar catalog, if there is one). Rather than go through a round
+   of system calls per file, it opens every dat file in one go, then
+   reads every header and closes every file in another, so on a cold
+   cache or a network filesystem the files are waited on together
+   rather than one after another. Anything that goes wrong with a file sends it
+   down the ordinary path, Jars_add_at(), to report the failure, as does
+   a fortune file that's only there compressed. */
+void Walker_load_headers(Walker* w, int dir_fd, Catalog* cat,
+                         uint32_t cat_dir)
+{
+	unsigned char added;
+	HeaderBatch* b = &(w->batch);
+	Jar j;
+	HeaderLoad* load;
+	unsigned int load_no;
+	unsigned int num_queued = 0;
+	unsigned char ok;
+	unsigned int prev_phase;
+	int res;
+	struct io_uring_sqe* sqe;
+	struct timespec start;
+	uint64_t user_data;
+
+	if (!b->count) {
+		return;
+	}
+	prev_phase = stats_enter(PHASE_HEADERS, &start);
+	for (load_no = 0; load_no < b->count; load_no++) {
+		load = &(b->loads[load_no]);
+		load->fd = load->stat_res = load->read_res = -1;
+		load->close_res = -ECANCELED;
+		sqe = Ring_queue(&(w->ring), 2 * load_no);
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = dir_fd;
+		sqe->addr = (uintptr_t) (b->strs + load->name_off);
+		sqe->open_flags = O_RDONLY | O_CLOEXEC;
+	}
+
+	/* io_uring always hands statx off to a worker thread, which costs
+	   more than the system call when the inode's cached, so look up
+	   the fortune files' sizes directly while the opens go on. */
+	ok = Ring_run(&(w->ring), 0);
+	for (load_no = 0; load_no < b->count; load_no++) {
+		load = &(b->loads[load_no]);
+		load->stat_res = statx(dir_fd, b->strs + load->text_name_off, 0,
+		                       STATX_SIZE, &(load->text_info));
+	}
+	ok = ok && Ring_run(&(w->ring), b->count);
+	while (Ring_reap(&(w->ring), &user_data, &res)) {
+		load = &(b->loads[user_data / 2]);
+		load->fd = res;
+	}
+	STATS_COUNT(files_opened, b->count);
+	STATS_COUNT(stats, b->count);
+
+	/* Read each header, closing each file once its header's read (or
+	   not, if the read falls short, in which case it's closed here). */
+	for (load_no = 0; ok && (load_no < b->count); load_no++) {
+		load = &(b->loads[load_no]);
+		if (load->fd < 0) {
+			continue;
+		}
+		sqe = Ring_queue(&(w->ring), 2 * load_no);
+		sqe->opcode = IORING_OP_READ;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->fd = load->fd;
+		sqe->addr = (uintptr_t) load->header;
+		sqe->len = STRFILE_HEADER_SIZE;
+		sqe = Ring_queue(&(w->ring), 2 * load_no + 1);
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = load->fd;
+		load->close_res = 1;
+		num_queued += 2;
+	}
+	ok = ok && Ring_run(&(w->ring), num_queued);
+	while (Ring_reap(&(w->ring), &user_data, &res)) {
+		load = &(b->loads[user_data / 2]);
+		if (user_data % 2) {
+			load->close_res = res;
+		} else {
+			load->read_res = res;
+		}
+	}
+	STATS_COUNT(bytes_read, num_queued / 2 * STRFILE_HEADER_SIZE);
+
+	for (load_no = 0; load_no < b->count; load_no++) {
+		load = &(b->loads[load_no]);
+		if ((load->fd >= 0) && (load->close_res == -ECANCELED)) {
+			close(load->fd);
+		}
+		if (ok && (load->fd >= 0) && (load->stat_res == 0)
+		    && (load->read_res == STRFILE_HEADER_SIZE)) {
+			memset(&j, 0, sizeof(Jar));
+			Jar_read_header(&j, load->header);
+			j.file_size = load->text_info.stx_size;
+			added = Jars_add_known(&(w->js), b->strs + load->path_off, &j);
+		} else {
+			added = Jars_add_at(&(w->js), dir_fd, b->strs + load->name_off,
+			                    b->strs + load->path_off);
+		}
+		if (!added) {
+			report("Cannot add %s to data file list.\n",
+			       b->strs + load->path_off);
+			STATS_COUNT(jars_skipped, 1);
+			continue;
+		}
+		w->js.j[w->js.count - 1].id = load->id;
+		if (cat != NULL) {
+			Walk_catalog_ent(w->walk, cat_dir, dir_fd,
+			                 b->strs + load->name_off,
+			                 &(w->js.j[w->js.count - 1]), &(load->id),
+			                 load->is_link);
+		}
+	}
+	stats_leave(prev_phase, &start);
+
+	/* If the ring's failed, it can't be trusted to be in a fit state
+	   for another batch, so go without it from now on. */
+	if (!ok) {
+		Ring_free(&(w->ring));
+		w->use_ring = 0;
+	}
+	b->count = 0;
+	b->strs_len = 0;
+}
+
+/* Cut `w`'s jar list down to a sample of one jar (see Jars_sample()).
+   The jars thrown away would leave their paths in the list's arena, so
+   the jar kept moves to a fresh list, and the old one's freed. */
+void Walker_sample(Walker* w)
+{
+	Jars fresh;
+
+	Jars_sample(&(w->js), w->walk->wopts);
+	if (!Jars_init(&fresh, 1)) {
+		return;
+	}
+	if (w->js.count) {
+		fresh.j[0] = w->js.j[0];
+		if ((Jar_path(&(w->js.j[0]), ".dat", &(w->path), &(w->path_alloc))
+		     == NULL)
+		    || !Jars_set_path(&fresh, &(fresh.j[0]), w->path)) {
+			Jars_free(&fresh);
+			return;
+		}
+		fresh.count = 1;
+		fresh.num_fortunes = fresh.j[0].num_fortunes;
+		w->js.j[0].index = NULL;
+		w->js.j[0].by_length = NULL;
+	}
+	Jars_free(&(w->js));
+	w->js = fresh;
+}
+
+/* Scan the directory described by `task`: add the jars in it to `w`'s
+   jar list, and queue its subdirectories for scanning in turn. */
+void Walker_scan(Walker* w, WalkTask* task)
+{
+	unsigned char added;
+	Catalog* cat = w->walk->cat;
+	uint32_t cat_dir = 0;
+	const CatDir* cd = NULL;
+	const CatEnt* ce;
+	const char* dat_name;
+	dev_t dev;
+	struct dirent* en;
+	int fd;
+	FileId id;
+	uint32_t idx;
+	struct stat info;
+	unsigned char is_dir;
+	unsigned char is_link;
+	Jar known_jar;
+	const char* name;
+	unsigned int prev_phase;
+	struct timespec start;
+	WalkDir* wd;
+
+	fd = openat((task->parent == NULL) ? AT_FDCWD : task->parent->fd,
+	            task->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	STATS_COUNT(dirs_opened, 1);
+	if (task->parent != NULL) {
+		WalkDir_release(task->parent);
+		task->parent = NULL;
+	}
+	if (fd < 0) {
+		report("Cannot open directory %s.\n", task->path);
+		return;
+	}
+	if ((wd = malloc(sizeof(WalkDir))) == NULL) {
+		report("Cannot allocate directory record memory.\n");
+		close(fd);
+		return;
+	}
+	wd->d = NULL;
+	wd->fd = fd;
+	wd->refs = 1;
+
+	/* Symbolic links can lead back to a directory already scanned, or
+	   make two paths to the same one, so skip any directory the walk's
+	   been to before, whatever it was called then. */
+	STATS_COUNT(stats, 1);
+	if (fstat(fd, &info)) {
+		report("Cannot access information about path %s.\n",
+		       task->path);
+		if (cat != NULL) {
+			pthread_mutex_lock(&(w->walk->lock));
+			cat->failed = 1;
+			pthread_mutex_unlock(&(w->walk->lock));
+		}
+		WalkDir_release(wd);
+		return;
+	}
+	dev = info.st_dev;
+	id.dev = dev;
+	id.ino = info.st_ino;
+	wd->id = id;
+	if (!Walk_visit(w->walk, task, &id)) {
+		WalkDir_release(wd);
+		return;
+	}
+	if (cat != NULL) {
+		cd = Walk_catalog_dir(w->walk, task->path, &info, &cat_dir);
+	}
+
+	if (cd != NULL) {
+		/* The catalog knows what's in this directory already. */
+		for (idx = 0; idx < cd->num_ents; idx++) {
+			if (w->walk->wopts->sample
+			    && (w->js.count >= SAMPLE_BATCH_SIZE)) {
+				Walker_sample(w);
+			}
+			ce = &(cat->ents[cd->first_ent + idx]);
+			name = cat->strs + ce->name_off;
+			if (ce->num_fortunes == CATENT_SUBDIR) {
+				Walker_descend(w, wd, task, name, ce->is_link);
+				continue;
+			}
+			if (Walker_path(w, task->path, name) == NULL) {
+				continue;
+			}
+			memset(&known_jar, 0, sizeof(Jar));
+			known_jar.id = ce->id;
+			known_jar.indexed = ce->indexed;
+			known_jar.lazy = ce->lazy;
+			known_jar.num_fortunes = ce->num_fortunes;
+			known_jar.min_len = ce->min_len;
+			known_jar.max_len = ce->max_len;
+			known_jar.delim = ce->delim;
+			known_jar.flags = ce->flags;
+			known_jar.file_size = ce->file_size;
+			known_jar.wide = ce->wide;
+			known_jar.dat_size = ce->dat_size;
+			known_jar.dat_mtime = ce->dat_mtime;
+			if (!Jars_add_known(&(w->js), w->path, &known_jar)) {
+				report("Cannot add %s to data file list.\n",
+				       w->path);
+			}
+		}
+		WalkDir_release(wd);
+		return;
+	}
+
+	if ((wd->d = fdopendir(fd)) == NULL) {
+		report("Cannot open directory %s.\n", task->path);
+		WalkDir_release(wd);
+		return;
+	}
+
+	/* Iterate over every filesystem entry in the directory. Most
+	   filesystems say what type of thing each entry is, so `stat` is
+	   only needed for symbolic links (to find out what they lead to)
+	   and on filesystems that don't. */
+	while ((en = readdir(wd->d)) != NULL) {
+		if (w->walk->wopts->sample
+		    && (w->js.count >= SAMPLE_BATCH_SIZE)) {
+			Walker_sample(w);
+		}
+		name = en->d_name;
+
+		/* Skip the filesystem entries ./ and ../. */
+		if (is_dot_or_dot_dot(name)) {
+			continue;
+		}
+
+		is_dir = (en->d_type == DT_DIR);
+		is_link = (en->d_type == DT_LNK);
+		if (en->d_type == DT_UNKNOWN) {
+			STATS_COUNT(stats, 1);
+			if (fstatat(fd, name, &info, AT_SYMLINK_NOFOLLOW)) {
+				report("Cannot access information about path %s.\n",
+				       Walker_path(w, task->path, name));
+				continue;
+			}
+			is_dir = S_ISDIR(info.st_mode);
+			is_link = S_ISLNK(info.st_mode);
+		}
+		if (is_link) {
+			STATS_COUNT(stats, 1);
+			if (fstatat(fd, name, &info, 0)) {
+				report("Cannot access information about path %s.\n",
+				       Walker_path(w, task->path, name));
+				continue;
+			}
+			is_dir = S_ISDIR(info.st_mode);
+		}
+
+		if (is_dir) {
+			if (cat != NULL) {
+				Walk_catalog_ent(w->walk, cat_dir, fd, name, NULL, NULL,
+				                 is_link);
+			}
+			Walker_descend(w, wd, task, name, is_link);
+			continue;
+		}
+
+		if (Walker_path(w, task->path, name) == NULL) {
+			continue;
+		}
+
+		/* A jar reached by two paths is added by both, and each path's
+		   directory is catalogued with it; Jars_drop_duplicates() keeps
+		   just one once the walk's over, by the jar's ID. A link's ID
+		   is that of what it leads to; anything else's is in its
+		   directory entry. */
+		id.dev = is_link ? info.st_dev : dev;
+		id.ino = is_link ? info.st_ino : en->d_ino;
+
+		/* Conventionally, fortune files' names have no dots in them.
+		   When asked to, index any such file that has no dat file. */
+		if (w->walk->wopts->index && (strchr(name, '.') == NULL)) {
+			strcat(w->path, ".dat");
+			dat_name = w->path + strlen(w->path) - strlen(name) - 4;
+			STATS_COUNT(stats, 1);
+			if (!fstatat(fd, dat_name, &info, 0) || (errno != ENOENT)) {
+				continue;
+			}
+			prev_phase = stats_enter(PHASE_HEADERS, &start);
+			added = Jars_index_at(&(w->js), fd, name, w->path,
+			                      w->walk->wopts->index == 2);
+			stats_leave(prev_phase, &start);
+			if (!added) {
+				continue;
+			}
+			w->js.j[w->js.count - 1].id = id;
+			if (cat != NULL) {
+				Walk_catalog_ent(w->walk, cat_dir, fd, dat_name,
+				                 &(w->js.j[w->js.count - 1]), &id, is_link);
+			}
+			continue;
+		}
+
+		/* The files of interest here are strfile-generated .dat files,
+		   which presumably correspond to fortune files. Check that the
+		   file's name ends in ".dat"; if it does, add it to the list of
+		   such files, otherwise skip it. */
+		if (!ends_with_dot_dat(name)) {
+			continue;
+		}
+		if (w->use_ring && Walker_defer_header(w, name, &id, is_link)) {
+			if (w->batch.count == w->batch_limit) {
+				Walker_load_headers(w, fd, cat, cat_dir);
+			}
+			continue;
+		}
+		prev_phase = stats_enter(PHASE_HEADERS, &start);
+		added = w->walk->wopts->lazy
+		        ? Jars_add_lazily_at(&(w->js), fd, name, w->path)
+		        : Jars_add_at(&(w->js), fd, name, w->path);
+		stats_leave(prev_phase, &start);
+		if (!added) {
+			report("Cannot add %s to data file list.\n", w->path);
+			STATS_COUNT(jars_skipped, 1);
+			continue;
+		}
+		w->js.j[w->js.count - 1].id = id;
+		if (cat != NULL) {
+			Walk_catalog_ent(w->walk, cat_dir, fd, name,
+			                 &(w->js.j[w->js.count - 1]), &id, is_link);
+		}
+	}
+	if (w->use_ring) {
+		Walker_load_headers(w, fd, cat, cat_dir);
+	}
+
+	WalkDir_release(wd);
+}
+
+/* Scan directories until every directory in the walk has been scanned,
+   taking them from `w`'s own queue if possible, and otherwise stealing
+   them from the other walkers' queues. */
+void* Walker_run(void* arg)
+{
+	unsigned char done;
+	unsigned int other;
+	WalkTask* task;
+	Walker* w = arg;
+	Walk* walk = w->walk;
+
+	for (;;) {
+		task = WalkQueue_take(&(w->queue), 0);
+		for (other = 1; (task == NULL) && (other < walk->num_walkers);
+		     other++) {
+			task = WalkQueue_take(&(walk->walkers[(w - walk->walkers + other)
+			                                      % walk->num_walkers].queue),
+			                      1);
+		}
+		if (task != NULL) {
+			__atomic_sub_fetch(&(walk->queued), 1, __ATOMIC_SEQ_CST);
+			Walker_scan(w, task);
+			WalkTask_free(task);
+			if (!__atomic_sub_fetch(&(walk->pending), 1, __ATOMIC_SEQ_CST)) {
+				/* That was the last directory; wake everyone so they
+				   can finish. */
+				pthread_mutex_lock(&(walk->lock));
+				pthread_cond_broadcast(&(walk->wake));
+				pthread_mutex_unlock(&(walk->lock));
+			}
+			continue;
+		}
+
+		/* There's nothing to steal right now. Sleep until there is, or
+		   until the walk's over. */
+		pthread_mutex_lock(&(walk->lock));
+		__atomic_add_fetch(&(walk->num_idle), 1, __ATOMIC_SEQ_CST);
+		while (!__atomic_load_n(&(walk->queued), __ATOMIC_SEQ_CST)
+		       && __atomic_load_n(&(walk->pending), __ATOMIC_SEQ_CST)) {
+			pthread_cond_wait(&(walk->wake), &(walk->lock));
+		}
+		__atomic_sub_fetch(&(walk->num_idle), 1, __ATOMIC_SEQ_CST);
+		done = !__atomic_load_n(&(walk->pending), __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&(walk->lock));
+		if (done) {
+			return NULL;
+		}
+	}
+}
+
+/* Pick a number of threads for directory traversal. Traversal mostly
+   waits on the filesystem rather than the CPU (especially over NFS), so
+   it's worth running a few more threads than there are processors. */
+unsigned int default_walk_threads(void)
+{
+	long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (num_cpus < 1) {
+		num_cpus = 1;
+	}
+	if (2 * num_cpus > MAX_WALK_THREADS) {
+		return MAX_WALK_THREADS;
+	}
+	return 2 * num_cpus;
+}
+
+/* Look for fortune cookie files in the hierarchy under `init_path` (or
+   just `init_path` itself, if it's a file), and add them to `js`, in
+   order of path. The hierarchy's traversed by several threads at once,
+   each collecting its own list of jars; the lists are merged at the
+   end. */
+unsigned char walk_for_fortune_files(const char* init_path, Jars* js,
+                                     Catalog* cat, const WalkOptions* wopts)
+{
+	unsigned int batch_limit = 0;
+	unsigned int num_threads = wopts->threads;
+	unsigned int first_jar = js->count;
+	struct stat info_about_path;
+	struct rlimit max_files;
+	unsigned int jar_no;
+	unsigned int num_started = 1;
+	size_t slot;
+	WalkTask* task;
+	WalkOptions unsampled;
+	Walk walk;
+	unsigned int walker_no;
+
+	STATS_COUNT(stats, 1);
+	if (stat(init_path, &info_about_path)) {
+		report("Cannot access information about path %s.\n",
+		       init_path);
+		return 0;
+	}
+	if (S_ISREG(info_about_path.st_mode)) {
+		/* The starting path is merely an ordinary file. It might be a
+		   pack of jars; otherwise, presumably it's a specific fortune
+		   cookie file the user wants to use, so try adding the path to
+		   the list of fortune files. */
+		if (is_pack_file(init_path)) {
+			return Jars_add_pack(js, init_path);
+		}
+		return Jars_build_dat_file_path_and_add(js, init_path, wopts->index);
+	}
+	if (!S_ISDIR(info_about_path.st_mode)) {
+		return 0;
+	}
+
+	/* Set up the walkers, with the initial directory as the first
+	   walker's first task. */
+	if (num_threads < 1) {
+		num_threads = 1;
+	} else if (num_threads > MAX_WALK_THREADS) {
+		num_threads = MAX_WALK_THREADS;
+	}
+	memset(&walk, 0, sizeof(Walk));
+	walk.cat = cat;
+	walk.wopts = wopts;
+	walk.num_walkers = num_threads;
+	if ((walk.walkers = calloc(num_threads, sizeof(Walker))) == NULL) {
+		report("Cannot allocate directory walker memory.\n");
 		return 0;
 	}
+	pthread_mutex_init(&(walk.lock), NULL);
+	pthread_cond_init(&(walk.wake), NULL);
+	pthread_mutex_init(&(walk.visit_lock), NULL);
 
-	/* Jump to a uniformly randomly chosen fortune cookie in the
-	   selected file. */
-	byte_idx = (size_t) (js->j[jar_no].num_fortunes
-	                     * (rand() / (RAND_MAX + 1.0)));
-	byte_idx = (6 + byte_idx) * sizeof(uint32_t);
-	if (fseek(fh, byte_idx, SEEK_SET)) {
-		fprintf(stderr,
-		        "Cannot seek in fortune data file %s for offsets.\n", dat);
+	/* A batch of headers holds a file descriptor per dat file, so keep
+	   all the walkers' batches to a quarter of the descriptors the
+	   process may have, leaving the rest for the directories being
+	   walked. If that leaves too little to be worth batching, don't.
+	   (Lazily added jars' headers aren't read while walking at all.) */
+	if (wopts->uring && !wopts->lazy
+	    && !getrlimit(RLIMIT_NOFILE, &max_files)) {
+		batch_limit = (max_files.rlim_cur == RLIM_INFINITY)
+		              ? HEADER_BATCH_SIZE
+		              : max_files.rlim_cur / 4 / num_threads;
+		if (batch_limit > HEADER_BATCH_SIZE) {
+			batch_limit = HEADER_BATCH_SIZE;
+		}
+	}
+	for (walker_no = 0; walker_no < num_threads; walker_no++) {
+		walk.walkers[walker_no].walk = &walk;
+		pthread_mutex_init(&(walk.walkers[walker_no].queue.lock), NULL);
+		Jars_init(&(walk.walkers[walker_no].js), 0);
+		walk.walkers[walker_no].batch_limit = batch_limit;
+		walk.walkers[walker_no].use_ring
+		    = (batch_limit >= 4)
+		      && Ring_init(&(walk.walkers[walker_no].ring),
+		                   2 * HEADER_BATCH_SIZE);
+	}
+	if (((task = calloc(1, sizeof(WalkTask))) == NULL)
+	    || ((task->path = strdup(init_path)) == NULL)) {
+		report("Cannot allocate directory record memory.\n");
+		free(task);
+	} else {
+		task->name = task->path;
+		Walker_push(&(walk.walkers[0]), task);
+	}
+
+	/* Walk. The calling thread's the first walker. If some threads
+	   can't be started, the walkers that did start will steal their
+	   share of the work anyway. */
+	for (walker_no = 1; walker_no < num_threads; walker_no++) {
+		if (pthread_create(&(walk.walkers[walker_no].thread), NULL,
+		                   Walker_run, &(walk.walkers[walker_no]))) {
+			break;
+		}
+		num_started++;
+	}
+	Walker_run(&(walk.walkers[0]));
+	for (walker_no = 1; walker_no < num_started; walker_no++) {
+		pthread_join(walk.walkers[walker_no].thread, NULL);
+	}
+
+	/* Gather up the jars, putting them in order so the outcome doesn't
+	   depend on which thread happened to find which jar, or by which
+	   link it reached a directory first. */
+	for (walker_no = 0; walker_no < num_threads; walker_no++) {
+		Jars_merge(js, &(walk.walkers[walker_no].js));
+		Jars_free(&(walk.walkers[walker_no].js));
+		free(walk.walkers[walker_no].queue.tasks);
+		free(walk.walkers[walker_no].path);
+		free(walk.walkers[walker_no].batch.strs);
+		if (walk.walkers[walker_no].use_ring) {
+			Ring_free(&(walk.walkers[walker_no].ring));
+		}
+		pthread_mutex_destroy(&(walk.walkers[walker_no].queue.lock));
+	}
+	if (walk.aliased && !wopts->sample) {
+		Walk_name_dirs(&walk);
+		Walk_move_jars(&walk, js, first_jar);
+	}
+	qsort(js->j + first_jar, js->count - first_jar, sizeof(Jar),
+	      Jar_compare_paths);
+	pthread_cond_destroy(&(walk.wake));
+	pthread_mutex_destroy(&(walk.lock));
+	pthread_mutex_destroy(&(walk.visit_lock));
+	for (slot = 0; slot < walk.num_visit_slots; slot++) {
+		free(walk.visits[slot].path);
+		free(walk.visits[slot].first_path);
+	}
+	for (slot = 0; slot < walk.num_links; slot++) {
+		free(walk.links[slot].name);
+	}
+	free(walk.visits);
+	free(walk.links);
+	free(walk.walkers);
+
+	/* A sampling walk judged jars by the paths it found them at, which
+	   in a directory reached by more than one link are down to timing,
+	   so in that case walk again without sampling. The catalog's up to
+	   date already. */
+	if (walk.aliased && wopts->sample) {
+		for (jar_no = first_jar; jar_no < js->count; jar_no++) {
+			js->num_fortunes -= js->j[jar_no].num_fortunes;
+			Jar_free(&(js->j[jar_no]));
+		}
+		js->count = first_jar;
+		unsampled = *wopts;
+		unsampled.sample = 0;
+		return walk_for_fortune_files(init_path, js, NULL, &unsampled);
+	}
+	return 1;
+}
+
+/* Append `num_bytes` bytes at `p` to `cl`'s pending output. */
+unsigned char Client_put(Client* cl, const void* p, size_t num_bytes)
+{
+	char* new_out;
+	size_t new_size;
+
+	if (cl->out_len + num_bytes > cl->out_size) {
+		new_size = (cl->out_len + num_bytes) * 2;
+		if ((new_out = realloc(cl->out, new_size)) == NULL) {
+			report("Cannot allocate memory for server output.\n");
+			return 0;
+		}
+		cl->out = new_out;
+		cl->out_size = new_size;
+	}
+	memcpy(cl->out + cl->out_len, p, num_bytes);
+	cl->out_len += num_bytes;
+	return 1;
+}
+
+/* Turn the request line `cl` has received into its options and cookie
+   count. A request line looks like "tfortune ce 3": the word tfortune,
+   then a word of option letters ("-" if there are none), and then the
+   number of cookies wanted. */
+unsigned char Client_parse(Client* cl)
+{
+	char* end;
+	const char* flag;
+
+	cl->req[cl->req_len] = '\0';
+	if (strncmp(cl->req, "tfortune ", 9)) {
+		return 0;
+	}
+	memset(&(cl->opts), 0, sizeof(Options));
+	for (flag = cl->req + 9; *flag && (*flag != ' '); flag++) {
+		switch (*flag) {
+		case 'c': cl->opts.c = 1; break;
+		case 'e': cl->opts.e = 1; break;
+		case '-': break;
+		default: return 0;
+		}
+	}
+	if (*flag != ' ') {
 		return 0;
 	}
+	cl->remaining = strtoul(flag + 1, &end, 10);
+	cl->batch = (cl->remaining != 1);
+	return (end != flag + 1) && ((*end == '\n') || (*end == '\r'));
+}
+
+/* Draw cookies for `cl` into its pending output, until there's a chunk's
+   worth or it's had all it asked for. */
+unsigned char Client_fill(Client* cl, const Jars* js, JarCache* cache)
+{
+	const char* cookie;
+	unsigned int jar_no;
+	JarMap* m;
+	size_t num_bytes;
+
+	while (cl->remaining && (cl->out_len < SERVER_OUTPUT_CHUNK)) {
+		jar_no = Jars_pick(js, cl->opts.e, &rng);
+		if (((m = JarCache_get(cache, jar_no)) == NULL)
+		    || !JarMap_cookie(m, Jar_draw(&(js->j[jar_no]), &rng),
+		                      &cookie, &num_bytes)) {
+			return 0;
+		}
+		if (cl->opts.c && (!Client_put(cl, m->jar->dir,
+		                               strlen(m->jar->dir))
+		                   || !Client_put(cl, m->jar->name,
+		                                  strlen(m->jar->name))
+		                   || !Client_put(cl, "\n%\n", 3))) {
+			return 0;
+		}
+		if (!Client_put(cl, cookie, num_bytes)) {
+			return 0;
+		}
+		if (cl->batch) {
+			/* Format a batch as -N does. */
+			if ((num_bytes && (cookie[num_bytes-1] != '\n')
+			     && !Client_put(cl, "\n", 1))
+			    || !Client_put(cl, "%\n", 2)) {
+				return 0;
+			}
+		}
+		cl->remaining--;
+	}
+	return 1;
+}
+
+void Client_free(Client* cl)
+{
+	close(cl->fd);
+	free(cl->out);
+	free(cl);
+}
+
+/* Deal with whatever's happened on the connection to `cl`: read its
+   request if it hasn't all arrived yet, then write it as much of the
+   answer as it'll take. Return 0 when the client's done with. */
+unsigned char Client_serve(Client* cl, const Jars* js, JarCache* cache)
+{
+	char* newline;
+	ssize_t num_read;
+	ssize_t written;
+
+	while (!cl->replying) {
+		num_read = read(cl->fd, cl->req + cl->req_len,
+		                SERVER_REQUEST_MAX - cl->req_len);
+		if (num_read < 0) {
+			return (errno == EAGAIN) || (errno == EINTR);
+		}
+		if (num_read == 0) {
+			return 0;
+		}
+		cl->req_len += num_read;
+		if ((newline = memchr(cl->req, '\n', cl->req_len)) == NULL) {
+			if (cl->req_len == SERVER_REQUEST_MAX) {
+				return 0;
+			}
+			continue;
+		}
+		cl->req_len = newline + 1 - cl->req;
+		cl->replying = 1;
+		if (!Client_parse(cl)) {
+			cl->remaining = 0;
+			Client_put(cl, "ERR Malformed request.\n", 23);
+		} else if (!Client_put(cl, "OK\n", 3)) {
+			return 0;
+		}
+	}
 
-	num_offsets_read = fread(offsets, sizeof(uint32_t), 2, fh);
-	offsets[0] = htonl(offsets[0]);
-	offsets[1] = htonl(offsets[1]);
-	if (num_offsets_read == 0) {
-		fprintf(stderr, "Cannot read offsets from data file %s.\n", dat);
-		return 0;
-	} else if (num_offsets_read == 1) {
-		/* There was only one offset left to be read in the dat file stream,
-		   stream, so that must have been the last offset in it, implying
-		   that offset refers to the last fortune cookie in the file. Set
-		   the 2nd offset to the fortune cookie file's size, indicating
-		   that this function should read from the first offset to EOF. */
-		offsets[1] = js->j[jar_no].file_size;
+	for (;;) {
+		if ((cl->out_pos == cl->out_len) && cl->remaining) {
+			cl->out_pos = 0;
+			cl->out_len = 0;
+			if (!Client_fill(cl, js, cache)) {
+				/* The client's already been told all's well, so the
+				   best that can be done is to hang up on it. */
+				return 0;
+			}
+		}
+		if (cl->out_pos == cl->out_len) {
+			return 0;
+		}
+		written = write(cl->fd, cl->out + cl->out_pos,
+		                cl->out_len - cl->out_pos);
+		if (written < 0) {
+			return (errno == EAGAIN) || (errno == EINTR);
+		}
+		cl->out_pos += written;
 	}
-	num_bytes = offsets[1] - offsets[0];
+}
 
-	if (fclose(fh)) {
-		fprintf(stderr, "Cannot close fortune data file %s.\n", dat);
-	}
+volatile sig_atomic_t server_stopping = 0;
 
-	if ((cookie_buf = malloc(num_bytes)) == NULL) {
-		fprintf(stderr, "Cannot allocate %lu bytes of memory "
-		        "for fortune cookie.\n", num_bytes);
-		return 0;
-	}
+void stop_server(int signal_number)
+{
+	(void) signal_number;
+	server_stopping = 1;
+}
 
-	last_dot_ptr = strrchr(dat, '.');
-	*last_dot_ptr = '\0';
+/* Listen on the Unix domain socket at `socket_path` and answer requests
+   for fortune cookies from `js` until interrupted. All the work's done
+   by a single thread, driven by epoll; the jars' files stay mapped
+   between requests (the least recently used being dropped if there
+   are too many to keep). */
+unsigned char serve(const Jars* js, const char* socket_path)
+{
+	struct sockaddr_un addr;
+	JarCache cache;
+	Client* cl;
+	int conn_fd;
+	struct epoll_event ev;
+	struct epoll_event events[SERVER_EVENTS];
+	int event_no;
+	int epoll_fd;
+	int listen_fd;
+	int num_events;
+	unsigned char ok = 1;
+	struct sigaction sa;
 
-	if ((fh = fopen(dat, "rb")) == NULL) {
-		fprintf(stderr, "Cannot open fortune cookie file %s.\n", dat);
-		*last_dot_ptr = '.';
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		report("Socket path %s is too long.\n", socket_path);
 		return 0;
 	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
 
-	if (fseek(fh, offsets[0], SEEK_SET)) {
-		fprintf(stderr, "Cannot seek in fortune file %s for cookie.\n", dat);
-		*last_dot_ptr = '.';
+	if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK
+	                                 | SOCK_CLOEXEC, 0)) < 0) {
+		report("Cannot create server socket.\n");
 		return 0;
 	}
-
-	if (fread(cookie_buf, num_bytes, 1, fh) != 1) {
-		fprintf(stderr, "Cannot read cookie from %s.\n", dat);
-		*last_dot_ptr = '.';
+	unlink(socket_path);
+	if (bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr))
+	    || listen(listen_fd, SOMAXCONN)) {
+		report("Cannot listen on socket %s.\n", socket_path);
+		close(listen_fd);
 		return 0;
 	}
-
-	/* strfile doesn't calculate offsets so as to exclude the delimiter
-	   character and newline, so check to see whether the read-in fortune
-	   cookie has a delimiter and newline at the end of it, and if so,
-	   deduct 2 from the cookie's byte count to hide them. Note the
-	   assumption of Unix-style line endings. */
-	if ((num_bytes >= 2) && (cookie_buf[num_bytes-2] == js->j[jar_no].delim)
-	    && (cookie_buf[num_bytes-1] == '\n')) {
-		num_bytes -= 2;
-	}
-
-	if (opts.c) {
-		printf("%s\n%%\n", dat);
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		report("Cannot create epoll instance.\n");
+		close(listen_fd);
+		unlink(socket_path);
+		return 0;
 	}
-
-	fwrite(cookie_buf, num_bytes, 1, stdout);
-	free(cookie_buf);
-
-	if (fclose(fh)) {
-		fprintf(stderr, "Cannot close fortune cookie file %s.\n", dat);
-		*last_dot_ptr = '.';
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+	if (!JarCache_init(&cache, js, (js->count < SERVER_CACHE_SLOTS)
+	                               ? js->count : SERVER_CACHE_SLOTS)) {
+		close(epoll_fd);
+		close(listen_fd);
+		unlink(socket_path);
 		return 0;
 	}
 
-	*last_dot_ptr = '.';
+	/* A client hanging up early mustn't kill the server, but SIGINT and
+	   SIGTERM should stop it cleanly, removing the socket. */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+	sa.sa_handler = stop_server;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
 
-	if (opts.w) {
-		/* Compute a time period for which to wait for the user to read
-		   the fortune cookie. Using the length of the entire cookie is a
-		   bad idea (it gives too long a waiting time for ASCII art);
-		   instead, use the number of lines, letters and numeric digits. */
-		for (byte_idx = 0; byte_idx < num_bytes; byte_idx++) {
-			if (isalpha(cookie_buf[byte_idx])) {
-				delay_time += 0.06;
-			} else if (isdigit(cookie_buf[byte_idx])) {
-				delay_time += 0.03;
-			} else if (cookie_buf[byte_idx] == '\n') {
-				delay_time += 0.07;
+	while (!server_stopping) {
+		num_events = epoll_wait(epoll_fd, events, SERVER_EVENTS, -1);
+		if (num_events < 0) {
+			if (errno == EINTR) {
+				continue;
 			}
+			report("Cannot wait for server events.\n");
+			ok = 0;
+			break;
 		}
-		delay_time = 1 + (unsigned int) (opts.w * delay_time);
-		sleep(delay_time);
-	}
-
-	return 1;
-}
-
-unsigned char paths_in_same_dir(const char* first, const char* second)
-{
-	char* p = strrchr(first, '/');
-	char* q = strrchr(second, '/');
+		for (event_no = 0; event_no < num_events; event_no++) {
+			if ((cl = events[event_no].data.ptr) != NULL) {
+				if (!Client_serve(cl, js, &cache)) {
+					Client_free(cl);
+				}
+				continue;
+			}
 
-	/* The paths need not have slashes in them. One or both of them
-	   might be the name of a file in the current directory. */
-	if ((p == NULL) || (q == NULL)) {
-		return (unsigned char) ((p == NULL) && (q == NULL));
+			/* The event's on the listening socket; take on all the
+			   new clients waiting. */
+			while ((conn_fd = accept4(listen_fd, NULL, NULL,
+			                          SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+				if ((cl = calloc(1, sizeof(Client))) == NULL) {
+					close(conn_fd);
+					continue;
+				}
+				cl->fd = conn_fd;
+				ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+				ev.data.ptr = cl;
+				if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn_fd, &ev)) {
+					Client_free(cl);
+				}
+			}
+		}
 	}
 
-	/* If the paths `first` & `second` both lead to the same directory,
-	   the string from `first` to `p` should now match the string from
-	   `second` to `q`. So, for one thing, those two string should be the
-	   same length; check that. Then check that the two strings match. */
-	if ((p - first) != (q - second)) {
-		return 0;
-	}
-	return (unsigned char) !memcmp(first, second, p - first);
+	/* Closing the epoll instance drops any clients still connected
+	   (without freeing them, since the process is about to end). */
+	JarCache_free(&cache);
+	close(epoll_fd);
+	close(listen_fd);
+	unlink(socket_path);
+	return ok;
 }
 
-/* Display the selection probability and short name of a Jar's file. */
-void Jar_chance(const Jar* j, const Jars* js, size_t dir_part_len, unsigned char e_opt)
+/* Connect to the fortune server listening on `socket_path`, returning
+   the connection's fd, or -1 if there's no server there. */
+int connect_to_server(const char* socket_path)
 {
-	float chance;
-	char* p;
-	char* path_end;
+	struct sockaddr_un addr;
+	int fd;
 
-	/* First the selection probability... */
-	if (e_opt) {
-		chance = 1.0 / (float) js->count;
-	} else {
-		chance = j->num_fortunes / (float) js->num_fortunes;
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		return -1;
 	}
-	printf("    %5.2f%% ", 100.0 * chance);
-
-	/* ...then the file's name. Since `j->dat` is the path to the dat
-	   file rather than the fortune file's name itself, shave the
-	   last four characters off the path before displaying it, to
-	   eliminate the superfluous ".dat". */
-	p = j->dat + dir_part_len;
-	path_end = p + 1;
-	while (*path_end) {
-		path_end++;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+		return -1;
 	}
-	for (; p < path_end - 4; p++) {
-		putchar(*p);
+	if (connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+		close(fd);
+		return -1;
 	}
-	putchar('\n');
+	return fd;
 }
 
-void Jars_list(const Jars* js, unsigned char e_opt)
+/* Ask the fortune server connected on `fd` for `count` fortune cookies,
+   and copy its answer to standard output. */
+unsigned char ask_server(int fd, Options opts, unsigned long count)
 {
-	unsigned char dir_already_noted;
-	unsigned int* dir_num_fortunes;
-	unsigned int dir_path_idx;
-	char** dir_paths;
-	size_t dir_part_len;
-	Jar* jar;
-	unsigned int jar_no;
-	char* last_slash;
-	unsigned int num_dir_paths;
+	char buf[65536];
+	size_t buf_len = 0;
+	struct iovec iov;
+	char* newline = NULL;
+	ssize_t num_read;
+	char request[64];
+	size_t request_len;
+	char* start;
 
-	if (!(js->count)) {
-		/* `js` has no jars. The caller should've handled this case
-		   itself -- when `js` is empty this function lacks the
-		   information to list the directories searched. */
-		return;
+	request_len = sprintf(request, "tfortune %s%s%s %lu\n",
+	                      (opts.c || opts.e) ? "" : "-",
+	                      opts.c ? "c" : "", opts.e ? "e" : "", count);
+	if (write(fd, request, request_len) != (ssize_t) request_len) {
+		report("Cannot send request to fortune server.\n");
+		close(fd);
+		return 0;
 	}
 
-	/* When it lists the available fortune files, this function has
-	   to group them by directory, even though the fortune files in a
-	   subdirectory might not be in a contiguous sequence in `js->j`.
-	   This function therefore has to bear the burden of grouping
-	   files itself.
-
-	   It begins this task by recording in `dir_paths` each unique
-	   subdirectory represented in `js->j`, and recording in
-	   `dir_num_fortunes` the total number of fortune cookies in each
-	   unique subdirectory. */
-	if ((dir_paths = malloc(js->count * sizeof(char*))) == NULL) {
-		fputs("Can't allocate memory for directory list.\n", stderr);
-		return;
-	}
-	if ((dir_num_fortunes = malloc(js->count * sizeof(unsigned int))) == NULL) {
-		fputs("Can't allocate memory for fortune cookie counts by directory.\n", stderr);
-		free(dir_paths);
-		return;
-	}
-	dir_paths[0] = js->j[0].dat;
-	dir_num_fortunes[0] = js->j[0].num_fortunes;
-	num_dir_paths = 1;
-	for (jar_no = 1; jar_no < js->count; jar_no++) {
-		jar = &(js->j[jar_no]);
-		dir_already_noted = 0;
-		for (dir_path_idx = 0; dir_path_idx < num_dir_paths; dir_path_idx++) {
-			if (paths_in_same_dir(dir_paths[dir_path_idx], jar->dat)) {
-				dir_num_fortunes[dir_path_idx] += jar->num_fortunes;
-				dir_already_noted = 1;
-				break;
-			}
-		}
-		if (!dir_already_noted) {
-			dir_paths[num_dir_paths] = jar->dat;
-			dir_num_fortunes[num_dir_paths] = jar->num_fortunes;
-			num_dir_paths++;
+	/* Read the server's status line, then pass the rest straight on. */
+	while ((newline == NULL) && (buf_len < sizeof(buf))) {
+		if ((num_read = read(fd, buf + buf_len, sizeof(buf) - buf_len))
+		    <= 0) {
+			break;
 		}
+		buf_len += num_read;
+		newline = memchr(buf, '\n', buf_len);
 	}
-
-	/* Now `dir_paths` contains a pointer to a path in every unique
-	   subdirectory represented in `js->j`, it's time to iterate over that
-	   list of paths, extracting each subdirectory, picking out the fortune
-	   files in it, computing the subdirectory's total selection
-	   probability, displaying that and the subdirectory's path, then
-	   listing the files in that subdir. and their probabilities. */
-	for (dir_path_idx = 0; dir_path_idx < num_dir_paths; dir_path_idx++) {
-		if (js->num_fortunes) {
-			if (e_opt) {
-				printf("%5.2f%% ", 100.0 / (float) num_dir_paths);
-			} else {
-				printf("%5.2f%% ", 100.0 * dir_num_fortunes[dir_path_idx]
-				                   / (float) js->num_fortunes);
-			}
+	if ((newline == NULL) || (newline - buf != 2) || memcmp(buf, "OK", 2)) {
+		if (newline != NULL) {
+			report("Fortune server says: %.*s\n",
+			       (int) (newline - buf), buf);
 		} else {
-			printf("  0.00%% ");
+			report("No answer from fortune server.\n");
 		}
-		last_slash = strrchr(dir_paths[dir_path_idx], '/');
-		if (last_slash != NULL) {
-			dir_part_len = last_slash - dir_paths[dir_path_idx] + 1;
-			fwrite(dir_paths[dir_path_idx], dir_part_len, 1, stdout);
-			putchar('\n');
-		} else {
-			dir_part_len = 0;
-			puts("./");
+		close(fd);
+		return 0;
+	}
+	start = newline + 1;
+	num_read = buf + buf_len - start;
+	for (;;) {
+		iov.iov_base = start;
+		iov.iov_len = num_read;
+		if (num_read && !writev_all(STDOUT_FILENO, &iov, 1)) {
+			report("Cannot write fortune cookie.\n");
+			close(fd);
+			return 0;
 		}
-		for (jar_no = 0; jar_no < js->count; jar_no++) {
-			jar = &(js->j[jar_no]);
-			if (paths_in_same_dir(dir_paths[dir_path_idx], jar->dat)) {
-				Jar_chance(jar, js, dir_part_len, e_opt);
-			}
+		if ((num_read = read(fd, buf, sizeof(buf))) <= 0) {
+			break;
 		}
+		start = buf;
 	}
-
-	free(dir_num_fortunes);
-	free(dir_paths);
+	close(fd);
+	return num_read == 0;
 }
 
-void Jars_free(Jars* js)
+/* If `arg` starts with a percentage, as fortune takes them ("30%", to
+   apply to the next argument, or "30%path"), put it in `percent` (or
+   101 for anything over 100) and the rest of `arg` in `rest`. */
+unsigned char parse_percent(const char* arg, unsigned int* percent,
+                            const char** rest)
 {
-	unsigned int jar_no;
+	unsigned int value = 0;
 
-	if (js->j != NULL) {
-		for (jar_no = 0; jar_no < js->count; jar_no++) {
-			free(js->j[jar_no].dat);
+	if (!isdigit((unsigned char) *arg)) {
+		return 0;
+	}
+	for (; isdigit((unsigned char) *arg); arg++) {
+		value = value * 10 + (*arg - '0');
+		if (value > 100) {
+			value = 101;
 		}
-		free(js->j);
-		js->j = NULL;
 	}
-	js->count = 0;
-	js->capacity = 0;
+	if (*arg != '%') {
+		return 0;
+	}
+	*percent = value;
+	*rest = arg + 1;
+	return 1;
 }
 
-unsigned char ends_with_dot_dat(const char* s)
+/* Parse `arg` as a decimal number, putting it in `value`. Return 0 if
+   `arg` is empty, has anything but digits in it, or is out of range. */
+unsigned char parse_number(const char* arg, uint64_t* value)
 {
-	unsigned int len = strlen(s);
-	if (len < 4) {
+	char* end;
+
+	if (!isdigit((unsigned char) *arg)) {
 		return 0;
 	}
-	return ((s[len-4] == '.') && (s[len-3] == 'd')
-	        && (s[len-2] == 'a') && (s[len-1] == 't'));
+	errno = 0;
+	*value = strtoull(arg, &end, 10);
+	return !*end && !errno;
 }
 
-unsigned char is_dot_or_dot_dot(const char* s)
+struct TfCorpus {
+	Jars js;
+	unsigned char e;  /* whether the jars are all equally likely */
+};
+
+void tf_set_report(TfReportFn fn, void* arg)
 {
-	if (s[0] != '.') {
-		return 0;
-	}
-	return (s[1] == '\0') || ((s[1] == '.') && (s[2] == '\0'));
+	report_fn = fn;
+	report_arg = arg;
 }
 
-unsigned char Jars_build_dat_file_path_and_add(Jars* js, const char* path)
+TfCorpus* TfCorpus_open(const char* const* paths, unsigned int num_paths,
+                        unsigned int flags)
 {
-	char* dat_file_path;
-	size_t dat_file_path_len = 5 + strlen(path);
+	TfCorpus* corpus;
+	unsigned int first_jar;
+	unsigned int jar_no;
+	Options opts;
+	unsigned int path_no;
+	WalkOptions wopts;
 
-	if ((dat_file_path = malloc(dat_file_path_len)) == NULL) {
-		fprintf(stderr, "Cannot allocate %lu bytes for data file path.\n",
-		        dat_file_path_len);
-		return 0;
+	if ((corpus = malloc(sizeof(TfCorpus))) == NULL) {
+		report("Cannot allocate memory for fortune corpus.\n");
+		return NULL;
+	}
+	if (!Jars_init(&(corpus->js), 99)) {
+		report("Cannot initialize list of fortune cookie files.\n");
+		free(corpus);
+		return NULL;
 	}
+	wopts.threads = default_walk_threads();
+	wopts.index = 0;
+	wopts.lazy = 0;
+	wopts.uring = 1;
+	wopts.sample = 0;
+	memset(&opts, 0, sizeof(Options));
+	opts.e = corpus->e = (flags & TF_EQUAL) != 0;
 
-	strcpy(dat_file_path, path);
-	strcat(dat_file_path, ".dat");
+	if (num_paths) {
+		for (path_no = 0; path_no < num_paths; path_no++) {
+			first_jar = corpus->js.count;
+			walk_for_fortune_files(paths[path_no], &(corpus->js), NULL,
+			                       &wopts);
 
-	if (!Jars_add(js, dat_file_path)) {
-		fprintf(stderr, "Cannot add %s to data file list.\n", dat_file_path);
-		free(dat_file_path);
-		return 0;
+			/* Only for Jars_drop_duplicates(); there are no groups to
+			   weigh. */
+			for (jar_no = first_jar; jar_no < corpus->js.count; jar_no++) {
+				corpus->js.j[jar_no].group = path_no;
+			}
+		}
+	} else {
+		walk_for_fortune_files(DEFAULT_FORTUNE_FILE_DIR, &(corpus->js), NULL,
+		                       &wopts);
 	}
+	if (!(flags & TF_ALL)) {
+		Jars_keep_offensive(&(corpus->js), (flags & TF_OFFENSIVE) != 0);
+	}
+	Jars_drop_duplicates(&(corpus->js));
+	if ((!opts.e && corpus->js.num_fortunes
+	     && !Jars_build_alias(&(corpus->js)))
+	    || !Jars_ready(&(corpus->js), opts)) {
+		TfCorpus_close(corpus);
+		return NULL;
+	}
+	return corpus;
+}
 
-	free(dat_file_path);
-	return 1;
+unsigned long TfCorpus_count(const TfCorpus* corpus)
+{
+	return corpus->js.num_fortunes;
 }
 
-unsigned char walk_for_fortune_files(const char* init_path, Jars* js)
+void TfRng_seed(TfRng* r, uint64_t seed)
 {
-	char* cur_dir;
-	char* cur_path = NULL;
-	size_t cur_path_alloc = 0;
-	size_t cur_path_needing_alloc;
-	unsigned int depth = 1;
-	Dire* dirs;
-	unsigned int dir_slots = 2;
-	struct stat info_about_path;
-	char* last_slash_ptr;
+	Rng_seed(r, seed);
+}
 
-	/* Allocate initial memory for the directory hierarchy. */
-	if ((dirs = malloc(dir_slots * sizeof(Dire))) == NULL) {
-		fputs("Cannot allocate directory record memory.\n", stderr);
-		return 0;
-	}
+/* Nothing a draw touches but `r` and `cookie` is written to, and each
+   draw maps its jar's files for itself, so draws from one corpus can
+   go on in several threads at once. */
+unsigned char TfCorpus_draw(const TfCorpus* corpus, TfRng* r,
+                            TfCookie* cookie)
+{
+	uint32_t cookie_no;
+	unsigned int jar_no;
+	JarMap m;
+	char* new_buf;
+	size_t num_bytes;
+	const char* text;
 
-	/* Try opening the initial path as a directory. */
-	if ((dirs[0].d = opendir(init_path)) == NULL) {
-		/* The initial path wouldn't open as a directory. It could be
-		   non-existent or totally inaccessible, but it could just be a
-		   user-supplied path to a single fortune file. Try treating it
-		   as the latter. But first free the memory for the directory
-		   hierarchy, which won't be needed as no directory traversal
-		   will take place. */
-		free(dirs);
-		if (stat(init_path, &info_about_path)) {
-			fprintf(stderr, "Cannot access information about path %s.\n",
-			        init_path);
-			return 0;
-		}
-		if (S_ISREG(info_about_path.st_mode)) {
-			/* The starting path is indeed merely an ordinary file.
-			   Presumably it's a specific fortune cookie file the user
-			   wants to use; try adding the path to the list of
-			   fortune files. */
-			return Jars_build_dat_file_path_and_add(js, init_path);
-		}
+	Jars_draw(&(corpus->js), corpus->e, r, &jar_no, &cookie_no);
+	if (!JarMap_open(&m, &(corpus->js.j[jar_no]))) {
 		return 0;
 	}
-
-	if ((cur_dir = malloc(strlen(init_path) + 1 + dir_slots * (NAME_MAX+1))) == NULL) {
-		fputs("Cannot allocate directory name memory.\n", stderr);
-		free(dirs);
+	if (!JarMap_cookie(&m, cookie_no, &text, &num_bytes)) {
+		JarMap_close(&m);
 		return 0;
 	}
-	strcpy(cur_dir, init_path);
-
-	/* Recursively traverse directories, depth-first, looking for fortune
-	   cookie files (and of course subdirectories). */
-	while (depth) {
-
-		/* Iterate over every filesystem entry in the current directory. */
-		while ((dirs[depth-1].en = readdir(dirs[depth-1].d)) != NULL) {
-
-			/* Skip the filesystem entries ./ and ../. */
-			if (is_dot_or_dot_dot(dirs[depth-1].en->d_name)) {
-				continue;
-			}
-
-			/* If necessary, (re)allocate memory for the current filesystem
-			   entry's full path. Allocation length explanation: length of
-			   the nonzero bytes in `cur_dir`, plus length of the nonzero
-			   bytes in `cur_path`, plus 2 bytes for the terminating zero
-			   byte and '/' separator. */
-			cur_path_needing_alloc = 2 + strlen(cur_dir)
-			                         + strlen(dirs[depth-1].en->d_name);
-			if (cur_path_needing_alloc > cur_path_alloc) {
-				if ((cur_path = realloc(cur_path, cur_path_needing_alloc)) == NULL) {
-					fprintf(stderr,
-					        "Cannot reallocate %lu bytes for file path.\n",
-					        cur_path_needing_alloc);
-					free(dirs);
-					free(cur_dir);
-					if (cur_path != NULL) {
-						free(cur_path);
-					}
-					return 0;
-				}
-			}
+	if (num_bytes + 1 > cookie->buf_size) {
+		if ((new_buf = realloc(cookie->buf, num_bytes + 1)) == NULL) {
+			report("Cannot allocate memory for fortune cookie.\n");
+			JarMap_close(&m);
+			return 0;
+		}
+		cookie->buf = new_buf;
+		cookie->buf_size = num_bytes + 1;
+	}
+	memcpy(cookie->buf, text, num_bytes);
+	cookie->buf[num_bytes] = '\0';
+	JarMap_close(&m);
 
-			/* Build the full path of the current filesystem entry. */
-			strcpy(cur_path, cur_dir);
-			if (cur_dir[strlen(cur_dir) - 1] != '/') {
-				strcat(cur_path, "/");
-			}
-			strcat(cur_path, dirs[depth-1].en->d_name);
+	cookie->text = cookie->buf;
+	cookie->len = num_bytes;
+	cookie->dir = corpus->js.j[jar_no].dir;
+	cookie->name = corpus->js.j[jar_no].name;
+	return 1;
+}
 
-			/* With the full path in a string, it's finally possible to
-			   see what exactly is at the path. */
-			if (stat(cur_path, &info_about_path)) {
-				/* Then again, maybe it's still not possible.
-				   (This can happen if the program gets trapped by a
-				   cyclic path produced by a link -- eventually `stat`
-				   throws the program for an `ELOOP`.) */
-				fprintf(stderr, "Cannot access information about path %s.\n",
-				        cur_path);
-				continue;
-			}
+void TfCookie_free(TfCookie* cookie)
+{
+	free(cookie->buf);
+	memset(cookie, 0, sizeof(TfCookie));
+}
 
-			if (S_ISDIR(info_about_path.st_mode)) {
-				/* `cur_path` points to a subdirectory. Turn attention to
-				   that, allocating further memory if needed. */
-				if (depth == dir_slots) {
-					dir_slots *= 2;
-					if ((dirs = realloc(dirs, dir_slots * sizeof(Dire))) == NULL) {
-						fputs("Cannot reallocate directory record memory.\n",
-						      stderr);
-						free(dirs);
-						free(cur_dir);
-						if (cur_path != NULL) {
-							free(cur_path);
-						}
-						return 0;
-					}
-					if ((cur_dir = realloc(cur_dir, strlen(cur_dir) + 1 + (NAME_MAX+1) * dir_slots)) == NULL) {
-						fputs("Cannot reallocate directory name memory.\n",
-						      stderr);
-						free(dirs);
-						free(cur_dir);
-						if (cur_path != NULL) {
-							free(cur_path);
-						}
-						return 0;
-					}
-				}
-				if (cur_dir[strlen(cur_dir) - 1] != '/') {
-					strcat(cur_dir, "/");
-				}
-				strcat(cur_dir, dirs[depth-1].en->d_name);
-				if ((dirs[depth].d = opendir(cur_dir)) == NULL) {
-					/* The directory at `cur_dir` couldn't be opened.
-					   Try to chop the inaccessible subdirectory off
-					   the end of the current path and press on. */
-					fprintf(stderr, "Cannot open directory %s.\n", cur_dir);
-					last_slash_ptr = strrchr(strrchr(cur_dir, '/'), '/');
-					if (last_slash_ptr != NULL) {
-						*last_slash_ptr = '\0';
-						break;
-					} else {
-						/* I don't see how the flow of execution
-						   could ever arrive here, but if it
-						   somehow does, fail safely. */
-						free(dirs);
-						free(cur_dir);
-						if (cur_path != NULL) {
-							free(cur_path);
-						}
-						return 0;
-					}
-				}
-				depth++;
-			} else {
-				/* `cur_path` points to a file. The files of interest here
-				   are strfile-generated .dat files, which presumably
-				   correspond to fortune files. Check that the file's name
-				   ends in ".dat"; if it does, add it to the list of such
-				   files, otherwise skip it. */
-				if (!ends_with_dot_dat(dirs[depth-1].en->d_name)) {
-					continue;
-				}
-				if (!Jars_add(js, cur_path)) {
-					fprintf(stderr, "Cannot add %s to data file list.\n",
-					        cur_path);
-				}
-			}
-		}
+void TfCorpus_close(TfCorpus* corpus)
+{
+	Jars_free(&(corpus->js));
+	free(corpus);
+}
 
-		/* Having exhausted this (sub)directory's contents, close it and
-		   return attention to the parent directory. */
-		if (closedir(dirs[depth-1].d)) {
-			fprintf(stderr, "Cannot close directory stream for %s.\n",
-			        cur_dir);
-		}
-		last_slash_ptr = strrchr(cur_dir, '/');
-		if (last_slash_ptr != NULL) {
-			*last_slash_ptr = '\0';
-		}
-		depth--;
+/* The library leaves out tfortune's own main(). */
+#ifndef TFORTUNE_LIBRARY
 
-	}
+/* The jar catalog this run used, if any. */
+const char* catalog_path = NULL;
 
-	free(dirs);
-	free(cur_dir);
-	if (cur_path != NULL) {
-		free(cur_path);
+/* If any jar turned out to be newer than the jar catalog says, delete
+   the catalog, so the next run that uses it rescans everything. */
+void drop_stale_catalog(void)
+{
+	if (__atomic_load_n(&stale_catalog, __ATOMIC_RELAXED)
+	    && unlink(catalog_path) && (errno != ENOENT)) {
+		report("Cannot remove out-of-date jar catalog %s.\n",
+		       catalog_path);
 	}
-
-	return 1;
 }
 
 int main(int argc, char* argv[])
 {
+	Catalog cat;
+	const char* cat_path = getenv("TFORTUNE_CATALOG");
+	unsigned char cat_path_given = 0;
+	const char* client_socket = getenv("TFORTUNE_SOCKET");
+	unsigned char client_socket_given = 0;
+	unsigned int first_jar;
+	JarGroup* g;
 	int getopt_option;
+	unsigned int group_no;
+	JarGroup* groups;
+	unsigned int jar_no;
 	Jars js;
-	unsigned int orig_optind;
+	const char* match_pattern = NULL;
+	unsigned long num_cookies = 1;
+	unsigned int num_groups = 0;
+	unsigned int num_weighted = 0;
+	uint64_t number;
+	unsigned int percent_total = 0;
+	unsigned long short_len = DEFAULT_SHORT_LEN;
 	Options opts;
+	const char* pack_path = NULL;
+	unsigned int prev_phase;
+	uint64_t seed = 0;
+	unsigned char seed_given = 0;
+	Seen seen;
+	const char* seen_path = getenv("TFORTUNE_SEEN");
+	unsigned char seen_path_given = 0;
+	int server_fd;
+	const char* server_socket = NULL;
+	struct timespec start;
+	WalkOptions wopts;
+	unsigned char z_opt = 0;
 
 	/* Initialize the list of fortune cookie files with enough memory to
 	   store metadata for 99 files. (More memory will be allocated for
 	   the list later if needed.) */
 	if (!Jars_init(&js, 99)) {
-		fputs("Cannot initialize list of fortune cookie files.\n", stderr);
+		report("Cannot initialize list of fortune cookie files.\n");
 		return EXIT_FAILURE;
 	}
 
 	/* Initialize the list of command-line options with default values. */
+	wopts.threads = default_walk_threads();
+	wopts.index = 0;
+	wopts.lazy = 0;
+	wopts.uring = 1;
+	opts.a = 0;
 	opts.c = 0;
 	opts.e = 0;
 	opts.f = 0;
+	opts.F = 0;
+	opts.l = 0;
+	opts.o = 0;
+	opts.s = 0;
+	opts.S = 0;
 	opts.w = 0;
 
 	/* Interpret command-line flags. */
-	while ((getopt_option = getopt(argc, argv, "cefw")) != -1) {
+	while ((getopt_option = getopt(argc, argv, "acd:D:efFIj:k:lLm:n:N:oP:r:R:sSTwxz")) != -1) {
 		switch (getopt_option) {
+		case 'a': opts.a = 1; break;
 		case 'c': opts.c = 1; break;
+		case 'd':
+			client_socket = optarg;
+			client_socket_given = 1;
+			break;
+		case 'D': server_socket = optarg; break;
 		case 'e': opts.e = 1; break;
 		case 'f': opts.f = 1; break;
+		case 'F': opts.f = 1; opts.F = 1; break;
+		case 'I': wopts.index = (wopts.index > 1) ? wopts.index : 1; break;
+		case 'j':
+			if (!parse_number(optarg, &number) || !number) {
+				report("Cannot traverse with %s threads.\n", optarg);
+				goto usage;
+			}
+			wopts.threads = (number > MAX_WALK_THREADS) ? MAX_WALK_THREADS
+			                                            : number;
+			break;
+		case 'k':
+			cat_path = optarg;
+			cat_path_given = 1;
+			break;
+		case 'l': opts.l = 1; break;
+		case 'L': wopts.lazy = 1; break;
+		case 'm': match_pattern = optarg; break;
+		case 'n':
+			if (!parse_number(optarg, &number) || (number > ULONG_MAX)) {
+				report("Cannot count %s bytes as short.\n", optarg);
+				goto usage;
+			}
+			short_len = number;
+			break;
+		case 'N':
+			if (!parse_number(optarg, &number) || !number
+			    || (number > ULONG_MAX)) {
+				report("Cannot write %s fortune cookies.\n", optarg);
+				goto usage;
+			}
+			num_cookies = number;
+			break;
+		case 'o': opts.o = 1; break;
+		case 'P': pack_path = optarg; break;
+		case 'r':
+			seen_path = optarg;
+			seen_path_given = 1;
+			break;
+		case 'R':
+			if (!parse_number(optarg, &seed)) {
+				report("Cannot seed with %s.\n", optarg);
+				goto usage;
+			}
+			seed_given = 1;
+			break;
+		case 's': opts.s = 1; break;
+		case 'S': opts.S = 1; break;
+		case 'T': stats.enabled = 1; break;
 		case 'w': opts.w++; break;  /* lengthen wait with each "-w" */
+		case 'x': wopts.index = 2; break;
+		case 'z': z_opt = 1; break;
 		default:
-			fprintf(stderr, "Usage: %s [-cefw]\n", argv[0]);
+		usage:
+			report("Usage: %s [-cefFILSTwxz] [-a | -o] [-l | -s] "
+			       "[-d socket | -D socket] [-j threads] [-k catalog] "
+			       "[-m pattern] [-n length] [-N count] [-P pack] "
+			       "[-r state] [-R seed]\n", argv[0]);
+		return EXIT_FAILURE;
+		}
+	}
+	if (opts.l && opts.s) {
+		report("Cannot draw only long and only short fortune cookies at "
+		       "once.\n");
+		return EXIT_FAILURE;
+	}
+	if (opts.a && opts.o) {
+		report("Cannot choose from all fortune files and only offensive "
+		       "ones at once.\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Gather the remaining arguments, which should be paths, each
+	   perhaps preceded by the percentage of the time to choose from
+	   it. Whatever the paths given percentages leave over goes to the
+	   rest, so they can't add up to more than 100%, or (if there isn't
+	   any rest) less. */
+	if ((groups = malloc((argc - optind + 1) * sizeof(JarGroup))) == NULL) {
+		report("Cannot allocate memory for fortune file paths.\n");
+		return EXIT_FAILURE;
+	}
+	for (; optind < argc; optind++) {
+		g = &(groups[num_groups++]);
+		g->weighted = 0;
+		g->percent = 0;
+		g->path = argv[optind];
+		if (parse_percent(argv[optind], &(g->percent), &(g->path))) {
+			if ((*(g->path) == '\0') && (++optind == argc)) {
+				report("Cannot weight fortune files by %u%% without naming "
+				       "them.\n", g->percent);
+				return EXIT_FAILURE;
+			} else if (*(g->path) == '\0') {
+				g->path = argv[optind];
+			}
+			g->weighted = 1;
+			num_weighted++;
+			percent_total += g->percent;
+		}
+	}
+	if (percent_total > 100) {
+		report("Cannot weight fortune files by more than 100%% in all.\n");
+		return EXIT_FAILURE;
+	}
+	if (num_weighted && (num_weighted == num_groups)
+	    && (percent_total < 100)) {
+		report("Cannot weight fortune files by only %u%% in all.\n",
+		       percent_total);
 		return EXIT_FAILURE;
+	}
+
+	/* Drawing without repeats is from all the cookies uniformly, which
+	   doesn't go with weighting the files differently or drawing from
+	   only some cookies, or with a server's shared state. If the state
+	   file was only named by the environment, do without it. */
+	if ((seen_path != NULL) && (*seen_path == '\0')) {
+		seen_path = NULL;
+	}
+	if ((seen_path != NULL) && (opts.e || opts.l || opts.s || num_weighted
+	                            || (server_socket != NULL)
+	                            || (client_socket_given
+	                                && (*client_socket != '\0')))) {
+		if (seen_path_given) {
+			report("Cannot avoid repeating fortune cookies with -e, -l, "
+			       "-s, -d, -D or percentages.\n");
+			return EXIT_FAILURE;
+		}
+		seen_path = NULL;
+	}
+
+	/* If there's a fortune server to ask, ask it, and don't bother
+	   looking for fortune files at all. If the server was only named
+	   by the environment, and can't be reached (or can't do what's
+	   asked), quietly do without it. */
+	if ((client_socket != NULL) && (*client_socket != '\0')
+	    && (server_socket == NULL) && (pack_path == NULL) && !z_opt) {
+		if (client_socket_given && opts.f) {
+			report("Cannot list fortune files via a fortune server.\n");
+			return EXIT_FAILURE;
+		}
+		if (client_socket_given && (match_pattern != NULL)) {
+			report("Cannot search fortune files via a fortune server.\n");
+			return EXIT_FAILURE;
+		}
+		if (client_socket_given && (opts.l || opts.s)) {
+			report("Cannot choose cookie lengths via a fortune server.\n");
+			return EXIT_FAILURE;
+		}
+		if (client_socket_given && num_weighted) {
+			report("Cannot weight fortune files via a fortune server.\n");
+			return EXIT_FAILURE;
+		}
+		if (client_socket_given && (opts.a || opts.o)) {
+			report("Cannot choose offensive fortune files via a fortune "
+			       "server.\n");
+			return EXIT_FAILURE;
+		}
+		if (client_socket_given && num_groups) {
+			report("Cannot choose fortune file paths via a fortune "
+			       "server.\n");
+			return EXIT_FAILURE;
+		}
+		if (client_socket_given && seed_given) {
+			report("Cannot seed a fortune server's choices.\n");
+			return EXIT_FAILURE;
+		}
+		if (client_socket_given
+		    && (cat_path_given || wopts.index || wopts.lazy)) {
+			report("Cannot change how a fortune server finds fortune "
+			       "files.\n");
+			return EXIT_FAILURE;
+		}
+		if ((client_socket_given
+		     || (!opts.f && !opts.w && (match_pattern == NULL) && !opts.l
+		         && !opts.s && !opts.a && !opts.o && !num_groups
+		         && (seen_path == NULL) && !seed_given && !cat_path_given
+		         && !wopts.index && !wopts.lazy))
+		    && ((server_fd = connect_to_server(client_socket)) >= 0)) {
+			return ask_server(server_fd, opts, num_cookies)
+			       ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+		if (client_socket_given) {
+			report("Cannot connect to fortune server %s.\n",
+			       client_socket);
+			return EXIT_FAILURE;
 		}
 	}
 
-	/* Process remaining arguments, which should be paths. */
-	orig_optind = optind;
-	if (optind < argc) {
-		while (optind < argc) {
-			walk_for_fortune_files(argv[optind++], &js);
+	/* With -T, report on each phase's work however the run ends. */
+	if (stats.enabled) {
+		atexit(stats_report);
+	}
+
+	/* To draw just one cookie, from jars chosen among as a whole, the
+	   jar it'll come from can be sampled while walking, rather than
+	   every jar being kept till the end; see Jars_sample(). */
+	if (!seed_given) {
+		seed = time(NULL) ^ ((uint64_t) getpid() << 32) ^ getppid();
+	}
+	wopts.sample = !opts.f && (pack_path == NULL) && !z_opt
+	               && (match_pattern == NULL) && (server_socket == NULL)
+	               && (seen_path == NULL) && (num_cookies == 1)
+	               && !num_weighted && !opts.l && !opts.s;
+	wopts.uniform = opts.e;
+	wopts.offensive = opts.a ? 2 : opts.o;
+	wopts.seed = seed;
+
+	/* If there's a jar catalog to use (an empty path means don't), load
+	   the results of the last run's directory traversal from it. */
+	prev_phase = stats_enter(PHASE_TRAVERSAL, &start);
+	if ((cat_path != NULL) && (*cat_path == '\0')) {
+		cat_path = NULL;
+	}
+	if (cat_path != NULL) {
+		Catalog_init(&cat, cat_path, wopts.index | (wopts.lazy << 2));
+		Catalog_load(&cat);
+		catalog_path = cat_path;
+		atexit(drop_stale_catalog);
+	}
+
+	/* Look for fortune files under each path, noting each jar's group
+	   as it's found. The groups are only kept if any of them was given
+	   a percentage; otherwise, all the jars are chosen from together. */
+	if (num_groups) {
+		for (group_no = 0; group_no < num_groups; group_no++) {
+			first_jar = js.count;
+			walk_for_fortune_files(groups[group_no].path, &js,
+			                       cat_path ? &cat : NULL, &wopts);
+			if (wopts.sample) {
+				Jars_sample(&js, &wopts);
+			}
+			for (jar_no = first_jar; jar_no < js.count; jar_no++) {
+				js.j[jar_no].group = group_no;
+			}
 		}
 	} else {
-		walk_for_fortune_files(DEFAULT_FORTUNE_FILE_DIR, &js);
+		walk_for_fortune_files(DEFAULT_FORTUNE_FILE_DIR, &js,
+		                       cat_path ? &cat : NULL, &wopts);
+		if (wopts.sample) {
+			Jars_sample(&js, &wopts);
+		}
+	}
+	if (num_weighted) {
+		js.groups = groups;
+		js.num_groups = num_groups;
+	}
+
+	if (cat_path != NULL) {
+		Catalog_save(&cat);
+		Catalog_free(&cat);
+	}
+
+	/* Like fortune, leave out offensive fortune files unless asked. */
+	if (!opts.a) {
+		Jars_keep_offensive(&js, opts.o);
+	}
+	Jars_drop_duplicates(&js);
+	stats_leave(prev_phase, &start);
+
+	if (pack_path != NULL) {
+		/* The user wants the fortune files packed up, not sampled. */
+		if (!Jars_pack(&js, pack_path)) {
+			report("Failed to pack the fortune cookie files.\n");
+			return EXIT_FAILURE;
+		}
+		Jars_free(&js);
+		return EXIT_SUCCESS;
+	}
+	if (z_opt) {
+		/* The user wants the fortune files compressed, not sampled. */
+		if (!Jars_compress(&js)) {
+			report("Failed to compress the fortune cookie files.\n");
+			return EXIT_FAILURE;
+		}
+		Jars_free(&js);
+		return EXIT_SUCCESS;
 	}
 
 	if (opts.f) {
 		/* The user wants a list of files from which fortune cookies
 		   would be sampled, not a fortune cookie itself. */
 		if (js.count) {
-			Jars_list(&js, opts.e);
+			if (js.num_groups) {
+				Jars_weigh_groups(&js);
+			}
+			Jars_list(&js, opts.e, opts.F);
 			Jars_free(&js);
-		} else {
-			for (optind = orig_optind; optind < argc; optind++) {
-				printf("  0.00%% %s\n", argv[optind]);
+		} else if (!opts.F) {
+			for (group_no = 0; group_no < num_groups; group_no++) {
+				printf("  0.00%% %s\n", groups[group_no].path);
 			}
 		}
 		return EXIT_SUCCESS;
 	}
+	if (!num_weighted) {
+		free(groups);
+	}
+
+	if (match_pattern != NULL) {
+		/* The user wants every fortune cookie matching a pattern. */
+		if (!Jars_search(&js, match_pattern, wopts.threads)) {
+			report("Failed to search the fortune cookie files.\n");
+			return EXIT_FAILURE;
+		}
+		Jars_free(&js);
+		return EXIT_SUCCESS;
+	}
 
-	/* Seed the PRNG, display a random fortune, then free the memory
-	   allocated for the list of fortune files before finishing. */
-	srand(time(NULL) + getpid() + getppid());
-	if (!Jars_fortune(&js, opts)) {
-		fputs("Failed to pick out a fortune cookie.\n", stderr);
+	/* Seed the PRNG, display a random fortune (or as many as were asked
+	   for), then free the memory allocated for the list of fortune
+	   files before finishing. */
+	Rng_seed(&rng, seed);
+	prev_phase = stats_enter(PHASE_SELECTION, &start);
+	if ((opts.l || opts.s) && js.count
+	    && !Jars_restrict_lengths(&js, opts.l, short_len)) {
+		return EXIT_FAILURE;
+	}
+	if ((!opts.e || server_socket || js.num_groups) && js.num_fortunes
+	    && !Jars_build_alias(&js)) {
+		report("Failed to weight the fortune cookie files.\n");
+		return EXIT_FAILURE;
+	}
+	stats_leave(prev_phase, &start);
+	if (server_socket != NULL) {
+		if (!Jars_ready(&js, opts) || !serve(&js, server_socket)) {
+			report("Failed to run fortune server.\n");
+			return EXIT_FAILURE;
+		}
+		Jars_free(&js);
+		return EXIT_SUCCESS;
+	}
+	if ((seen_path != NULL) && js.num_fortunes) {
+		if (!Seen_open(&seen, seen_path, &js)) {
+			return EXIT_FAILURE;
+		}
+		js.seen = &seen;
+	}
+	if (num_cookies != 1) {
+		if (!Jars_fortunes(&js, opts, num_cookies)) {
+			report("Failed to pick out fortune cookies.\n");
+			return EXIT_FAILURE;
+		}
+	} else if (!Jars_fortune(&js, opts)) {
+		report("Failed to pick out a fortune cookie.\n");
 		return EXIT_FAILURE;
 	}
+	if (js.seen != NULL) {
+		Seen_close(&seen);
+	}
 	Jars_free(&js);
 
 	return EXIT_SUCCESS;
 }
+#endif